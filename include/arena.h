@@ -0,0 +1,73 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 32768    // First block, reused across requests
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+/**
+ * @struct Arena
+ * @brief Bump allocator for per-connection, per-request state.
+ *
+ * Allocations are never freed individually. arena_reset() releases
+ * everything at once between requests, keeping the first block so a
+ * connection serving ordinary requests does not touch malloc at all.
+ */
+typedef struct ArenaCleanup {
+    struct ArenaCleanup* next;
+    void (*fn)(void* ctx);
+    void* ctx;
+} ArenaCleanup;
+
+typedef struct Arena {
+    ArenaBlock* head;     // Block currently allocated from
+    ArenaBlock* first;    // Retained across resets
+    size_t block_size;
+    ArenaCleanup* cleanups;    // Run by the next reset, newest first
+} Arena;
+
+/**
+ * @struct StrBuf
+ * @brief Growable string living in an arena, always NUL-terminated.
+ */
+typedef struct StrBuf {
+    Arena* arena;
+    char* data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+void arena_init(Arena* arena, size_t block_size);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+
+/**
+ * @brief Returns size bytes aligned for any type, or NULL if out of memory.
+ */
+void* arena_alloc(Arena* arena, size_t size);
+/**
+ * @brief Calls fn(ctx) on the next arena_reset() or arena_free(), for
+ * memory the request borrowed from elsewhere (a shared cache entry).
+ *
+ * @return 0 on success, -1 if out of memory (fn is then not called).
+ */
+int arena_defer(Arena* arena, void (*fn)(void* ctx), void* ctx);
+char* arena_strndup(Arena* arena, const char* str, size_t len);
+char* arena_sprintf(Arena* arena, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void sb_init(StrBuf* sb, Arena* arena, size_t cap);
+void sb_append(StrBuf* sb, const char* data, size_t len);
+void sb_puts(StrBuf* sb, const char* str);
+void sb_printf(StrBuf* sb, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif    // ARENA_H
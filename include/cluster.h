@@ -0,0 +1,56 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdio.h>
+
+#include "arena.h"
+#include "site.h"
+
+#define CLUSTER_VNODES     64             // Ring points per peer
+#define CLUSTER_CACHE_SIZE (256 << 20)    // Segments kept by an edge
+#define CLUSTER_CACHE_TTL  3600           // Seconds a segment is reused
+#define CLUSTER_OBJECT_MAX (64 << 20)     // Largest response proxied
+#define CLUSTER_CONNECT_MS 1000           // Connect timeout to a peer
+#define CLUSTER_TIMEOUT    30             // Seconds without a byte
+#define CLUSTER_RETRY      5              // Seconds a dead peer is skipped
+#define CLUSTER_HOP_HEADER "X-Movie-Stream-Edge"    // Marks proxied requests
+
+/**
+ * @brief Joins a cluster of servers sharing the same library.
+ *
+ * Each conversion is owned by one node, chosen on a consistent-hash ring of
+ * the origin peers (CLUSTER_VNODES points each) by the conversion id, so
+ * each title is converted once across the cluster and adding or removing a
+ * peer only moves the titles next to its points. Requests for a conversion
+ * owned elsewhere (the player page, playlists and segments) are proxied to
+ * the owner, see cluster_proxy(); everything else is served locally.
+ *
+ * @param self  This node as it appears in peers ("host:port"), or NULL for
+ *              an edge that owns nothing and proxies every conversion.
+ * @param peers Comma-separated "host:port" list of the origins, the same on
+ *              every node.
+ * @return 0 on success, -1 on an invalid list.
+ */
+int cluster_init(const char* self, const char* peers);
+
+/**
+ * @brief Answers a request from the owner of its conversion.
+ *
+ * Segments (.ts) are cached in memory, up to CLUSTER_CACHE_SIZE bytes for
+ * CLUSTER_CACHE_TTL seconds, and concurrent misses for the same segment
+ * share one upstream fetch. Playlists and player pages are fetched every
+ * time. An unreachable owner is skipped for CLUSTER_RETRY seconds, its
+ * titles going to the next peer on the ring (possibly this node).
+ *
+ * @return 0 if resp holds the owner's answer, -1 if the request is to be
+ * served locally: the cluster is off, this node owns it, it is not about a
+ * conversion, or it was proxied here already.
+ */
+int cluster_proxy(const Request* req, Arena* arena, Response* resp);
+
+/**
+ * @brief Prints proxy, cache and coalescing counters.
+ */
+void cluster_dump_stats(FILE* out);
+
+#endif    // CLUSTER_H
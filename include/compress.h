@@ -0,0 +1,118 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+
+#define COMPRESS_MIN        256        // Smaller bodies are sent as they are
+#define COMPRESS_INLINE_MAX 1048576    // Largest file compressed per request
+#define COMPRESS_CACHE      64         // Generated bodies kept encoded
+
+/**
+ * @enum Encoding
+ * @brief Content codings, in increasing order of preference. Brotli and
+ * zstd are only available when the server is built with them.
+ */
+typedef enum Encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_ZSTD,
+    ENCODING_BROTLI,
+    ENCODING_COUNT
+} Encoding;
+
+/**
+ * @brief Parses an Accept-Encoding value (NULL if absent).
+ *
+ * @return A bit mask of (1 << Encoding) for the codings this build supports
+ * and the client accepts with a non-zero q-value. Identity is not included.
+ */
+unsigned compress_accepted(const char* accept_encoding);
+
+/**
+ * @brief Returns the most preferred coding in an accepted mask, or
+ * ENCODING_IDENTITY if it is empty.
+ */
+Encoding compress_preferred(unsigned accepted);
+
+/** @brief Content-Encoding token of a coding, e.g. "gzip". */
+const char* compress_name(Encoding encoding);
+
+/** @brief File suffix of precompressed siblings, e.g. ".gz". */
+const char* compress_suffix(Encoding encoding);
+
+/** @brief True for content types worth compressing (text, playlists). */
+bool compress_text_type(const char* content_type);
+
+/**
+ * @brief Compresses a body for one response, at a fast level.
+ *
+ * @return 0 with the result in arena, -1 on failure.
+ */
+int compress_buffer(Encoding encoding,
+                    const void* src,
+                    size_t len,
+                    Arena* arena,
+                    char** out,
+                    size_t* out_len);
+
+/**
+ * @brief Writes a sibling (path + suffix) of a file for every supported
+ * coding, at the best level, replacing older ones atomically.
+ *
+ * @return 0 on success, -1 if a sibling could not be written.
+ */
+int compress_file(const char* path);
+
+/**
+ * @brief Runs compress_file on the playlists (.m3u8) and WebVTT files of a
+ * directory.
+ */
+void compress_playlists(const char* dir);
+
+/**
+ * @brief Looks up a generated body cached for key in the given coding.
+ *
+ * Entries are valid while st (device, inode, mtime) matches the one they
+ * were stored with. The body is copied into arena.
+ *
+ * @param used Receives the coding of the body, which is identity when the
+ *             body was too small to compress.
+ * @return 0 on a hit, -1 otherwise.
+ */
+int compress_cache_get(const char* key,
+                       const struct stat* st,
+                       Encoding encoding,
+                       Arena* arena,
+                       const char** body,
+                       size_t* len,
+                       Encoding* used);
+
+/**
+ * @brief Stores a generated body for key, requested in encoding and
+ * actually encoded as used. Replaces the least recently used entry.
+ */
+void compress_cache_put(const char* key,
+                        const struct stat* st,
+                        Encoding encoding,
+                        const char* body,
+                        size_t len,
+                        Encoding used);
+
+/**
+ * @brief Calls fn for every cached body, most recently used first, with the
+ * cache locked. Only the device, inode and mtime of st are set.
+ */
+void compress_cache_foreach(void (*fn)(void* ctx,
+                                       const char* key,
+                                       const struct stat* st,
+                                       Encoding encoding,
+                                       Encoding used,
+                                       const char* body,
+                                       size_t len),
+                            void* ctx);
+
+#endif    // COMPRESS_H
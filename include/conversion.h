@@ -0,0 +1,157 @@
+#ifndef CONVERSION_H
+#define CONVERSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "pathcache.h"
+
+#define JOURNAL_FILE      ".movie_stream.jobs"    // Conversion registry file
+#define OUTPUT_URL_PREFIX ".hls/"    // Request paths served from the cache
+
+/**
+ * @brief Loads the conversion registry and restarts the jobs it lists as
+ * running.
+ *
+ * The registry records the state of every conversion (running, ready or
+ * failed) with the source mtime it applies to, and is rewritten whenever a
+ * state changes. Jobs are left running in it when the server is stopped or
+ * killed during a conversion; they are resumed from scratch on the next
+ * start. After a hot restart the jobs whose ffmpeg was handed over by
+ * conversion_handoff() are adopted instead: their output is kept, so viewers
+ * of the growing playlists are not interrupted, and they are marked ready
+ * once ffmpeg has ended every playlist. Calling it again after
+ * conversion_checkpoint() or conversion_handoff() resumes the jobs
+ * in-process.
+ *
+ * @param journal_path Path of the registry file.
+ * @return Number of resumed jobs.
+ */
+int conversion_init(const char* journal_path);
+
+/**
+ * @brief Sets where new conversions are written and how much room all
+ * conversions may take. Must be called before conversion_init().
+ *
+ * With a cache directory (e.g. on an SSD) each new conversion goes to
+ * "<dir>/<16 hex digits>", a hash of the source path, instead of
+ * "<source>.hls", so ffmpeg's writes and the segment reads of players stay
+ * off the disk the sources are read from. Its files are served under
+ * OUTPUT_URL_PREFIX. Conversions made before keep their directory.
+ *
+ * With a quota, finished conversions are evicted least recently served first
+ * whenever their total size exceeds it, and converted again when requested.
+ *
+ * @param dir   Cache directory, created if missing, or NULL.
+ * @param quota Limit in bytes, 0 for none.
+ * @return 0 on success, -1 if the directory cannot be opened.
+ */
+int conversion_set_output(const char* dir, uint64_t quota);
+
+/**
+ * @brief Writes the request path (without the leading '/') under which an
+ * output directory is served into out (PATH_MAX bytes).
+ */
+void conversion_url(const char* hls_dir, char* out);
+
+/**
+ * @brief Writes the thumbnail directory of a source into out (PATH_MAX
+ * bytes): "<output dir>/<id>/thumbs" with an output directory, so the
+ * thumbnailer's writes stay off the media volume too, "<source>.hls/thumbs"
+ * otherwise. Its URL comes from conversion_url().
+ */
+void conversion_thumb_dir(const char* mkv_path, char* out);
+
+/**
+ * @brief True if a cache directory was set, so OUTPUT_URL_PREFIX paths are
+ * served from it rather than from the library.
+ */
+bool conversion_output_enabled(void);
+
+/**
+ * @brief Opens a request path below the cache directory, without
+ * OUTPUT_URL_PREFIX.
+ *
+ * @return 0 on success, -1 with errno set on failure or without a cache
+ * directory.
+ */
+int conversion_open_output(const char* path, PathHandle* out);
+
+/**
+ * @brief Records that a file of a conversion's output was served, for the
+ * least-recently-watched eviction. Other paths are ignored. Lock-free.
+ */
+void conversion_touch(const char* path);
+
+/**
+ * @brief Prints the number and size of ready conversions and evictions.
+ */
+void conversion_dump_stats(FILE* out);
+
+/**
+ * @brief Reports the HLS state of an .mkv file, starting a conversion if
+ * needed.
+ *
+ * The state comes from the in-memory registry; ready conversions are looked
+ * up without taking a lock. A conversion is started again when the source's
+ * mtime differs from the one it was made from. Sources missing from the
+ * registry have their output directory checked once.
+ *
+ * @param mkv_path    Path of the source file.
+ * @param st          stat() of the source.
+ * @param out_hls_dir Receives the HLS output directory (PATH_MAX bytes).
+ * @return 0 if the HLS output is ready, 1 if a conversion is running, -1 if
+ * it failed for this version of the source.
+ */
+int check_or_start_hls(const char* mkv_path,
+                       const struct stat* st,
+                       char* out_hls_dir);
+
+/**
+ * @brief Returns the id of a source's conversion, a 64-bit FNV-1a hash of its
+ * path. It names the cache directory ("<id in hex>") and is the same on
+ * every server serving the same library.
+ */
+uint64_t conversion_id(const char* mkv_path);
+
+/**
+ * @brief Reports whether a (possibly still running) conversion can be played.
+ *
+ * Conversions write EVENT playlists that grow as segments land, so playback
+ * can start before ffmpeg finishes: once master.m3u8 and every playlist it
+ * references exist.
+ *
+ * @param hls_dir The HLS output directory.
+ * @return true if the playlists can be served.
+ */
+bool conversion_playlists_ready(const char* hls_dir);
+
+/**
+ * @brief Reports whether ffmpeg finished a conversion: master.m3u8 exists and
+ * every playlist it references has its #EXT-X-ENDLIST tag.
+ */
+bool conversion_output_finished(const char* hls_dir);
+
+/**
+ * @brief Stops every running conversion and keeps it in the journal.
+ *
+ * Called before shutdown. New conversion requests after this point are
+ * journaled but not started, so the next process picks them up. Does
+ * nothing after conversion_handoff(): the conversions belong to the next
+ * process.
+ */
+void conversion_checkpoint(void);
+
+/**
+ * @brief Hands the running conversions over to the next process.
+ *
+ * Called before a hot restart. ffmpeg is left running; its process group is
+ * written to the journal for conversion_init() in the next process to adopt.
+ * From then on this process starts no ffmpeg and no longer writes the
+ * journal.
+ */
+void conversion_handoff(void);
+
+#endif    // CONVERSION_H
@@ -3,8 +3,10 @@
 
 #include <libavformat/avformat.h>
 #include <libavutil/log.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/types.h>
 
 #define MAX_TRACKS 32
 
@@ -23,6 +25,20 @@ typedef struct {
 } TrackInfo;
 
 TrackInfo get_track_counts(const char* filename);
-int generate_hls_with_tracks(const char* mkv_path, const char* hls_dir);
+/**
+ * @brief Converts an .mkv file to HLS in hls_dir by running ffmpeg.
+ *
+ * While ffmpeg runs, its process group id is stored in *child (0 otherwise),
+ * so another thread can stop the conversion by setting *stop and sending
+ * kill(-*child, SIGTERM). No ffmpeg run is started once *stop is set, so a
+ * conversion stopped that way is not retried without subtitles.
+ *
+ * @return 0 on success, -1 if the input is unusable or *stop was set before
+ * a run, otherwise the wait status of the failed ffmpeg run.
+ */
+int generate_hls_with_tracks(const char* mkv_path,
+                             const char* hls_dir,
+                             pid_t* child,
+                             const bool* stop);
 
 #endif    // FFMPEG_UTILS_H
\ No newline at end of file
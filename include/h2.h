@@ -0,0 +1,46 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stddef.h>
+
+#include "ratelimit.h"
+#include "site.h"
+
+#define H2_PREFACE      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN  24
+#define H2_MAX_STREAMS  32       // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_FRAME_SIZE   16384    // Largest frame received and sent
+#define H2_HEADER_BLOCK 65536    // Largest request header block
+#define H2_STREAM_ARENA 8192     // First arena block of each stream slot
+
+/**
+ * @brief Returns true if req asks to switch to cleartext HTTP/2
+ * ("Upgrade: h2c" with an HTTP2-Settings header).
+ */
+bool h2_upgrade_request(const Request* req);
+
+/**
+ * @brief Serves a connection as cleartext HTTP/2 (h2c) until it closes.
+ *
+ * Requests of up to H2_MAX_STREAMS concurrent streams are answered through
+ * handle_request(); their DATA frames are interleaved round-robin within the
+ * peer's flow-control windows, and file bodies are sent with sendfile()
+ * through the bandwidth limiter. Runs on the connection's thread; a handler
+ * that blocks delays the other streams of the connection.
+ *
+ * @param fd      The client socket.
+ * @param data    Bytes already read from the socket, starting with the
+ *                client connection preface (prior knowledge), or NULL.
+ * @param len     Length of data.
+ * @param upgrade The HTTP/1.1 request that asked for the upgrade, answered
+ *                with 101 Switching Protocols and then as stream 1, or NULL.
+ *                Its strings must stay valid until the function returns.
+ * @param bucket  The client's rate limit bucket.
+ */
+void h2_serve(int fd,
+              const char* data,
+              size_t len,
+              const Request* upgrade,
+              ClientBucket* bucket);
+
+#endif    // H2_H
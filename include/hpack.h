@@ -0,0 +1,89 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define HPACK_TABLE_SIZE 4096    // Default SETTINGS_HEADER_TABLE_SIZE
+
+/**
+ * @struct HpackField
+ * @brief A decoded header field, NUL-terminated strings in the arena.
+ */
+typedef struct HpackField {
+    char* name;
+    char* value;
+} HpackField;
+
+typedef struct HpackEntry HpackEntry;
+
+/**
+ * @struct HpackTable
+ * @brief HPACK dynamic table (RFC 7541), one per direction of a connection.
+ *
+ * Fields:
+ * - entries, count, cap: Entries, newest first.
+ * - size:                Sum of the entry sizes (name + value + 32).
+ * - max_size:            Current maximum size.
+ * - limit:               Largest maximum size the peer may set (decoder) or
+ *                        allowed by the peer's settings (encoder).
+ * - size_update:         Encoder only: max_size changed, announce it at the
+ *                        start of the next header block.
+ */
+typedef struct HpackTable {
+    HpackEntry* entries;
+    size_t count;
+    size_t cap;
+    size_t size;
+    size_t max_size;
+    size_t limit;
+    bool size_update;
+} HpackTable;
+
+void hpack_init(HpackTable* table, size_t max_size);
+void hpack_free(HpackTable* table);
+
+/**
+ * @brief Decodes a complete header block.
+ *
+ * Fields beyond max_fields are decoded (the table must stay in sync) but
+ * dropped.
+ *
+ * @return 0 on success, -1 on a malformed block (a COMPRESSION_ERROR).
+ */
+int hpack_decode(HpackTable* table,
+                 const uint8_t* block,
+                 size_t len,
+                 Arena* arena,
+                 HpackField* fields,
+                 size_t max_fields,
+                 size_t* count);
+
+/**
+ * @brief Changes the encoder's maximum table size after a peer
+ * SETTINGS_HEADER_TABLE_SIZE; the change is announced in the next block.
+ */
+void hpack_set_limit(HpackTable* table, size_t limit);
+
+/**
+ * @brief Starts a header block, emitting a pending table size update.
+ */
+void hpack_encode_begin(HpackTable* table, StrBuf* out);
+
+/**
+ * @brief Appends one field to a header block.
+ *
+ * Fields found in the static or dynamic table are sent as an index.
+ * Otherwise they are sent as literals; with index set they are also added
+ * to the dynamic table, for values that repeat across responses.
+ */
+void hpack_encode_field(HpackTable* table,
+                        StrBuf* out,
+                        const char* name,
+                        const char* value,
+                        bool index);
+
+#endif    // HPACK_H
@@ -0,0 +1,91 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define PATHCACHE_ENTRIES 256    // Default number of cached open files/dirs
+
+/**
+ * @struct PathEntry
+ * @brief A cached, open file or directory below the served root.
+ */
+typedef struct PathEntry PathEntry;
+
+/**
+ * @struct PathHandle
+ * @brief Result of pathcache_open().
+ *
+ * Fields:
+ * - fd:    Open descriptor (O_RDONLY). Borrowed from the cache when entry is
+ *          set, owned by the handle otherwise; either way it is only valid
+ *          until pathcache_release().
+ * - st:    fstat() of fd, taken when it was opened. Cached entries are
+ *          invalidated by inotify when the file changes.
+ * - entry: The cache entry, or NULL for an uncached descriptor.
+ */
+typedef struct PathHandle {
+    int fd;
+    struct stat st;
+    PathEntry* entry;
+} PathHandle;
+
+/**
+ * @brief Opens the served root and starts the invalidation thread.
+ *
+ * Every later lookup is resolved against this directory descriptor and may
+ * not leave it, including through ".." or symlinks (openat2 RESOLVE_BENEATH;
+ * on kernels without openat2, normalized paths are opened with openat).
+ *
+ * @param root     Directory to serve.
+ * @param capacity Maximum number of cached entries; 0 disables caching but
+ *                 keeps the root-relative resolution.
+ * @return 0 on success, -1 if the root cannot be opened.
+ */
+int pathcache_init(const char* root, size_t capacity);
+
+/**
+ * @brief Resolves a normalized request path below the root.
+ *
+ * Regular files and directories are kept open in the cache, together with
+ * their parent directories, so repeated requests cost no open/fstat/close
+ * syscalls. Concurrent misses on the same path are opened once: the first
+ * caller walks the path while the others wait and share its descriptor.
+ *
+ * @param path Path relative to the root, as produced by scan_decode_path().
+ * @param out  Receives the descriptor and its stat.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int pathcache_open(const char* path, PathHandle* out);
+
+/**
+ * @brief Opens a path below another directory, with the same confinement as
+ * the root but without caching.
+ *
+ * @param dirfd Directory the path is resolved against.
+ * @param path  Normalized relative path.
+ * @param out   Receives the descriptor and its stat.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int pathcache_open_at(int dirfd, const char* path, PathHandle* out);
+
+/**
+ * @brief Gives back a handle obtained from pathcache_open().
+ */
+void pathcache_release(PathHandle* handle);
+
+/**
+ * @brief Calls fn for every cached regular file, most recently used first,
+ * with the cache locked.
+ */
+void pathcache_foreach_file(void (*fn)(void* ctx,
+                                       const char* path,
+                                       const struct stat* st),
+                            void* ctx);
+
+/**
+ * @brief Prints hit, miss, coalesced and invalidation counters.
+ */
+void pathcache_dump_stats(FILE* out);
+
+#endif    // PATHCACHE_H
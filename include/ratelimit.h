@@ -0,0 +1,85 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * @enum TrafficClass
+ * @brief Scheduling class of an outgoing response body.
+ *
+ * Streaming traffic (HLS playlists/segments and ranged reads issued by
+ * players) is served before bulk traffic (downloads) whenever the global
+ * bucket runs dry. Within a class, connections take turns.
+ */
+typedef enum TrafficClass {
+    TRAFFIC_STREAM = 0,
+    TRAFFIC_BULK,
+    TRAFFIC_CLASS_COUNT
+} TrafficClass;
+
+/**
+ * @struct ClientBucket
+ * @brief Per-client-IP token bucket, shared by all connections of that IP.
+ */
+typedef struct ClientBucket ClientBucket;
+
+/**
+ * @brief Configures the limiter. Must be called before any other rl_ call.
+ *
+ * @param global_rate Global limit in bytes per second (0 = unlimited).
+ * @param client_rate Per-client-IP limit in bytes per second (0 = unlimited).
+ */
+void rl_init(uint64_t global_rate, uint64_t client_rate);
+
+/**
+ * @brief Looks up (or creates) the bucket for a client address.
+ *
+ * The returned bucket is reference counted; release it with
+ * rl_client_release() when the connection closes. Returns NULL when per-client
+ * limiting is disabled or on allocation failure, which rl_write() accepts.
+ */
+ClientBucket* rl_client_acquire(struct in_addr addr);
+
+/**
+ * @brief Drops a reference obtained from rl_client_acquire().
+ */
+void rl_client_release(ClientBucket* client);
+
+/**
+ * @brief Writes a buffer to a socket, pacing it through the token buckets.
+ *
+ * Blocks while the global or the client bucket is empty. Writers waiting
+ * on the global bucket are served round-robin, RL_QUANTUM bytes per turn,
+ * streaming writers before bulk ones.
+ *
+ * @return Number of bytes written, or -1 on write error.
+ */
+ssize_t rl_write(int fd,
+                 const void* buf,
+                 size_t len,
+                 ClientBucket* client,
+                 TrafficClass cls);
+
+/**
+ * @brief Sends len bytes of a file from offset with sendfile(), paced like
+ * rl_write().
+ *
+ * @return Number of bytes sent, or -1 on error or if the file is shorter.
+ */
+ssize_t rl_sendfile(int fd,
+                    int file_fd,
+                    off_t offset,
+                    size_t len,
+                    ClientBucket* client,
+                    TrafficClass cls);
+
+/**
+ * @brief Prints byte and throttled-time counters for every traffic class
+ * and every active client.
+ */
+void rl_dump_stats(FILE* out);
+
+#endif    // RATELIMIT_H
@@ -0,0 +1,54 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/**
+ * Byte-scanning kernels for the request hot path.
+ *
+ * Each kernel has AVX2 and SSE2 implementations on x86-64, picked at run time
+ * from the CPU features, and a scalar fallback used on other targets and for
+ * the tail of the buffer.
+ */
+
+/**
+ * @brief Finds the first occurrence of the 4-byte pattern pat in buf.
+ *
+ * Used with "\r\n\r\n" to find the end of the request header.
+ *
+ * @return Pointer to the match, or NULL.
+ */
+const char* scan_quad(const char* buf, size_t len, const char pat[4]);
+
+/**
+ * @brief Finds the first position where a is immediately followed by b.
+ *
+ * Used with '\r', '\n' to split header lines.
+ *
+ * @return Pointer to a, or NULL.
+ */
+const char* scan_pair(const char* buf, size_t len, char a, char b);
+
+/**
+ * @brief Finds the first byte equal to a or b.
+ *
+ * @return Pointer to the byte, or NULL.
+ */
+const char* scan_any2(const char* buf, size_t len, char a, char b);
+
+/**
+ * @brief Percent-decodes and normalizes a request path in one pass.
+ *
+ * Empty and "." segments are dropped and ".." removes the previous segment
+ * (never going above the root). Decoded slashes separate segments, as if
+ * they had been sent unescaped. The result has no leading slash; the root
+ * itself is ".".
+ *
+ * @param dst Output buffer of at least len + 2 bytes.
+ * @param src The path as sent, starting with '/', without the query.
+ * @param len Length of src.
+ * @return Length of dst, or -1 if the path decodes to a NUL byte.
+ */
+int scan_decode_path(char* dst, const char* src, size_t len);
+
+#endif    // SCAN_H
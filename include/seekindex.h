@@ -0,0 +1,37 @@
+#ifndef SEEKINDEX_H
+#define SEEKINDEX_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SEEK_INDEX_SUFFIX ".seek"    // Persisted index, next to the source
+#define SEEK_WAIT_MS      2000       // Wait for an index built on demand
+#define SEEK_CACHE        32         // Indexes kept in memory
+#define SEEK_WORKERS      2          // Threads building indexes
+
+/**
+ * @brief Finds the byte offset to stream a Matroska file from for a seek.
+ *
+ * The index maps keyframe timestamps to the start of the cluster holding
+ * them. It is read from "<path>.seek" when that file matches the source's
+ * size and mtime, otherwise built in the background with libavformat (from
+ * the Cues when the file has them, by reading the packets otherwise) and
+ * written there for next time. At most SEEK_WORKERS indexes are built at
+ * once; other files wait their turn.
+ *
+ * @param path    Source path, relative to the served root.
+ * @param st      stat() of the source, used to validate the index.
+ * @param seconds Requested position.
+ * @param offset  Receives the cluster offset of the last keyframe at or
+ *                before seconds.
+ * @param time    Receives that keyframe's timestamp in seconds.
+ * @return 0 on success, 1 if the index is still being built, -1 if the file
+ * cannot be indexed.
+ */
+int seek_lookup(const char* path,
+                const struct stat* st,
+                double seconds,
+                off_t* offset,
+                double* time);
+
+#endif    // SEEKINDEX_H
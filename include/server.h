@@ -0,0 +1,77 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+
+#define ACCEPT_BATCH  64    // Connections accepted per listener wakeup
+#define EMFILE_BACKOFF_MS 100    // Listener pause when no descriptor is left
+#define RETRY_AFTER   1     // Seconds advertised in overload responses
+#define DRAIN_TIMEOUT 30    // Default seconds to wait for responses on stop
+#define LISTEN_FDS_ENV "MOVIE_STREAM_LISTEN_FDS"    // Handed-off sockets
+
+/**
+ * @struct ServerConfig
+ * @brief Listening and admission settings for server_run().
+ *
+ * Fields:
+ * - port:            TCP port to listen on.
+ * - max_connections: Maximum in-flight client connections; connections
+ *                    beyond it get a 503 with Retry-After and are closed.
+ * - listeners:       Number of listener threads, each with its own
+ *                    SO_REUSEPORT socket so the kernel spreads accepts.
+ *                    Ignored when sockets are inherited via LISTEN_FDS_ENV.
+ * - drain_timeout:   Seconds server_run() waits for in-flight connections
+ *                    after server_stop() before returning anyway.
+ */
+typedef struct ServerConfig {
+    int port;
+    int max_connections;
+    int listeners;
+    int drain_timeout;
+} ServerConfig;
+
+/**
+ * @brief Binds the listening sockets and runs the accept loops.
+ *
+ * Accepted connections are handed to thread_fn on detached threads. Resource
+ * exhaustion (EMFILE, thread creation failure, connection cap) is answered
+ * with a 503 instead of terminating the server.
+ *
+ * If LISTEN_FDS_ENV is set (by server_handoff() in the previous process), the
+ * listed sockets are reused instead of binding new ones.
+ *
+ * @return 0 after server_stop() and the drain, -1 if the sockets could not be
+ * set up.
+ */
+int server_run(const ServerConfig* config);
+
+/**
+ * @brief Stops accepting and starts draining. Safe to call from any thread.
+ *
+ * Idle keep-alive connections are closed, busy ones finish their current
+ * response first.
+ */
+void server_stop(void);
+
+/**
+ * @brief True once server_stop() has been called.
+ */
+bool server_draining(void);
+
+/**
+ * @brief Starts a new server process that inherits the listening sockets.
+ *
+ * The new process is the current executable run with argv; it finds the
+ * sockets through LISTEN_FDS_ENV, so no connection is refused while the old
+ * process drains. Call server_stop() afterwards.
+ *
+ * @return 0 if the new process was started, -1 otherwise.
+ */
+int server_handoff(char* const argv[]);
+
+/**
+ * @brief Number of client connections currently being served.
+ */
+int server_active_connections(void);
+
+#endif    // SERVER_H
@@ -1,8 +1,10 @@
 #ifndef SITE_H
 #define SITE_H
 
-#define BUFFER_SIZE   8192       // Buffer size for reading requests/responses
-#define BODY_MAX_SIZE 1048576    // Maximum allowed HTTP body size (1 MB)
+#define BUFFER_SIZE     8192     // Buffer size for reading requests
+#define MAX_HEADERS     64       // Request header fields kept per request
+#define CONNECTION_STACK_SIZE (256 * 1024)    // Stack of connection threads
+#define STREAM_RANGE_MAX (16 << 20)    // Longest ranged read served as stream
 
 #include <ctype.h>
 #include <dirent.h>
@@ -20,53 +22,186 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "ffmpeg_utils.h"
-#include "list.h"
+#include "pathcache.h"
+#include "ratelimit.h"
 
 /**
- * @struct Header
- * @brief Represents the parsed HTTP request header.
+ * @struct Client
+ * @brief An accepted connection handed from the accept loop to thread_fn.
  *
- * This structure holds information extracted from an HTTP request header.
- * It includes the HTTP version, method (e.g., GET, POST), requested path,
- * connection persistence (keep-alive), range request details, and a list
- * of additional headers.
+ * Fields:
+ * - fd:    The connected client socket.
+ * - addr:  The peer address, used for per-client bandwidth accounting.
+ */
+typedef struct Client {
+    int fd;
+    struct sockaddr_in addr;
+} Client;
+
+/**
+ * @struct HeaderField
+ * @brief One request header line, both strings pointing into the read
+ * buffer.
+ */
+typedef struct HeaderField {
+    const char* name;
+    const char* value;
+} HeaderField;
+
+/**
+ * @struct Request
+ * @brief Represents a parsed HTTP request.
+ *
+ * All strings point into the connection's read buffer (which parsing
+ * NUL-terminates in place) or into the per-request arena, so the struct
+ * itself stays small and nothing needs to be freed.
  *
  * Fields:
- * - version:      The HTTP version string (e.g., "HTTP/1.1").
- * - method:       The HTTP method string (e.g., "GET", "POST").
- * - path:         The requested resource path.
- * - keep_alive:   Indicates if the connection should be kept alive.
- * - range_request:True if the request includes a Range header.
- * - range_start:  The starting byte for a range request (if applicable).
- * - range_end:    The ending byte for a range request (if applicable).
- * - headers:      Pointer to a linked list of additional HTTP headers.
+ * - method:        The HTTP method string (e.g., "GET").
+ * - path:          The decoded, normalized path relative to the served
+ *                  directory ("." for the root).
+ * - query:         The query string without '?', or "".
+ * - version:       The HTTP version string (e.g., "HTTP/1.1").
+ * - keep_alive:    False if the client sent "Connection: close".
+ * - range_request: True if the request includes a Range header.
+ * - range_start:   The starting byte for a range request (if applicable),
+ *                  -1 for a suffix range.
+ * - range_end:     The ending byte for a range request, -1 if open-ended,
+ *                  or the length of a suffix range.
+ * - headers:       The header fields, header_count entries.
  */
-typedef struct Header {
-    char version[BUFFER_SIZE - 1];
-    char method[BUFFER_SIZE - 1];
-    char path[PATH_MAX - 1];
+typedef struct Request {
+    char* method;
+    char* path;
+    char* query;
+    char* version;
     bool keep_alive;
     bool range_request;
-    char query[256];
     off_t range_start;
     off_t range_end;
-    List* headers;
-} Header;
+    HeaderField* headers;
+    size_t header_count;
+} Request;
+
+/**
+ * @struct Response
+ * @brief A response ready to be written, with either an in-memory or a file
+ * body.
+ *
+ * Fields:
+ * - status, reason: The status line, e.g. 200 and "OK".
+ * - content_type:   Content-Type value, or NULL to omit it.
+ * - content_encoding: Content-Encoding of the body, or NULL for identity.
+ * - headers:        Additional header lines, each ending in "\r\n", or NULL.
+ * - body, body_len: In-memory body (arena or static storage).
+ * - file:           File body source if file.fd >= 0; released by the sender.
+ * - file_offset:    First byte of the file body.
+ * - file_len:       Length of the file body.
+ * - traffic:        Scheduling class used by the bandwidth limiter.
+ * - close:          Close the connection after this response.
+ */
+typedef struct Response {
+    int status;
+    const char* reason;
+    const char* content_type;
+    const char* content_encoding;
+    const char* headers;
+    const char* body;
+    size_t body_len;
+    PathHandle file;
+    off_t file_offset;
+    off_t file_len;
+    TrafficClass traffic;
+    bool close;
+} Response;
+
+/**
+ * @brief Resets a Request to an empty keep-alive request.
+ */
+void request_init(Request* req);
+
+/**
+ * @brief Sets path and query from a request target ("/path?query").
+ *
+ * The target is modified in place and must outlive the request.
+ *
+ * @return 0 on success, -1 if the target is not an absolute path or does not
+ * decode to a path inside the served directory.
+ */
+int request_set_target(Request* req, Arena* arena, char* target, size_t len);
+
+/**
+ * @brief Appends a header field, interpreting Range and Connection.
+ *
+ * Fields beyond MAX_HEADERS are dropped. Both strings must outlive the
+ * request.
+ *
+ * @return 0 on success, -1 on allocation failure.
+ */
+int request_add_header(Request* req,
+                       Arena* arena,
+                       const char* name,
+                       const char* value);
+
+/**
+ * @brief Looks up a request header by name (case-insensitive).
+ *
+ * @return The header value, or NULL if absent.
+ */
+const char* request_header(const Request* req, const char* name);
+
+/**
+ * @brief Produces the response for a parsed request.
+ *
+ * Protocol independent: the caller serializes the Response (HTTP/1.1 in
+ * thread_fn). Strings and bodies are allocated from arena.
+ */
+void handle_request(const Request* req, Arena* arena, Response* resp);
+
+/**
+ * @brief Percent-encodes a path for a URL, keeping '/'. dest needs three
+ * times the length of src plus one bytes.
+ */
+void urlencode(char* dest, const char* src);
+
+/**
+ * @brief Parses the first range of a Range header value ("bytes=...").
+ *
+ * @param start Receives the first byte, or -1 for a suffix range ("-n").
+ * @param end   Receives the last byte, -1 if open-ended ("n-"), or the
+ *              length of a suffix range.
+ * @return 0 on success, -1 if the value is not a byte range (the header is
+ * then ignored).
+ */
+int getcontentrange(const char* content, off_t* start, off_t* end);
+
+/**
+ * @brief Resolves a range from getcontentrange() against a body of
+ * file_size bytes, clamping its end.
+ *
+ * @return 0 on success, -1 if no byte of the range exists, to be answered
+ * with 416 (Range Not Satisfiable).
+ */
+int normalizeranges(off_t* start, off_t* end, const off_t file_size);
 
 /**
  * @brief Thread function to handle client connections.
  *
  * This function is intended to be used as the entry point for a new thread
- * that handles a single client connection. The argument should be a pointer
- * to the client socket file descriptor or a structure containing connection
- * information. The function processes the client's HTTP request, sends the
- * appropriate response, and closes the connection when done.
+ * that handles a single client connection. The argument must be a
+ * heap-allocated Client, which the thread takes ownership of. The function
+ * processes the client's HTTP requests, sends the appropriate responses
+ * through the bandwidth limiter, and closes the connection when done.
+ *
+ * All per-request state lives in a per-connection arena that is reset
+ * between requests, so the thread runs on a small stack
+ * (CONNECTION_STACK_SIZE).
  *
- * @param arg Pointer to the client connection information (typically a socket
- * fd).
+ * @param arg Pointer to a malloc'd Client.
  * @return void* Always returns NULL.
  */
 void* thread_fn(void* arg);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,60 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "compress.h"
+
+#define SNAPSHOT_LISTINGS 256            // Directory listings kept
+#define SNAPSHOT_HOT      1024           // Hot files kept
+#define SNAPSHOT_WARM_MAX (256 << 20)    // Bytes read ahead at startup
+
+/**
+ * @brief Maps a snapshot written by snapshot_save() and starts warming up.
+ *
+ * A low-priority thread opens the directories and hot files it lists
+ * through the path cache, leaving them in the order they were last served
+ * in, and asks the kernel to read the most recently served
+ * SNAPSHOT_WARM_MAX bytes ahead (POSIX_FADV_WILLNEED). Files whose size or
+ * mtime changed since are skipped. The listings are
+ * used by snapshot_listing(). A missing or malformed snapshot is ignored.
+ * Must be called after pathcache_init().
+ *
+ * @param path Path of the snapshot file.
+ * @return 0 if a snapshot was loaded, -1 otherwise.
+ */
+int snapshot_load(const char* path);
+
+/**
+ * @brief Looks up a directory listing in the loaded snapshot.
+ *
+ * Works like compress_cache_get(): the listing is only returned while st
+ * (device, inode, mtime) matches the directory it was generated from, and
+ * is copied into arena.
+ *
+ * @return 0 on a hit, -1 otherwise.
+ */
+int snapshot_listing(const char* key,
+                     const struct stat* st,
+                     Encoding encoding,
+                     Arena* arena,
+                     const char** body,
+                     size_t* len,
+                     Encoding* used);
+
+/**
+ * @brief Writes the cached directory listings and the files the path cache
+ * holds open, replacing the snapshot file atomically.
+ *
+ * Listings of the loaded snapshot that were not regenerated are kept, up to
+ * SNAPSHOT_LISTINGS; they are validated when used. HLS readiness needs no
+ * entry, the conversion registry already persists it.
+ *
+ * @param path Path of the snapshot file.
+ * @return 0 on success, -1 on failure.
+ */
+int snapshot_save(const char* path);
+
+#endif    // SNAPSHOT_H
@@ -0,0 +1,75 @@
+#ifndef SOCKTUNE_H
+#define SOCKTUNE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define SOCKTUNE_SMALL 65536     // Largest body sent with the latency profile
+#define SOCKTUNE_LOWAT 131072    // Default TCP_NOTSENT_LOWAT of bulk sends
+#define SOCKTUNE_DEFER 5         // Default TCP_DEFER_ACCEPT, in seconds
+
+/**
+ * @enum SockProfile
+ * @brief Socket options used while sending a response.
+ *
+ * - SOCK_PROFILE_LATENCY: Playlists, listings, pages and other small
+ *                         bodies; TCP_NODELAY so the last segment of a
+ *                         response is not held back for the peer's delayed
+ *                         ACK.
+ * - SOCK_PROFILE_BULK:    Media segments and downloads; TCP_NODELAY and a
+ *                         small TCP_NOTSENT_LOWAT, so a thread blocked in a
+ *                         send (and the rate limiter behind it) gets control
+ *                         back before the whole send buffer has drained.
+ * - SOCK_PROFILE_UNSET:   A fresh connection, nothing applied yet.
+ */
+typedef enum SockProfile {
+    SOCK_PROFILE_LATENCY,
+    SOCK_PROFILE_BULK,
+    SOCK_PROFILE_COUNT,
+    SOCK_PROFILE_UNSET = -1
+} SockProfile;
+
+/**
+ * @brief Changes the tuning from a comma-separated list of key=value pairs.
+ * Must be called before the sockets are opened.
+ *
+ * Keys (sizes accept k, m and g suffixes, 0 turns an option off):
+ * - latency.nodelay, bulk.nodelay: TCP_NODELAY of the profile (0 or 1).
+ * - latency.lowat, bulk.lowat:     TCP_NOTSENT_LOWAT of the profile.
+ * - small:                         Largest body sent as latency.
+ * - sndbuf, rcvbuf:                SO_SNDBUF/SO_RCVBUF of the listening
+ *                                  sockets, inherited by the connections;
+ *                                  0 keeps the kernel's autotuning.
+ * - defer:                         TCP_DEFER_ACCEPT in seconds: connections
+ *                                  are accepted once their request arrived.
+ * - fastopen:                      TCP_FASTOPEN queue length.
+ *
+ * @return 0 on success, -1 on an unknown key or invalid value.
+ */
+int socktune_parse(const char* spec);
+
+/**
+ * @brief Applies the listener options. Called before listen().
+ */
+void socktune_listener(int fd);
+
+/**
+ * @brief Picks the profile of a response from the length of its body.
+ */
+SockProfile socktune_profile(off_t body_len);
+
+/**
+ * @brief Switches a client socket to a profile. Options that already have
+ * the wanted value on the connection are not set again.
+ *
+ * @param current The connection's profile, updated.
+ */
+void socktune_apply(int fd, SockProfile* current, SockProfile profile);
+
+/**
+ * @brief Prints the tuning in effect.
+ */
+void socktune_dump(FILE* out);
+
+#endif    // SOCKTUNE_H
@@ -0,0 +1,32 @@
+#ifndef THUMBNAILS_H
+#define THUMBNAILS_H
+
+#include <sys/stat.h>
+
+#define THUMB_DIR      "thumbs"    // See conversion_thumb_dir()
+#define THUMB_WIDTH    160         // Sprite tile width, height keeps aspect
+#define THUMB_COLUMNS  10          // Tiles per sprite row
+#define THUMB_ROWS     10          // Rows per sprite sheet
+#define THUMB_INTERVAL 10          // Seconds between tiles at least
+#define THUMB_MAX      1000        // Tiles per file, the interval grows past it
+#define THUMB_POSTER   480         // Poster frame width
+#define THUMB_RATE     20          // Keyframes decoded per second
+#define THUMB_QUEUE    64          // Files waiting for thumbnails
+
+/**
+ * @brief Returns the state of a file's thumbnails, queueing them if needed.
+ *
+ * Thumbnails are written to conversion_thumb_dir(): poster.jpg, JPEG sprite
+ * sheets and thumbnails.vtt, a WebVTT track mapping time ranges to sprite
+ * tiles ("sprite_000.jpg#xywh=x,y,w,h"). A single background thread builds
+ * them from sparse keyframes, decoding no more than THUMB_RATE per second.
+ * They are rebuilt when the source is newer than thumbnails.vtt.
+ *
+ * @param path Source path, relative to the served root.
+ * @param st   stat() of the source.
+ * @return 0 if the thumbnails are ready, 1 if they are queued or the queue is
+ * full, -1 if the file could not be processed.
+ */
+int thumb_request(const char* path, const struct stat* st);
+
+#endif    // THUMBNAILS_H
@@ -0,0 +1,178 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+static ArenaBlock* new_block(size_t size) {
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+    if(!block) {
+        fprintf(stderr, "Memory allocation failed for arena block\n");
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void arena_init(Arena* arena, size_t block_size) {
+    arena->head = NULL;
+    arena->first = NULL;
+    arena->block_size = block_size;
+    arena->cleanups = NULL;
+}
+
+void arena_reset(Arena* arena) {
+    // The records live in the blocks about to be reused
+    for(ArenaCleanup* c = arena->cleanups; c; c = c->next) c->fn(c->ctx);
+    arena->cleanups = NULL;
+    if(!arena->first) return;
+    ArenaBlock* block = arena->first->next;
+    while(block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->head = arena->first;
+}
+
+void arena_free(Arena* arena) {
+    arena_reset(arena);
+    free(arena->first);
+    arena->first = NULL;
+    arena->head = NULL;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = align_up(size ? size : 1);
+    ArenaBlock* head = arena->head;
+    if(!head || head->size - head->used < size) {
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        ArenaBlock* block = new_block(block_size);
+        if(!block) return NULL;
+        if(!arena->first) {
+            arena->first = block;
+        } else {
+            head->next = block;
+        }
+        arena->head = head = block;
+    }
+    void* ptr = head->data + head->used;
+    head->used += size;
+    return ptr;
+}
+
+int arena_defer(Arena* arena, void (*fn)(void* ctx), void* ctx) {
+    ArenaCleanup* c = arena_alloc(arena, sizeof(ArenaCleanup));
+    if(!c) return -1;
+    c->fn = fn;
+    c->ctx = ctx;
+    c->next = arena->cleanups;
+    arena->cleanups = c;
+    return 0;
+}
+
+char* arena_strndup(Arena* arena, const char* str, size_t len) {
+    char* copy = arena_alloc(arena, len + 1);
+    if(!copy) return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char* arena_sprintf(Arena* arena, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if(len < 0) return NULL;
+
+    char* str = arena_alloc(arena, (size_t) len + 1);
+    if(!str) return NULL;
+    va_start(ap, fmt);
+    vsnprintf(str, (size_t) len + 1, fmt, ap);
+    va_end(ap);
+    return str;
+}
+
+// Grows the buffer in place when it is the most recent allocation of the
+// current block, reallocates the block when the buffer is all it holds, and
+// moves the buffer otherwise.
+static int sb_reserve(StrBuf* sb, size_t extra) {
+    size_t need = sb->len + extra + 1;
+    if(need <= sb->cap) return 0;
+
+    size_t cap = sb->cap ? sb->cap : 256;
+    while(cap < need) cap *= 2;
+
+    Arena* arena = sb->arena;
+    ArenaBlock* head = arena->head;
+    if(sb->data && head &&
+       sb->data + align_up(sb->cap) == head->data + head->used) {
+        if(head->used - align_up(sb->cap) + align_up(cap) <= head->size) {
+            head->used = head->used - align_up(sb->cap) + align_up(cap);
+            sb->cap = cap;
+            return 0;
+        }
+        if(sb->data == head->data && head != arena->first) {
+            ArenaBlock* prev = arena->first;
+            while(prev->next != head) prev = prev->next;
+            ArenaBlock* block = realloc(head, sizeof(ArenaBlock) + align_up(cap));
+            if(!block) return -1;
+            block->size = block->used = align_up(cap);
+            prev->next = arena->head = block;
+            sb->data = block->data;
+            sb->cap = cap;
+            return 0;
+        }
+    }
+
+    char* data = arena_alloc(sb->arena, cap);
+    if(!data) return -1;
+    if(sb->data) memcpy(data, sb->data, sb->len + 1);
+    sb->data = data;
+    sb->cap = cap;
+    return 0;
+}
+
+void sb_init(StrBuf* sb, Arena* arena, size_t cap) {
+    sb->arena = arena;
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+    if(sb_reserve(sb, cap) == 0) sb->data[0] = '\0';
+}
+
+void sb_append(StrBuf* sb, const char* data, size_t len) {
+    if(sb_reserve(sb, len) != 0) return;
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_puts(StrBuf* sb, const char* str) {
+    sb_append(sb, str, strlen(str));
+}
+
+void sb_printf(StrBuf* sb, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if(len < 0 || sb_reserve(sb, (size_t) len) != 0) return;
+
+    va_start(ap, fmt);
+    vsnprintf(sb->data + sb->len, (size_t) len + 1, fmt, ap);
+    va_end(ap);
+    sb->len += (size_t) len;
+}
@@ -0,0 +1,612 @@
+#define _GNU_SOURCE
+#include "cluster.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conversion.h"
+#include "thumbnails.h"
+
+#define CACHE_BUCKETS 256
+#define READ_CHUNK    65536
+
+typedef struct Peer {
+    char name[256];    // "host:port" as configured
+    struct sockaddr_in addr;
+    bool self;
+    time_t down_until;    // Skipped on the ring until then
+} Peer;
+
+typedef struct RingPoint {
+    uint64_t hash;
+    int peer;
+} RingPoint;
+
+// An upstream response, shared by the requests that coalesced on it. Only
+// complete 200 answers for segments stay in the table.
+typedef struct Object {
+    char* key;    // Request path, NULL once out of the table
+    uint64_t hash;
+    bool done;        // Fetch finished, the fields below are set
+    bool cached;      // Counted in the cache, on the LRU list
+    int refs;         // Requests using it, plus one while in the table
+    time_t fetched;
+    int status;       // 0 if the owner could not be reached
+    char* reason;
+    char* content_type;    // NULL if there was none
+    char* headers;         // Relayed header lines
+    const char* body;
+    size_t body_len;
+    char* buf;    // The raw response, body points into it
+    struct Object* next;    // Hash chain
+    struct Object* lru_prev;    // Most recently used first, done only
+    struct Object* lru_next;
+} Object;
+
+static bool enabled;
+static const char* hop_value = "edge";
+static Peer* peers;
+static int peer_count;
+static RingPoint* ring;
+static size_t ring_size;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static Object* table[CACHE_BUCKETS];
+static Object* lru_head;
+static Object* lru_tail;
+static size_t cache_bytes;
+static size_t cache_objects;
+static uint64_t proxied, hits, misses, coalesced, failures;
+
+static uint64_t fnv1a(const char* s) {
+    uint64_t h = 14695981039346656037ull;
+    for(; *s; s++) {
+        h ^= (unsigned char) *s;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// FNV-1a keeps the low bits of similar inputs close; spread them over the
+// ring (splitmix64 finalizer)
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+static int compare_points(const void* a, const void* b) {
+    const RingPoint* x = a;
+    const RingPoint* y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static int parse_peer(const char* spec, size_t len, Peer* peer) {
+    if(len == 0 || len >= sizeof(peer->name)) return -1;
+    memcpy(peer->name, spec, len);
+    peer->name[len] = '\0';
+    char host[sizeof(peer->name)];
+    memcpy(host, peer->name, len + 1);
+    char* colon = strrchr(host, ':');
+    if(!colon || colon == host || !colon[1]) return -1;
+    *colon = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo* res;
+    int err = getaddrinfo(host, colon + 1, &hints, &res);
+    if(err != 0) {
+        fprintf(stderr,
+                "[Cluster] Could not resolve %s: %s\n",
+                peer->name,
+                gai_strerror(err));
+        return -1;
+    }
+    memcpy(&peer->addr, res->ai_addr, sizeof(peer->addr));
+    freeaddrinfo(res);
+    return 0;
+}
+
+int cluster_init(const char* self, const char* list) {
+    int count = 1;
+    for(const char* p = list; *p; p++) count += *p == ',';
+    peers = calloc((size_t) count, sizeof(Peer));
+    ring = calloc((size_t) count * CLUSTER_VNODES, sizeof(RingPoint));
+    if(!peers || !ring) return -1;
+
+    bool member = false;
+    for(const char* p = list; *p;) {
+        size_t len = strcspn(p, ",");
+        Peer* peer = &peers[peer_count];
+        if(parse_peer(p, len, peer) != 0) {
+            fprintf(stderr, "[Cluster] Invalid peer: %.*s\n", (int) len, p);
+            return -1;
+        }
+        peer->self = self && strcmp(peer->name, self) == 0;
+        member |= peer->self;
+        for(int i = 0; i < CLUSTER_VNODES; i++) {
+            char point[sizeof(peer->name) + 16];
+            snprintf(point, sizeof(point), "%s#%d", peer->name, i);
+            ring[ring_size].hash = mix(fnv1a(point));
+            ring[ring_size++].peer = peer_count;
+        }
+        peer_count++;
+        p += len;
+        if(*p == ',') p++;
+    }
+    if(peer_count == 0) return -1;
+    if(self && !member) {
+        fprintf(stderr, "[Cluster] %s is not in the peer list\n", self);
+        return -1;
+    }
+    qsort(ring, ring_size, sizeof(RingPoint), compare_points);
+    if(self) hop_value = self;
+    enabled = true;
+    printf("[Cluster] %d origin(s), this node is %s%s\n",
+           peer_count,
+           self ? "origin " : "an edge",
+           self ? self : "");
+    return 0;
+}
+
+// The first live peer at or after the id's point on the ring
+static int ring_owner(uint64_t id) {
+    uint64_t h = mix(id);
+    size_t lo = 0, hi = ring_size;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    time_t now = time(NULL);
+    for(size_t n = 0; n < ring_size; n++) {
+        int peer = ring[(lo + n) % ring_size].peer;
+        if(__atomic_load_n(&peers[peer].down_until, __ATOMIC_RELAXED) <= now)
+            return peer;
+    }
+    return -1;
+}
+
+// Whether the rest of a path below a conversion's directory is the thumbnails
+static bool is_thumb_path(const char* rest) {
+    size_t len = strlen(THUMB_DIR);
+    return strncmp(rest, THUMB_DIR, len) == 0 &&
+           (rest[len] == '/' || rest[len] == '\0');
+}
+
+// Finds the conversion a request is about: the player page of a source,
+// or a file below its output directory, except the thumbnails, which every
+// node makes for its own listings
+static bool conversion_key(const Request* req, uint64_t* id) {
+    const char* path = req->path;
+    size_t prefix = strlen(OUTPUT_URL_PREFIX);
+    if(strncmp(path, OUTPUT_URL_PREFIX, prefix) == 0) {
+        char* end;
+        *id = strtoull(path + prefix, &end, 16);
+        return end == path + prefix + 16 && *end == '/' &&
+               !is_thumb_path(end + 1);
+    }
+
+    const char* hls = strstr(path, ".mkv.hls/");
+    if(hls) {
+        if(is_thumb_path(hls + strlen(".mkv.hls/"))) return false;
+        char source[PATH_MAX];
+        size_t len = (size_t) (hls - path) + strlen(".mkv");
+        if(len >= sizeof(source)) return false;
+        memcpy(source, path, len);
+        source[len] = '\0';
+        *id = conversion_id(source);
+        return true;
+    }
+
+    size_t len = strlen(path);
+    if(len > 4 && strcmp(path + len - 4, ".mkv") == 0 &&
+       strcmp(req->query, "mode=hls") == 0) {
+        *id = conversion_id(path);
+        return true;
+    }
+    return false;
+}
+
+static int connect_peer(const Peer* peer) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) return -1;
+    const struct sockaddr* addr = (const struct sockaddr*) &peer->addr;
+    if(connect(fd, addr, sizeof(peer->addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if(poll(&pfd, 1, CLUSTER_CONNECT_MS) != 1 ||
+       getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    struct timeval timeout = {.tv_sec = CLUSTER_TIMEOUT};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static bool relayed(const char* name, size_t len) {
+    static const char* const dropped[] = {"Connection",
+                                          "Keep-Alive",
+                                          "Transfer-Encoding",
+                                          "Content-Length",
+                                          "Content-Type",
+                                          "Vary"};
+    for(size_t i = 0; i < sizeof(dropped) / sizeof(dropped[0]); i++) {
+        if(strlen(dropped[i]) == len && strncasecmp(name, dropped[i], len) == 0)
+            return false;
+    }
+    return true;
+}
+
+// Parses the response read into o->buf. A malformed or truncated one
+// becomes a 502 for the client.
+static void parse_response(Object* o, size_t len) {
+    char* end = memmem(o->buf, len, "\r\n\r\n", 4);
+    int status;
+    int reason_at;
+    if(!end || sscanf(o->buf, "HTTP/1.%*d %3d %n", &status, &reason_at) != 1 ||
+       status < 100 || status > 599) {
+        o->status = 502;
+        return;
+    }
+    *end = '\0';
+    char* line_end = strstr(o->buf, "\r\n");
+    size_t head_len = (size_t) (end - o->buf);
+    o->headers = malloc(head_len + 1);
+    o->reason = strndup(o->buf + reason_at,
+                        line_end ? (size_t) (line_end - o->buf - reason_at) :
+                                   0);
+    if(!o->headers || !o->reason || !line_end) {
+        o->status = 502;
+        return;
+    }
+
+    size_t headers_len = 0;
+    long long content_length = -1;
+    for(char* line = line_end + 2; line < end;) {
+        char* next = strstr(line, "\r\n");
+        if(!next) next = end;
+        char* colon = memchr(line, ':', (size_t) (next - line));
+        if(colon) {
+            size_t name_len = (size_t) (colon - line);
+            char* value = colon + 1 + strspn(colon + 1, " \t");
+            size_t value_len = (size_t) (next - value);
+            if(name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+                content_length = strtoll(value, NULL, 10);
+            if(name_len == 12 && strncasecmp(line, "Content-Type", 12) == 0)
+                o->content_type = strndup(value, value_len);
+            if(relayed(line, name_len)) {
+                memcpy(o->headers + headers_len, line, (size_t) (next - line));
+                headers_len += (size_t) (next - line);
+                memcpy(o->headers + headers_len, "\r\n", 2);
+                headers_len += 2;
+            }
+        }
+        line = next + 2;
+    }
+    o->headers[headers_len] = '\0';
+
+    o->body = end + 4;
+    o->body_len = len - (size_t) (o->body - o->buf);
+    if(content_length >= 0 && (size_t) content_length != o->body_len) {
+        o->status = 502;
+        return;
+    }
+    o->status = status;
+}
+
+// Fetches target from peer into o. Returns -1 if the peer could not be
+// reached, 0 otherwise (o->status is 502 for a broken answer).
+static int fetch(const Peer* peer, const char* target, Object* o) {
+    int fd = connect_peer(peer);
+    if(fd < 0) return -1;
+
+    char request[PATH_MAX * 3 + 512];
+    int request_len = snprintf(request,
+                               sizeof(request),
+                               "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                               "Connection: close\r\n%s: %s\r\n\r\n",
+                               target,
+                               peer->name,
+                               CLUSTER_HOP_HEADER,
+                               hop_value);
+    if(request_len < 0 || (size_t) request_len >= sizeof(request) ||
+       send(fd, request, (size_t) request_len, MSG_NOSIGNAL) != request_len) {
+        close(fd);
+        return -1;
+    }
+
+    size_t cap = READ_CHUNK, len = 0;
+    o->buf = malloc(cap);
+    while(o->buf) {
+        if(len == cap) {
+            char* bigger = cap < CLUSTER_OBJECT_MAX ? realloc(o->buf, cap * 2) :
+                                                      NULL;
+            if(!bigger) break;
+            o->buf = bigger;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, o->buf + len, cap - len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            if(n == 0) parse_response(o, len);
+            break;
+        }
+        len += (size_t) n;
+    }
+    close(fd);
+    if(o->status == 0) o->status = 502;    // Read error, timeout or too big
+    return 0;
+}
+
+static void object_free(Object* o) {
+    free(o->key);
+    free(o->reason);
+    free(o->content_type);
+    free(o->headers);
+    free(o->buf);
+    free(o);
+}
+
+static void lru_unlink(Object* o) {
+    if(o->lru_prev) o->lru_prev->lru_next = o->lru_next;
+    else if(lru_head == o)
+        lru_head = o->lru_next;
+    if(o->lru_next) o->lru_next->lru_prev = o->lru_prev;
+    else if(lru_tail == o)
+        lru_tail = o->lru_prev;
+    o->lru_prev = o->lru_next = NULL;
+}
+
+static void lru_push(Object* o) {
+    o->lru_next = lru_head;
+    if(lru_head) lru_head->lru_prev = o;
+    lru_head = o;
+    if(!lru_tail) lru_tail = o;
+}
+
+static void object_put(Object* o) {
+    if(--o->refs == 0) object_free(o);
+}
+
+// Takes an object out of the table; requests using it keep it alive
+static void object_unlink(Object* o) {
+    Object** link = &table[o->hash % CACHE_BUCKETS];
+    while(*link != o) link = &(*link)->next;
+    *link = o->next;
+    if(o->cached) {
+        lru_unlink(o);
+        cache_bytes -= o->body_len;
+        cache_objects--;
+    }
+    free(o->key);
+    o->key = NULL;
+    object_put(o);
+}
+
+// Returns the answer for a segment, fetched once by the first request while
+// the others wait for it. The caller puts the returned reference.
+static Object* fetch_segment(const Peer* peer,
+                             const char* key,
+                             const char* target) {
+    uint64_t hash = fnv1a(key);
+    time_t now = time(NULL);
+    pthread_mutex_lock(&cache_lock);
+    Object* o = table[hash % CACHE_BUCKETS];
+    while(o && (o->hash != hash || strcmp(o->key, key) != 0)) o = o->next;
+    if(o && o->done && now - o->fetched >= CLUSTER_CACHE_TTL) {
+        object_unlink(o);
+        o = NULL;
+    }
+    if(o) {
+        o->refs++;
+        if(o->done) {
+            hits++;
+            lru_unlink(o);
+            lru_push(o);
+        } else {
+            coalesced++;
+            while(!o->done) pthread_cond_wait(&cache_cond, &cache_lock);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return o;
+    }
+
+    o = calloc(1, sizeof(Object));
+    char* key_copy = strdup(key);
+    if(!o || !key_copy) {
+        pthread_mutex_unlock(&cache_lock);
+        free(o);
+        free(key_copy);
+        return NULL;
+    }
+    o->key = key_copy;
+    o->hash = hash;
+    o->refs = 2;    // The table and this request
+    o->next = table[hash % CACHE_BUCKETS];
+    table[hash % CACHE_BUCKETS] = o;
+    misses++;
+    pthread_mutex_unlock(&cache_lock);
+
+    bool reached = fetch(peer, target, o) == 0;
+
+    pthread_mutex_lock(&cache_lock);
+    o->done = true;
+    o->fetched = now;
+    if(!reached) o->status = 0;
+    if(o->status == 200 && o->body_len <= CLUSTER_CACHE_SIZE) {
+        o->cached = true;
+        lru_push(o);
+        cache_bytes += o->body_len;
+        cache_objects++;
+        while(cache_bytes > CLUSTER_CACHE_SIZE) object_unlink(lru_tail);
+    } else {
+        object_unlink(o);
+    }
+    pthread_cond_broadcast(&cache_cond);
+    pthread_mutex_unlock(&cache_lock);
+    return o;
+}
+
+static Object* fetch_once(const Peer* peer, const char* target) {
+    Object* o = calloc(1, sizeof(Object));
+    if(!o) return NULL;
+    o->refs = 1;
+    o->done = true;
+    if(fetch(peer, target, o) != 0) o->status = 0;
+    return o;
+}
+
+static void object_release(void* ctx) {
+    pthread_mutex_lock(&cache_lock);
+    object_put(ctx);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Points resp at the owner's answer, which the request keeps a reference
+// to until its arena is reset, applying the request's range to whole bodies
+static void answer(const Request* req,
+                   Arena* arena,
+                   Object* o,
+                   Response* resp) {
+    if(o->status == 502) {    // Set here, for a broken answer
+        resp->status = 502;
+        resp->reason = "Bad Gateway";
+        resp->close = true;
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    o->refs++;
+    pthread_mutex_unlock(&cache_lock);
+    if(arena_defer(arena, object_release, o) != 0) {
+        object_release(o);
+        resp->status = 500;
+        resp->reason = "Error";
+        resp->close = true;
+        return;
+    }
+    resp->status = o->status;
+    resp->reason = o->reason;
+    resp->content_type = o->content_type;
+    resp->headers = o->headers;
+    resp->body = o->body;
+    resp->body_len = o->body_len;
+    resp->traffic = TRAFFIC_STREAM;
+
+    if(req->range_request && o->status == 200) {
+        off_t start = req->range_start, end = req->range_end;
+        if(normalizeranges(&start, &end, (off_t) o->body_len) != 0) {
+            resp->status = 416;
+            resp->reason = "Range Not Satisfiable";
+            resp->content_type = NULL;
+            resp->headers = arena_sprintf(
+                arena, "Content-Range: bytes */%zu\r\n", o->body_len);
+            resp->body = NULL;
+            resp->body_len = 0;
+            return;
+        }
+        resp->status = 206;
+        resp->reason = "Partial Content";
+        resp->headers = arena_sprintf(arena,
+                                      "%sContent-Range: bytes %jd-%jd/%zu\r\n",
+                                      o->headers,
+                                      (intmax_t) start,
+                                      (intmax_t) end,
+                                      o->body_len);
+        resp->body = o->body + start;
+        resp->body_len = (size_t) (end - start + 1);
+    }
+}
+
+static bool is_segment(const char* path) {
+    size_t len = strlen(path);
+    return len > 3 && strcmp(path + len - 3, ".ts") == 0;
+}
+
+int cluster_proxy(const Request* req, Arena* arena, Response* resp) {
+    uint64_t id;
+    if(!enabled || request_header(req, CLUSTER_HOP_HEADER) ||
+       !conversion_key(req, &id))
+        return -1;
+
+    char* target = arena_alloc(arena, strlen(req->path) * 3 + 2);
+    if(!target) return -1;
+    target[0] = '/';
+    urlencode(target + 1, req->path);
+    if(req->query[0])
+        target = arena_sprintf(arena, "%s?%s", target, req->query);
+    bool cacheable = is_segment(req->path) && !req->query[0];
+
+    // An unreachable owner hands its titles to the next peer on the ring
+    for(int attempt = 0; attempt < peer_count; attempt++) {
+        int owner = ring_owner(id);
+        if(owner < 0 || peers[owner].self) return -1;
+        Peer* peer = &peers[owner];
+        Object* o = cacheable ? fetch_segment(peer, req->path, target) :
+                                fetch_once(peer, target);
+        if(!o) return -1;
+        if(o->status != 0) {
+            __atomic_fetch_add(&proxied, 1, __ATOMIC_RELAXED);
+            answer(req, arena, o, resp);
+        } else {
+            __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+            time_t now = time(NULL);
+            if(__atomic_exchange_n(&peer->down_until,
+                                   now + CLUSTER_RETRY,
+                                   __ATOMIC_RELAXED) <= now)
+                fprintf(stderr,
+                        "[Cluster] %s unreachable, skipping it for %d s\n",
+                        peer->name,
+                        CLUSTER_RETRY);
+        }
+        pthread_mutex_lock(&cache_lock);
+        int status = o->status;
+        object_put(o);
+        pthread_mutex_unlock(&cache_lock);
+        if(status != 0) return 0;
+    }
+    return -1;
+}
+
+void cluster_dump_stats(FILE* out) {
+    if(!enabled) return;
+    pthread_mutex_lock(&cache_lock);
+    fprintf(out,
+            "[Cluster] %" PRIu64 " proxied, %" PRIu64 " cache hits, %" PRIu64
+            " misses, %" PRIu64 " coalesced, %" PRIu64
+            " unreachable; %zu segments (%zu B) cached\n",
+            __atomic_load_n(&proxied, __ATOMIC_RELAXED),
+            hits,
+            misses,
+            coalesced,
+            __atomic_load_n(&failures, __ATOMIC_RELAXED),
+            cache_objects,
+            cache_bytes);
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,380 @@
+#define _DEFAULT_SOURCE
+#include "compress.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+typedef struct CacheEntry {
+    char* key;    // NULL for a free slot
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    Encoding encoding;    // Requested coding
+    Encoding used;        // Coding of body
+    char* body;
+    size_t len;
+    unsigned long last_used;
+} CacheEntry;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static CacheEntry cache[COMPRESS_CACHE];
+static unsigned long cache_clock = 0;
+
+static const char* const names[ENCODING_COUNT] = {
+    "identity", "gzip", "zstd", "br"};
+static const char* const suffixes[ENCODING_COUNT] = {"", ".gz", ".zst", ".br"};
+
+static unsigned supported(void) {
+    unsigned mask = 1u << ENCODING_GZIP;
+#ifdef HAVE_ZSTD
+    mask |= 1u << ENCODING_ZSTD;
+#endif
+#ifdef HAVE_BROTLI
+    mask |= 1u << ENCODING_BROTLI;
+#endif
+    return mask;
+}
+
+unsigned compress_accepted(const char* accept_encoding) {
+    if(!accept_encoding) return 0;
+
+    // Named codings take precedence over "*", whatever the order
+    unsigned accepted = 0, named = 0;
+    bool star = false;
+    const char* p = accept_encoding;
+    while(*p) {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, ",");
+        if(len == 0) break;
+        size_t name_len = strcspn(p, "; \t,");
+
+        double q = 1.0;
+        const char* param = memchr(p, ';', len);
+        while(param) {
+            param++;
+            param += strspn(param, " \t");
+            if((param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                q = strtod(param + 2, NULL);
+            size_t rest = len - (size_t) (param - p);
+            param = memchr(param, ';', rest);
+        }
+
+        unsigned bits = 0;
+        if((name_len == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+           (name_len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            bits = 1u << ENCODING_GZIP;
+        } else if(name_len == 4 && strncasecmp(p, "zstd", 4) == 0) {
+            bits = 1u << ENCODING_ZSTD;
+        } else if(name_len == 2 && strncasecmp(p, "br", 2) == 0) {
+            bits = 1u << ENCODING_BROTLI;
+        } else if(name_len == 1 && p[0] == '*') {
+            star = q > 0;
+        }
+        named |= bits;
+        if(q > 0) accepted |= bits;
+        p += len;
+    }
+    if(star) accepted |= ~named;
+    return accepted & supported();
+}
+
+Encoding compress_preferred(unsigned accepted) {
+    for(int e = ENCODING_COUNT - 1; e > ENCODING_IDENTITY; e--) {
+        if(accepted & (1u << e)) return (Encoding) e;
+    }
+    return ENCODING_IDENTITY;
+}
+
+const char* compress_name(Encoding encoding) {
+    return names[encoding];
+}
+
+const char* compress_suffix(Encoding encoding) {
+    return suffixes[encoding];
+}
+
+bool compress_text_type(const char* content_type) {
+    return strncmp(content_type, "text/", 5) == 0 ||
+           strcmp(content_type, "application/vnd.apple.mpegurl") == 0 ||
+           strcmp(content_type, "application/json") == 0 ||
+           strcmp(content_type, "application/javascript") == 0;
+}
+
+static size_t encode_bound(Encoding encoding, size_t len) {
+    switch(encoding) {
+#ifdef HAVE_BROTLI
+        case ENCODING_BROTLI: return BrotliEncoderMaxCompressedSize(len);
+#endif
+#ifdef HAVE_ZSTD
+        case ENCODING_ZSTD: return ZSTD_compressBound(len);
+#endif
+        case ENCODING_GZIP: return compressBound(len) + 32;    // gzip wrapper
+        default: return 0;
+    }
+}
+
+// Compresses src into dst, whose capacity is *dst_len on entry. best picks
+// the slowest level, for output that is written once and served many times.
+static int encode(Encoding encoding,
+                  bool best,
+                  const void* src,
+                  size_t len,
+                  void* dst,
+                  size_t* dst_len) {
+    switch(encoding) {
+        case ENCODING_GZIP: {
+            if(len > UINT_MAX || *dst_len > UINT_MAX) return -1;
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            if(deflateInit2(&zs,
+                            best ? Z_BEST_COMPRESSION : Z_DEFAULT_COMPRESSION,
+                            Z_DEFLATED,
+                            15 + 16,    // gzip wrapper
+                            8,
+                            Z_DEFAULT_STRATEGY) != Z_OK)
+                return -1;
+            zs.next_in = (Bytef*) src;
+            zs.avail_in = (uInt) len;
+            zs.next_out = dst;
+            zs.avail_out = (uInt) *dst_len;
+            int ret = deflate(&zs, Z_FINISH);
+            *dst_len = zs.total_out;
+            deflateEnd(&zs);
+            return ret == Z_STREAM_END ? 0 : -1;
+        }
+#ifdef HAVE_BROTLI
+        case ENCODING_BROTLI:
+            return BrotliEncoderCompress(best ? BROTLI_MAX_QUALITY : 5,
+                                         BROTLI_DEFAULT_WINDOW,
+                                         BROTLI_MODE_TEXT,
+                                         len,
+                                         src,
+                                         dst_len,
+                                         dst) ?
+                       0 :
+                       -1;
+#endif
+#ifdef HAVE_ZSTD
+        case ENCODING_ZSTD: {
+            size_t ret = ZSTD_compress(dst, *dst_len, src, len, best ? 19 : 3);
+            if(ZSTD_isError(ret)) return -1;
+            *dst_len = ret;
+            return 0;
+        }
+#endif
+        default: return -1;
+    }
+}
+
+int compress_buffer(Encoding encoding,
+                    const void* src,
+                    size_t len,
+                    Arena* arena,
+                    char** out,
+                    size_t* out_len) {
+    size_t cap = encode_bound(encoding, len);
+    char* dst = cap ? arena_alloc(arena, cap) : NULL;
+    if(!dst || encode(encoding, false, src, len, dst, &cap) != 0) return -1;
+    *out = dst;
+    *out_len = cap;
+    return 0;
+}
+
+static int write_sibling(const char* path, const void* data, size_t len) {
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    if(!f) return -1;
+    bool ok = fwrite(data, 1, len, f) == len;
+    if(fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int compress_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if(!f) return -1;
+    struct stat st;
+    char* src = NULL;
+    size_t len = 0;
+    if(fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+        len = (size_t) st.st_size;
+        src = malloc(len);
+        if(src && fread(src, 1, len, f) != len) {
+            free(src);
+            src = NULL;
+        }
+    }
+    fclose(f);
+    if(!src) return -1;
+
+    int ret = 0;
+    for(int e = ENCODING_IDENTITY + 1; e < ENCODING_COUNT; e++) {
+        if(!(supported() & (1u << e))) continue;
+        char sibling[PATH_MAX + 8];
+        snprintf(sibling, sizeof(sibling), "%s%s", path, suffixes[e]);
+        size_t cap = encode_bound((Encoding) e, len);
+        char* dst = malloc(cap);
+        if(dst && encode((Encoding) e, true, src, len, dst, &cap) == 0 &&
+           cap < len) {
+            if(write_sibling(sibling, dst, cap) != 0) ret = -1;
+        } else {
+            unlink(sibling);    // Not worth it, don't leave a stale one
+        }
+        free(dst);
+    }
+    free(src);
+    return ret;
+}
+
+static bool has_suffix(const char* name, const char* suffix) {
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+void compress_playlists(const char* dir) {
+    DIR* d = opendir(dir);
+    if(!d) return;
+    struct dirent* entry;
+    while((entry = readdir(d)) != NULL) {
+        if(!has_suffix(entry->d_name, ".m3u8") &&
+           !has_suffix(entry->d_name, ".vtt"))
+            continue;
+        char path[PATH_MAX * 2 + 2];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if(compress_file(path) != 0)
+            fprintf(stderr, "[Compress] Could not compress %s\n", path);
+    }
+    closedir(d);
+}
+
+static bool same_source(const CacheEntry* entry, const struct stat* st) {
+    return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+int compress_cache_get(const char* key,
+                       const struct stat* st,
+                       Encoding encoding,
+                       Arena* arena,
+                       const char** body,
+                       size_t* len,
+                       Encoding* used) {
+    int ret = -1;
+    pthread_mutex_lock(&cache_lock);
+    for(int i = 0; i < COMPRESS_CACHE; i++) {
+        CacheEntry* entry = &cache[i];
+        if(!entry->key || entry->encoding != encoding ||
+           strcmp(entry->key, key) != 0 || !same_source(entry, st))
+            continue;
+        char* copy = arena_alloc(arena, entry->len);
+        if(copy) {
+            memcpy(copy, entry->body, entry->len);
+            *body = copy;
+            *len = entry->len;
+            *used = entry->used;
+            entry->last_used = ++cache_clock;
+            ret = 0;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+void compress_cache_put(const char* key,
+                        const struct stat* st,
+                        Encoding encoding,
+                        const char* body,
+                        size_t len,
+                        Encoding used) {
+    char* key_copy = strdup(key);
+    char* body_copy = malloc(len ? len : 1);
+    if(!key_copy || !body_copy) {
+        free(key_copy);
+        free(body_copy);
+        return;
+    }
+    memcpy(body_copy, body, len);
+
+    pthread_mutex_lock(&cache_lock);
+    // Same key and coding first, then a free slot, then the oldest
+    CacheEntry* slot = NULL;
+    for(int i = 0; i < COMPRESS_CACHE; i++) {
+        CacheEntry* entry = &cache[i];
+        if(entry->key && entry->encoding == encoding &&
+           strcmp(entry->key, key) == 0) {
+            slot = entry;
+            break;
+        }
+        if(!slot || (slot->key && (!entry->key ||
+                                   entry->last_used < slot->last_used)))
+            slot = entry;
+    }
+    free(slot->key);
+    free(slot->body);
+    slot->key = key_copy;
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->mtime = st->st_mtim;
+    slot->encoding = encoding;
+    slot->used = used;
+    slot->body = body_copy;
+    slot->len = len;
+    slot->last_used = ++cache_clock;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void compress_cache_foreach(void (*fn)(void* ctx,
+                                       const char* key,
+                                       const struct stat* st,
+                                       Encoding encoding,
+                                       Encoding used,
+                                       const char* body,
+                                       size_t len),
+                            void* ctx) {
+    pthread_mutex_lock(&cache_lock);
+    // Selection by last_used, the cache is small
+    unsigned long below = ULONG_MAX;
+    for(;;) {
+        CacheEntry* next = NULL;
+        for(int i = 0; i < COMPRESS_CACHE; i++) {
+            CacheEntry* entry = &cache[i];
+            if(entry->key && entry->last_used < below &&
+               (!next || entry->last_used > next->last_used))
+                next = entry;
+        }
+        if(!next) break;
+        below = next->last_used;
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_dev = next->dev;
+        st.st_ino = next->ino;
+        st.st_mtim = next->mtime;
+        fn(ctx,
+           next->key,
+           &st,
+           next->encoding,
+           next->used,
+           next->body,
+           next->len);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
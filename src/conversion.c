@@ -0,0 +1,865 @@
+#define _DEFAULT_SOURCE
+#include "conversion.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "ffmpeg_utils.h"
+#include "thumbnails.h"
+
+#define CHECKPOINT_TIMEOUT 10      // Seconds to wait for ffmpeg to exit
+#define ADOPT_POLL_MS      500     // How often an adopted ffmpeg is checked
+#define REGISTRY_BUCKETS   1024    // Hash buckets of the job registry
+#define EVICT_GRACE        300     // Seconds a watched conversion is kept
+
+typedef enum JobState {
+    JOB_RUNNING,
+    JOB_READY,
+    JOB_FAILED,
+    JOB_EVICTED    // Output removed for the quota, converted again on demand
+} JobState;
+
+static const char state_codes[] = "RDFE";    // Registry file, by JobState
+
+// One entry per source ever converted. Entries are only added, never
+// unlinked or freed, so readers walk the chains without the lock; state and
+// mtime_ns are written atomically under jobs_lock.
+typedef struct ConversionJob {
+    char* mkv_path;
+    char* hls_dir;
+    uint64_t id;            // hash_path(mkv_path), names output in the cache
+    int64_t mtime_ns;       // Source mtime the state applies to
+    int state;              // JobState
+    int64_t size;           // Bytes of ready output, -1 until measured
+    int64_t last_access;    // Time the output was last served
+    pid_t pid;              // ffmpeg process group while it runs, 0 otherwise
+                            // (also one adopted from the previous process)
+    bool running;           // A worker thread owns the job
+    struct ConversionJob* next;
+} ConversionJob;
+
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static ConversionJob* registry[REGISTRY_BUCKETS];
+static bool stopping = false;    // Written under jobs_lock, read by workers
+static bool handed_off = false;    // The next process owns ffmpeg and journal
+static bool record_pids = false;    // Journal the process groups, for handoff
+static char journal_path[PATH_MAX] = JOURNAL_FILE;
+static char output_dir[PATH_MAX - 32];    // Empty: next to the sources
+static int output_fd = -1;
+static uint64_t output_quota;    // Bytes, 0 for no limit
+static uint64_t evictions;
+
+// Output moved out of the way under jobs_lock, deleted once it is released
+typedef struct Trash {
+    struct Trash* next;
+    char path[];
+} Trash;
+
+static Trash* trash;
+static unsigned trash_seq;
+
+static int exists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+static int64_t mtime_ns(const struct stat* st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static uint64_t hash_path(const char* path) {
+    uint64_t h = 14695981039346656037ull;    // FNV-1a
+    for(; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t conversion_id(const char* mkv_path) {
+    return hash_path(mkv_path);
+}
+
+// Removes name below dirfd and, for a directory, everything in it. Symlinks
+// are removed, not followed.
+static void remove_tree(int dirfd, const char* name) {
+    if(unlinkat(dirfd, name, 0) == 0 || (errno != EISDIR && errno != EPERM))
+        return;
+    int fd = openat(
+        dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if(!dir) {
+        if(fd >= 0) close(fd);
+        return;
+    }
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            remove_tree(fd, entry->d_name);
+    }
+    closedir(dir);
+    unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+// Clears a conversion's output. The thumbnails only depend on the source and
+// are kept.
+static void remove_output(const char* hls_dir) {
+    DIR* dir = opendir(hls_dir);
+    if(!dir) return;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strcmp(entry->d_name, ".") != 0 &&
+           strcmp(entry->d_name, "..") != 0 &&
+           strcmp(entry->d_name, THUMB_DIR) != 0)
+            remove_tree(dirfd(dir), entry->d_name);
+    }
+    closedir(dir);
+}
+
+// Moves a conversion's output aside for purge_trash(), putting the
+// thumbnails back in hls_dir. Deleting gigabytes of segments under jobs_lock
+// would stall every segment request, renaming takes a few syscalls. Caller
+// holds jobs_lock.
+static void discard_output(const char* hls_dir) {
+    const char* slash = strrchr(hls_dir, '/');
+    int dir_len = slash ? (int) (slash - hls_dir + 1) : 0;
+    size_t len = strlen(hls_dir) + 48;
+    Trash* t = malloc(sizeof(Trash) + len);
+    if(!t) {
+        remove_output(hls_dir);
+        return;
+    }
+    // Hidden, next to the output so the rename stays on its filesystem
+    snprintf(t->path,
+             len,
+             "%.*s.%s.trash.%d.%u",
+             dir_len,
+             hls_dir,
+             hls_dir + dir_len,
+             (int) getpid(),
+             trash_seq++);
+    if(rename(hls_dir, t->path) != 0) {
+        if(errno != ENOENT) remove_output(hls_dir);
+        free(t);
+        return;
+    }
+    char from[PATH_MAX + 64], to[PATH_MAX + 16];
+    snprintf(from, sizeof(from), "%s/" THUMB_DIR, t->path);
+    snprintf(to, sizeof(to), "%s/" THUMB_DIR, hls_dir);
+    if(exists(from) && mkdir(hls_dir, 0755) == 0) rename(from, to);
+    t->next = trash;
+    trash = t;
+}
+
+// Deletes the output discarded so far. Called without jobs_lock.
+static void purge_trash(void) {
+    pthread_mutex_lock(&jobs_lock);
+    Trash* t = trash;
+    trash = NULL;
+    pthread_mutex_unlock(&jobs_lock);
+    while(t) {
+        Trash* next = t->next;
+        remove_tree(AT_FDCWD, t->path);
+        free(t);
+        t = next;
+    }
+}
+
+// True if hls_dir holds anything besides the thumbnails
+static bool has_output(const char* hls_dir) {
+    DIR* dir = opendir(hls_dir);
+    if(!dir) return false;
+    bool found = false;
+    struct dirent* entry;
+    while(!found && (entry = readdir(dir)) != NULL) {
+        found = strcmp(entry->d_name, ".") != 0 &&
+                strcmp(entry->d_name, "..") != 0 &&
+                strcmp(entry->d_name, THUMB_DIR) != 0;
+    }
+    closedir(dir);
+    return found;
+}
+
+// Bytes used by a conversion's output, without the thumbnails
+static int64_t output_size(const char* hls_dir) {
+    DIR* dir = opendir(hls_dir);
+    if(!dir) return 0;
+    int64_t size = 0;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if(strcmp(entry->d_name, THUMB_DIR) != 0 &&
+           fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+           S_ISREG(st.st_mode))
+            size += (int64_t) st.st_blocks * 512;
+    }
+    closedir(dir);
+    return size;
+}
+
+// Both lookups are safe without jobs_lock; jobs are chained by id
+static ConversionJob* find_job(const char* mkv_path, uint64_t hash) {
+    ConversionJob* job = __atomic_load_n(&registry[hash % REGISTRY_BUCKETS],
+                                         __ATOMIC_ACQUIRE);
+    for(; job; job = job->next) {
+        if(job->id == hash && strcmp(job->mkv_path, mkv_path) == 0)
+            return job;
+    }
+    return NULL;
+}
+
+static ConversionJob* find_job_id(uint64_t id) {
+    ConversionJob* job = __atomic_load_n(&registry[id % REGISTRY_BUCKETS],
+                                         __ATOMIC_ACQUIRE);
+    for(; job; job = job->next) {
+        if(job->id == id) return job;
+    }
+    return NULL;
+}
+
+// Adds a job in the given state. Caller holds jobs_lock.
+static ConversionJob* add_job(const char* mkv_path,
+                              const char* hls_dir,
+                              JobState state,
+                              int64_t mtime) {
+    ConversionJob* job = calloc(1, sizeof(ConversionJob));
+    if(job) {
+        job->mkv_path = strdup(mkv_path);
+        job->hls_dir = strdup(hls_dir);
+    }
+    if(!job || !job->mkv_path || !job->hls_dir) {
+        if(job) {
+            free(job->mkv_path);
+            free(job->hls_dir);
+        }
+        free(job);
+        return NULL;
+    }
+    job->id = hash_path(mkv_path);
+    job->mtime_ns = mtime;
+    job->state = state;
+    job->size = -1;
+    job->last_access = time(NULL);
+
+    // Published fully initialized, after which only state and mtime change
+    ConversionJob** bucket = &registry[job->id % REGISTRY_BUCKETS];
+    job->next = *bucket;
+    __atomic_store_n(bucket, job, __ATOMIC_RELEASE);
+    return job;
+}
+
+static void set_state(ConversionJob* job, JobState state, int64_t mtime) {
+    __atomic_store_n(&job->mtime_ns, mtime, __ATOMIC_RELAXED);
+    __atomic_store_n(&job->state, state, __ATOMIC_RELEASE);
+}
+
+// Rewrites the registry file: state, source mtime, output size, last access,
+// ffmpeg process group, source and output directory per line. The process
+// groups are only recorded by conversion_handoff(): after a crash the pids
+// may have been reused. Caller holds jobs_lock.
+static void save_journal(void) {
+    if(handed_off) return;
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", journal_path);
+    FILE* f = fopen(tmp, "w");
+    if(!f) {
+        fprintf(stderr, "[Manager] Could not write %s\n", tmp);
+        return;
+    }
+    for(size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+        for(ConversionJob* job = registry[i]; job; job = job->next) {
+            pid_t pid = record_pids && job->state == JOB_RUNNING ?
+                            __atomic_load_n(&job->pid, __ATOMIC_ACQUIRE) :
+                            0;
+            fprintf(f,
+                    "%c\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%d\t%s\t%s\n",
+                    state_codes[job->state],
+                    job->mtime_ns,
+                    job->size,
+                    __atomic_load_n(&job->last_access, __ATOMIC_RELAXED),
+                    (int) pid,
+                    job->mkv_path,
+                    job->hls_dir);
+        }
+    }
+    if(fclose(f) != 0 || rename(tmp, journal_path) != 0) {
+        fprintf(stderr, "[Manager] Could not write %s\n", journal_path);
+        unlink(tmp);
+    }
+}
+
+// Adds the jobs of the registry file that are not known yet. Lines of the
+// older formats (without process group, without size and last access, or
+// only source and output directory for running jobs) are accepted too.
+// Caller holds jobs_lock.
+static void load_journal(void) {
+    FILE* f = fopen(journal_path, "r");
+    if(!f) return;
+
+    char line[PATH_MAX * 2 + 32];
+    while(fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* fields[7];
+        int count = 0;
+        for(char* p = line; count < 7; count++) {
+            fields[count] = p;
+            p = strchr(p, '\t');
+            if(!p) {
+                count++;
+                break;
+            }
+            *p++ = '\0';
+        }
+
+        // Blank, truncated or hand-edited lines are skipped
+        if(count != 2 && count != 4 && count != 6 && count != 7) continue;
+
+        JobState state = JOB_RUNNING;
+        int64_t mtime = 0, size = -1, last_access = -1;
+        pid_t pid = 0;
+        const char* mkv_path = fields[count - 2];
+        const char* hls_dir = fields[count - 1];
+        if(count >= 4) {
+            const char* code = strchr(state_codes, fields[0][0]);
+            if(!fields[0][0] || !code) continue;
+            state = (JobState) (code - state_codes);
+            mtime = strtoll(fields[1], NULL, 10);
+        }
+        if(count >= 6) {
+            size = strtoll(fields[2], NULL, 10);
+            last_access = strtoll(fields[3], NULL, 10);
+        }
+        if(count == 7) pid = (pid_t) strtol(fields[4], NULL, 10);
+        if(find_job(mkv_path, hash_path(mkv_path))) continue;
+        ConversionJob* job = add_job(mkv_path, hls_dir, state, mtime);
+        if(job && count >= 6) {
+            job->size = size;
+            job->last_access = last_access;
+        }
+        if(job && state == JOB_RUNNING && pid > 0) job->pid = pid;
+    }
+    fclose(f);
+}
+
+// Evicts the least recently served outputs until the ready ones fit the
+// quota. Outputs served within EVICT_GRACE may be playing and are kept, as
+// are running conversions, which are not counted. Caller holds jobs_lock
+// and calls purge_trash() after releasing it.
+static void enforce_quota(void) {
+    if(!output_quota) return;
+
+    int64_t total = 0;
+    for(size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+        for(ConversionJob* job = registry[i]; job; job = job->next) {
+            if(job->state != JOB_READY) continue;
+            if(job->size < 0) job->size = output_size(job->hls_dir);
+            total += job->size;
+        }
+    }
+
+    int64_t now = time(NULL);
+    while(total > (int64_t) output_quota) {
+        ConversionJob* victim = NULL;
+        for(size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+            for(ConversionJob* job = registry[i]; job; job = job->next) {
+                int64_t last_access =
+                    __atomic_load_n(&job->last_access, __ATOMIC_RELAXED);
+                if(job->state != JOB_READY || job->running ||
+                   now - last_access < EVICT_GRACE)
+                    continue;
+                if(!victim || last_access < victim->last_access) victim = job;
+            }
+        }
+        if(!victim) {
+            fprintf(stderr,
+                    "[Manager] Output over quota, all of it recently used\n");
+            break;
+        }
+
+        printf("[Manager] Evicting %s (%" PRId64 " bytes)\n",
+               victim->mkv_path,
+               victim->size);
+        set_state(victim, JOB_EVICTED, victim->mtime_ns);
+        discard_output(victim->hls_dir);    // Thumbnails stay
+        total -= victim->size;
+        victim->size = 0;
+        evictions++;
+    }
+}
+
+// Waits for an ffmpeg handed over by the previous process, which keeps
+// writing into hls_dir while viewers play it. Returns 0 if it finished the
+// output. Otherwise, unless stopping, the output is converted again.
+static int adopt_ffmpeg(ConversionJob* job) {
+    pid_t pid = __atomic_load_n(&job->pid, __ATOMIC_ACQUIRE);
+    // Not our child: polled until the group is gone. A checkpoint stops it
+    // through job->pid like any other.
+    while(kill(-pid, 0) == 0 || errno == EPERM) usleep(ADOPT_POLL_MS * 1000);
+    __atomic_store_n(&job->pid, 0, __ATOMIC_RELEASE);
+    if(conversion_output_finished(job->hls_dir)) return 0;
+    if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) return -1;
+
+    printf("[Worker] Adopted conversion did not finish, converting again: "
+           "%s\n",
+           job->mkv_path);
+    pthread_mutex_lock(&jobs_lock);
+    discard_output(job->hls_dir);
+    pthread_mutex_unlock(&jobs_lock);
+    purge_trash();
+    mkdir(job->hls_dir, 0755);
+    return generate_hls_with_tracks(
+        job->mkv_path, job->hls_dir, &job->pid, &stopping);
+}
+
+static void* conversion_worker(void* arg) {
+    ConversionJob* job = (ConversionJob*) arg;
+    int ret;
+    if(__atomic_load_n(&job->pid, __ATOMIC_ACQUIRE) > 0) {
+        printf("[Worker] Adopting: %s\n", job->mkv_path);
+        ret = adopt_ffmpeg(job);
+    } else {
+        printf("[Worker] Starting: %s\n", job->mkv_path);
+        ret = generate_hls_with_tracks(
+            job->mkv_path, job->hls_dir, &job->pid, &stopping);
+    }
+    // The playlists are final now, compress them once for all clients
+    if(ret == 0) compress_playlists(job->hls_dir);
+
+    pthread_mutex_lock(&jobs_lock);
+    job->running = false;
+    if(handed_off) {
+        // The next process adopted the ffmpeg and records the result
+        printf("[Worker] Handed over: %s\n", job->mkv_path);
+        pthread_cond_broadcast(&jobs_cond);
+        pthread_mutex_unlock(&jobs_lock);
+        return NULL;
+    }
+    if(stopping && ret != 0) {
+        // Checkpointed: the job stays running in the registry so the next
+        // process restarts it.
+        printf("[Worker] Stopped for restart: %s\n", job->mkv_path);
+        pthread_cond_broadcast(&jobs_cond);
+        pthread_mutex_unlock(&jobs_lock);
+        return NULL;
+    }
+
+    if(ret != 0) {
+        char error_file[PATH_MAX + 16];
+        snprintf(error_file, sizeof(error_file), "%s/error.txt", job->hls_dir);
+        FILE* f = fopen(error_file, "w");
+        if(f) {
+            fprintf(f, "Failed: %d\n", ret);
+            fclose(f);
+        }
+        set_state(job, JOB_FAILED, job->mtime_ns);
+    } else {
+        printf("[Worker] Finished Successfully: %s\n", job->mkv_path);
+        job->size = output_size(job->hls_dir);
+        __atomic_store_n(&job->last_access, time(NULL), __ATOMIC_RELAXED);
+        set_state(job, JOB_READY, job->mtime_ns);
+        enforce_quota();
+    }
+
+    save_journal();
+    pthread_cond_broadcast(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+    purge_trash();
+    return NULL;
+}
+
+// Creates the output directory, marks the job running and starts its
+// worker. job is NULL for a source seen for the first time. Caller holds
+// jobs_lock.
+static int start_job(ConversionJob* job,
+                     const char* mkv_path,
+                     const char* hls_dir,
+                     int64_t mtime) {
+#ifdef _WIN32
+    _mkdir(hls_dir);
+#else
+    mkdir(hls_dir, 0755);
+#endif
+
+    // Jobs resumed from the older journal format have no mtime
+    struct stat st;
+    if(mtime == 0 && stat(mkv_path, &st) == 0) mtime = mtime_ns(&st);
+
+    if(!job) job = add_job(mkv_path, hls_dir, JOB_RUNNING, mtime);
+    if(!job) return -1;
+    job->size = -1;
+    set_state(job, JOB_RUNNING, mtime);
+
+    // After a checkpoint the job is only recorded for the next process
+    if(!stopping) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, conversion_worker, job) != 0) {
+            set_state(job, JOB_FAILED, -1);    // Retried on the next request
+            save_journal();
+            return -1;
+        }
+        pthread_detach(thread);
+        job->running = true;
+    }
+    save_journal();
+    return 1;    // Processing
+}
+
+int conversion_init(const char* path) {
+    snprintf(journal_path, sizeof(journal_path), "%s", path);
+
+    // Also used to undo a checkpoint: the stopped jobs are still running in
+    // the registry, without a worker
+    pthread_mutex_lock(&jobs_lock);
+    __atomic_store_n(&stopping, false, __ATOMIC_RELEASE);
+    handed_off = false;
+    load_journal();
+
+    int resumed = 0;
+    for(size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+        for(ConversionJob* job = registry[i]; job; job = job->next) {
+            if(job->state != JOB_RUNNING || job->running) continue;
+            // A hot restart leaves ffmpeg running, its output is kept
+            if(job->pid > 0) {
+                printf("[Manager] Adopting running conversion: %s\n",
+                       job->mkv_path);
+            } else {
+                printf("[Manager] Resuming interrupted conversion: %s\n",
+                       job->mkv_path);
+                discard_output(job->hls_dir);
+            }
+            if(start_job(job, job->mkv_path, job->hls_dir, job->mtime_ns) ==
+               1)
+                resumed++;
+        }
+    }
+    enforce_quota();
+    pthread_mutex_unlock(&jobs_lock);
+    purge_trash();
+    return resumed;
+}
+
+int conversion_set_output(const char* dir, uint64_t quota) {
+    output_quota = quota;
+    if(!dir) return 0;
+
+    if(strlen(dir) >= sizeof(output_dir)) {
+        fprintf(stderr, "Output directory path too long: %s\n", dir);
+        return -1;
+    }
+    mkdir(dir, 0755);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        fprintf(stderr,
+                "Could not open output directory %s: %s\n",
+                dir,
+                strerror(errno));
+        return -1;
+    }
+    snprintf(output_dir, sizeof(output_dir), "%s", dir);
+    size_t len = strlen(output_dir);
+    while(len > 1 && output_dir[len - 1] == '/') output_dir[--len] = '\0';
+    output_fd = fd;
+    return 0;
+}
+
+void conversion_url(const char* hls_dir, char* out) {
+    size_t len = strlen(output_dir);
+    if(len && strncmp(hls_dir, output_dir, len) == 0 && hls_dir[len] == '/') {
+        snprintf(out, PATH_MAX, OUTPUT_URL_PREFIX "%s", hls_dir + len + 1);
+    } else {
+        snprintf(out, PATH_MAX, "%s", hls_dir);
+    }
+}
+
+void conversion_thumb_dir(const char* mkv_path, char* out) {
+    if(output_dir[0]) {
+        snprintf(out,
+                 PATH_MAX,
+                 "%s/%016" PRIx64 "/" THUMB_DIR,
+                 output_dir,
+                 hash_path(mkv_path));
+    } else {
+        snprintf(out, PATH_MAX, "%s.hls/" THUMB_DIR, mkv_path);
+    }
+}
+
+bool conversion_output_enabled(void) {
+    return output_fd >= 0;
+}
+
+int conversion_open_output(const char* path, PathHandle* out) {
+    if(output_fd < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    return pathcache_open_at(output_fd, path, out);
+}
+
+void conversion_touch(const char* path) {
+    ConversionJob* job = NULL;
+    size_t prefix = strlen(OUTPUT_URL_PREFIX);
+    if(strncmp(path, OUTPUT_URL_PREFIX, prefix) == 0) {
+        char* end;
+        uint64_t id = strtoull(path + prefix, &end, 16);
+        // "<id>/thumbs/<file>" is not watching either
+        if(end == path + prefix + 16 && *end == '/' &&
+           strncmp(end + 1, THUMB_DIR "/", strlen(THUMB_DIR) + 1) != 0)
+            job = find_job_id(id);
+    } else {
+        // "<source>.hls/<file>", the thumbnails are not watching
+        const char* hls = strstr(path, ".hls/");
+        if(!hls || strncmp(hls + 5, THUMB_DIR "/", strlen(THUMB_DIR) + 1) == 0)
+            return;
+        char mkv_path[PATH_MAX];
+        size_t len = (size_t) (hls - path);
+        if(len >= sizeof(mkv_path)) return;
+        memcpy(mkv_path, path, len);
+        mkv_path[len] = '\0';
+        job = find_job(mkv_path, hash_path(mkv_path));
+    }
+    if(!job) return;
+
+    // Written at most once a second, the entry is shared by all readers
+    int64_t now = time(NULL);
+    if(__atomic_load_n(&job->last_access, __ATOMIC_RELAXED) != now)
+        __atomic_store_n(&job->last_access, now, __ATOMIC_RELAXED);
+}
+
+void conversion_dump_stats(FILE* out) {
+    size_t ready = 0;
+    int64_t total = 0;
+    pthread_mutex_lock(&jobs_lock);
+    for(size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+        for(ConversionJob* job = registry[i]; job; job = job->next) {
+            if(job->state != JOB_READY) continue;
+            ready++;
+            if(job->size > 0) total += job->size;
+        }
+    }
+    fprintf(out,
+            "[Manager] %zu conversions ready, %" PRId64 " B of output, quota %"
+            PRIu64 " B, %" PRIu64 " evicted\n",
+            ready,
+            total,
+            output_quota,
+            evictions);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+int check_or_start_hls(const char* mkv_path,
+                       const struct stat* st,
+                       char* out_hls_dir) {
+    int64_t mtime = mtime_ns(st);
+    uint64_t hash = hash_path(mkv_path);
+
+    // Finished conversions are answered without the lock
+    ConversionJob* job = find_job(mkv_path, hash);
+    if(job && __atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == JOB_READY &&
+       __atomic_load_n(&job->mtime_ns, __ATOMIC_RELAXED) == mtime) {
+        snprintf(out_hls_dir, PATH_MAX, "%s", job->hls_dir);
+        return 0;
+    }
+
+    // Deciding and starting under one lock, so a job starts only once
+    pthread_mutex_lock(&jobs_lock);
+    job = find_job(mkv_path, hash);
+    if(job) {
+        snprintf(out_hls_dir, PATH_MAX, "%s", job->hls_dir);
+    } else if(output_dir[0]) {
+        snprintf(out_hls_dir, PATH_MAX, "%s/%016" PRIx64, output_dir, hash);
+    } else {
+        snprintf(out_hls_dir, PATH_MAX, "%s.hls", mkv_path);
+    }
+
+    int ret;
+    if(job && job->state == JOB_RUNNING) {
+        ret = 1;    // Running here or queued for the next process
+    } else if(job && job->state != JOB_EVICTED && job->mtime_ns == mtime) {
+        ret = job->state == JOB_READY ? 0 : -1;
+    } else if(job) {
+        printf(job->state == JOB_EVICTED ?
+                   "[Manager] Converting evicted output again: %s\n" :
+                   "[Manager] Source changed, converting again: %s\n",
+               mkv_path);
+        discard_output(out_hls_dir);
+        ret = start_job(job, mkv_path, out_hls_dir, mtime);
+    } else {
+        // Not in the registry: adopt output left by a version without one
+        char master_pl[PATH_MAX + 16];
+        snprintf(master_pl, sizeof(master_pl), "%s/master.m3u8", out_hls_dir);
+        char lock_file[PATH_MAX + 16];
+        snprintf(lock_file, sizeof(lock_file), "%s/.processing", out_hls_dir);
+
+        if(exists(lock_file)) {
+            printf("[Manager] Found stale lock file. Cleaning up %s...\n",
+                   out_hls_dir);
+            discard_output(out_hls_dir);
+        } else if(exists(master_pl)) {
+            ret = add_job(mkv_path, out_hls_dir, JOB_READY, mtime) ? 0 : -1;
+            enforce_quota();
+            save_journal();
+            pthread_mutex_unlock(&jobs_lock);
+            purge_trash();
+            return ret;
+        } else if(has_output(out_hls_dir)) {
+            printf("[Manager] Found corrupt folder. Cleaning up %s...\n",
+                   out_hls_dir);
+            discard_output(out_hls_dir);
+        }
+        ret = start_job(NULL, mkv_path, out_hls_dir, mtime);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+    purge_trash();
+    return ret;
+}
+
+// True if the playlist at path has its end tag
+static bool playlist_ended(const char* path) {
+    FILE* f = fopen(path, "r");
+    if(!f) return false;
+    bool ended = false;
+    char line[PATH_MAX];
+    while(!ended && fgets(line, sizeof(line), f))
+        ended = strncmp(line, "#EXT-X-ENDLIST", 14) == 0;
+    fclose(f);
+    return ended;
+}
+
+// Checks every playlist master.m3u8 references: that it exists, or with
+// ended that ffmpeg wrote its end tag
+static bool check_playlists(const char* hls_dir, bool ended) {
+    char path[PATH_MAX * 2 + 2];
+    snprintf(path, sizeof(path), "%s/master.m3u8", hls_dir);
+    FILE* f = fopen(path, "r");
+    if(!f) return false;
+
+    // Variant playlists are the URI lines, audio/subtitle renditions the
+    // URI="..." attributes of #EXT-X-MEDIA
+    bool ready = true;
+    char line[PATH_MAX];
+    while(ready && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char* uri = NULL;
+        char* attr = strstr(line, "URI=\"");
+        if(line[0] != '#' && line[0] != '\0') {
+            uri = line;
+        } else if(attr) {
+            uri = attr + 5;
+            char* quote = strchr(uri, '"');
+            if(quote) *quote = '\0';
+        }
+        if(!uri) continue;
+        snprintf(path, sizeof(path), "%s/%s", hls_dir, uri);
+        ready = ended ? playlist_ended(path) : exists(path);
+    }
+    fclose(f);
+    return ready;
+}
+
+bool conversion_playlists_ready(const char* hls_dir) {
+    return check_playlists(hls_dir, false);
+}
+
+bool conversion_output_finished(const char* hls_dir) {
+    return check_playlists(hls_dir, true);
+}
+
+void conversion_checkpoint(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CHECKPOINT_TIMEOUT;
+
+    pthread_mutex_lock(&jobs_lock);
+    if(handed_off) {
+        // The ffmpegs belong to the next process now
+        pthread_mutex_unlock(&jobs_lock);
+        return;
+    }
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    for(;;) {
+        bool running = false;
+        for(size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+            for(ConversionJob* job = registry[i]; job; job = job->next) {
+                if(!job->running) continue;
+                running = true;
+                // Re-sent each round in case the worker was between ffmpeg
+                // runs
+                pid_t pid = __atomic_load_n(&job->pid, __ATOMIC_ACQUIRE);
+                if(pid > 0) kill(-pid, SIGTERM);
+            }
+        }
+        if(!running) break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if(now.tv_sec >= deadline.tv_sec) {
+            fprintf(stderr, "[Manager] Conversions did not stop in time\n");
+            break;
+        }
+        struct timespec wake = now;
+        wake.tv_nsec += 200000000L;
+        if(wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&jobs_cond, &jobs_lock, &wake);
+    }
+    save_journal();
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+void conversion_handoff(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CHECKPOINT_TIMEOUT;
+
+    pthread_mutex_lock(&jobs_lock);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    // No ffmpeg starts from now on. Wait for the workers between two runs,
+    // or about to start one, so every running job has a group to hand over.
+    for(;;) {
+        bool settling = false;
+        for(size_t i = 0; i < REGISTRY_BUCKETS; i++) {
+            for(ConversionJob* job = registry[i]; job; job = job->next) {
+                if(job->running &&
+                   __atomic_load_n(&job->pid, __ATOMIC_ACQUIRE) == 0)
+                    settling = true;
+            }
+        }
+        if(!settling) break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if(now.tv_sec >= deadline.tv_sec) {
+            fprintf(stderr, "[Manager] Conversions did not settle in time\n");
+            break;
+        }
+        struct timespec wake = now;
+        wake.tv_nsec += 200000000L;
+        if(wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&jobs_cond, &jobs_lock, &wake);
+    }
+    record_pids = true;
+    save_journal();
+    record_pids = false;
+    handed_off = true;
+    pthread_mutex_unlock(&jobs_lock);
+}
@@ -2,13 +2,17 @@
 #include "ffmpeg_utils.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <libavformat/avformat.h>
 #include <libavutil/dict.h>
 #include <libavutil/log.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 // Helper: Ensures string is safe for FFmpeg command (only alphanumeric +
 // underscores)
@@ -129,10 +133,40 @@ TrackInfo get_track_counts(const char* filename) {
     return info;
 }
 
+// Runs a shell command in its own process group, publishing the group id in
+// *child while it runs so the caller can stop it. Returns the wait status.
+static int run_command(const char* cmd, pid_t* child) {
+    pid_t pid = fork();
+    if(pid < 0) return -1;
+    if(pid == 0) {
+        // Undo the server's signal setup before exec
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        setpgid(0, 0);
+        execl("/bin/sh", "sh", "-c", cmd, (char*) NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid);
+    if(child) __atomic_store_n(child, pid, __ATOMIC_RELEASE);
+
+    int status;
+    while(waitpid(pid, &status, 0) < 0) {
+        if(errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    if(child) __atomic_store_n(child, 0, __ATOMIC_RELEASE);
+    return status;
+}
+
 static int run_ffmpeg_command(const char* mkv_path,
                               const char* hls_dir,
                               TrackInfo info,
-                              int include_subs) {
+                              int include_subs,
+                              pid_t* child) {
     char cmd[16384];
     char var_stream_map[4096] = "";
     char map_args[2048] = "";
@@ -189,8 +223,8 @@ static int run_ffmpeg_command(const char* mkv_path,
              "ffmpeg -i \"%s\" %s "
              "-c:v copy -c:a aac %s "
              "-f hls -hls_time 10 -hls_list_size 0 "
-             "-hls_playlist_type vod "
-             "-hls_flags independent_segments "
+             "-hls_playlist_type event "
+             "-hls_flags independent_segments+temp_file "
              "-hls_segment_filename \"%s/segment_%%v_%%03d.ts\" "
              "-master_pl_name master.m3u8 "
              "-var_stream_map \"%s\" "
@@ -204,17 +238,26 @@ static int run_ffmpeg_command(const char* mkv_path,
 
     // Removed the printf("[DEBUG] Command: ...")
 
-    return system(cmd);
+    return run_command(cmd, child);
 }
 
-int generate_hls_with_tracks(const char* mkv_path, const char* hls_dir) {
+int generate_hls_with_tracks(const char* mkv_path,
+                             const char* hls_dir,
+                             pid_t* child,
+                             const bool* stop) {
     TrackInfo info = get_track_counts(mkv_path);
     if(info.error || info.video_count == 0) return -1;
 
     // Try with subtitles first
     if(info.subtitle_count > 0) {
-        if(run_ffmpeg_command(mkv_path, hls_dir, info, 1) == 0) return 0;
+        if(__atomic_load_n(stop, __ATOMIC_ACQUIRE)) return -1;
+        int status = run_ffmpeg_command(mkv_path, hls_dir, info, 1, child);
+        if(status == 0) return 0;
+        // Stopped by the server, not a subtitle failure. ffmpeg catches
+        // SIGTERM and exits normally, so the wait status cannot tell.
+        if(__atomic_load_n(stop, __ATOMIC_ACQUIRE)) return status;
         // Subtitles failed (likely PGS/ASS). Retry silently without.
     }
-    return run_ffmpeg_command(mkv_path, hls_dir, info, 0);
+    if(__atomic_load_n(stop, __ATOMIC_ACQUIRE)) return -1;
+    return run_ffmpeg_command(mkv_path, hls_dir, info, 0, child);
 }
\ No newline at end of file
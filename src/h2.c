@@ -0,0 +1,792 @@
+#define _GNU_SOURCE
+#include "h2.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "hpack.h"
+#include "server.h"
+#include "socktune.h"
+
+#define FRAME_HEADER   9             // Length, type, flags, stream id
+#define INPUT_SIZE     (FRAME_HEADER + H2_FRAME_SIZE)
+#define DEFAULT_WINDOW 65535         // Initial flow-control window
+#define MAX_WINDOW     0x7fffffff    // Largest flow-control window
+#define POLL_MS        1000          // Idle wait between drain checks
+
+enum {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM  0x01
+#define FLAG_ACK         0x01
+#define FLAG_END_HEADERS 0x04
+#define FLAG_PADDED      0x08
+#define FLAG_PRIORITY    0x20
+
+enum {
+    ERROR_NONE = 0x0,
+    ERROR_PROTOCOL = 0x1,
+    ERROR_INTERNAL = 0x2,
+    ERROR_FLOW_CONTROL = 0x3,
+    ERROR_STREAM_CLOSED = 0x5,
+    ERROR_FRAME_SIZE = 0x6,
+    ERROR_REFUSED_STREAM = 0x7,
+    ERROR_COMPRESSION = 0x9,
+    ERROR_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+static const char switching_protocols[] =
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\n"
+    "Upgrade: h2c\r\n\r\n";
+
+typedef struct Stream {
+    uint32_t id;          // 0 for a free slot
+    bool end_stream;      // The request is complete
+    bool answered;        // Response HEADERS sent
+    int64_t window;       // Send window
+    off_t remaining;      // Body bytes still to send
+    Arena arena;          // Request and response, reset on close
+    Request req;
+    Response resp;
+} Stream;
+
+typedef struct Connection {
+    int fd;
+    ClientBucket* bucket;
+    HpackTable decoder;
+    HpackTable encoder;
+    Stream streams[H2_MAX_STREAMS];
+    size_t active;              // Streams in use
+    size_t next;                // First stream of the next DATA round
+    uint32_t last_id;           // Highest stream id opened by the client
+    int64_t window;             // Connection send window
+    uint32_t initial_window;    // Peer SETTINGS_INITIAL_WINDOW_SIZE
+    uint8_t* in;                // Unparsed input, INPUT_SIZE bytes
+    size_t in_len;
+    uint8_t* block;             // Header block being received
+    size_t block_len;
+    uint32_t block_stream;      // Its stream, 0 when none
+    bool block_end_stream;
+    char* out;                  // Frames waiting to be written
+    size_t out_len;
+    size_t out_cap;
+    Arena scratch;              // Header blocks of refused streams
+    bool preface;               // Client preface received
+    bool goaway;                // GOAWAY sent, no new streams
+    bool peer_goaway;           // GOAWAY received
+    int error;                  // Connection error code, -1 for none
+} Connection;
+
+static uint32_t get32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+           (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
+
+static void out_append(Connection* c, const void* data, size_t len) {
+    if(c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 1024;
+        while(cap < c->out_len + len) cap *= 2;
+        char* out = realloc(c->out, cap);
+        if(!out) {
+            c->error = ERROR_INTERNAL;
+            return;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+static void queue_frame_header(Connection* c,
+                               size_t len,
+                               uint8_t type,
+                               uint8_t flags,
+                               uint32_t id) {
+    uint8_t header[FRAME_HEADER] = {(uint8_t) (len >> 16),
+                                    (uint8_t) (len >> 8),
+                                    (uint8_t) len,
+                                    type,
+                                    flags};
+    put32(header + 5, id);
+    out_append(c, header, sizeof(header));
+}
+
+static void queue_frame(Connection* c,
+                        uint8_t type,
+                        uint8_t flags,
+                        uint32_t id,
+                        const void* payload,
+                        size_t len) {
+    queue_frame_header(c, len, type, flags, id);
+    if(len) out_append(c, payload, len);
+}
+
+// Writes the queued frames. With more set the kernel may hold them back for
+// the payload that follows, so small frames and their DATA share segments.
+static int flush(Connection* c, bool more) {
+    size_t done = 0;
+    while(done < c->out_len) {
+        ssize_t n = send(c->fd,
+                         c->out + done,
+                         c->out_len - done,
+                         MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        done += (size_t) n;
+    }
+    c->out_len = 0;
+    return 0;
+}
+
+static void queue_rst_stream(Connection* c, uint32_t id, uint32_t code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    queue_frame(c, FRAME_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void queue_window_update(Connection* c, uint32_t id, uint32_t inc) {
+    uint8_t payload[4];
+    put32(payload, inc);
+    queue_frame(c, FRAME_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+static void queue_goaway(Connection* c, uint32_t code) {
+    uint8_t payload[8];
+    put32(payload, c->last_id);
+    put32(payload + 4, code);
+    queue_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->goaway = true;
+}
+
+static Stream* find_stream(Connection* c, uint32_t id) {
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        if(c->streams[i].id == id) return &c->streams[i];
+    }
+    return NULL;
+}
+
+static void close_stream(Connection* c, Stream* s) {
+    if(s->answered) pathcache_release(&s->resp.file);
+    arena_reset(&s->arena);
+    s->id = 0;
+    c->active--;
+}
+
+static void reset_stream(Connection* c, Stream* s, uint32_t code) {
+    queue_rst_stream(c, s->id, code);
+    close_stream(c, s);
+}
+
+static int apply_settings(Connection* c, const uint8_t* p, size_t len) {
+    for(; len >= 6; p += 6, len -= 6) {
+        uint16_t id = (uint16_t) (p[0] << 8 | p[1]);
+        uint32_t value = get32(p + 2);
+        switch(id) {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                hpack_set_limit(&c->encoder, value);
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1) return ERROR_PROTOCOL;
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if(value > MAX_WINDOW) return ERROR_FLOW_CONTROL;
+                int64_t delta = (int64_t) value - c->initial_window;
+                for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+                    Stream* s = &c->streams[i];
+                    if(!s->id) continue;
+                    s->window += delta;
+                    if(s->window > MAX_WINDOW) return ERROR_FLOW_CONTROL;
+                }
+                c->initial_window = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                // Frames are sent at the minimum size, which is H2_FRAME_SIZE
+                if(value < 16384 || value > 16777215) return ERROR_PROTOCOL;
+                break;
+            default: break;
+        }
+    }
+    return ERROR_NONE;
+}
+
+// Decodes the value of an HTTP2-Settings header (base64url, no padding).
+static size_t decode_base64url(const char* src, uint8_t* dst, size_t cap) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t bits = 0;
+    int count = 0;
+    size_t len = 0;
+    for(; *src && *src != '='; src++) {
+        const char* c = strchr(alphabet, *src);
+        if(!c) return 0;
+        bits = bits << 6 | (uint32_t) (c - alphabet);
+        count += 6;
+        if(count >= 8) {
+            count -= 8;
+            if(len == cap) return 0;
+            dst[len++] = (uint8_t) (bits >> count);
+        }
+    }
+    return len;
+}
+
+// Builds a Request from decoded fields. Returns 0, or -1 for a malformed
+// request (a stream error).
+static int build_request(Stream* s, HpackField* fields, size_t count) {
+    Request* req = &s->req;
+    request_init(req);
+    req->version = "HTTP/2";
+
+    char* path = NULL;
+    const char* authority = NULL;
+    bool regular = false;
+    for(size_t i = 0; i < count; i++) {
+        char* name = fields[i].name;
+        char* value = fields[i].value;
+        if(name[0] == ':') {
+            if(regular) return -1;    // Pseudo-headers come first
+            if(strcmp(name, ":method") == 0) {
+                req->method = value;
+            } else if(strcmp(name, ":path") == 0) {
+                path = value;
+            } else if(strcmp(name, ":authority") == 0) {
+                authority = value;
+            } else if(strcmp(name, ":scheme") != 0) {
+                return -1;
+            }
+            continue;
+        }
+        regular = true;
+        for(const char* p = name; *p; p++) {
+            if(isupper((unsigned char) *p)) return -1;
+        }
+        if(strcmp(name, "connection") == 0) return -1;
+        if(request_add_header(req, &s->arena, name, value) != 0) return -1;
+    }
+    if(!req->method || !path) return -1;
+    if(request_set_target(req, &s->arena, path, strlen(path)) != 0)
+        return -1;
+    if(authority && !request_header(req, "host") &&
+       request_add_header(req, &s->arena, "host", authority) != 0)
+        return -1;
+    return 0;
+}
+
+// Handles a complete header block. Returns 0, or -1 on a connection error.
+static int end_headers(Connection* c) {
+    uint32_t id = c->block_stream;
+    c->block_stream = 0;
+
+    Stream* s = find_stream(c, id);
+    bool open_new = !s && id > c->last_id;
+    if(open_new) {
+        c->last_id = id;
+        if(!c->goaway) s = find_stream(c, 0);
+    }
+
+    Arena* arena = s ? &s->arena : &c->scratch;
+    size_t max_fields = MAX_HEADERS + 4;    // Room for the pseudo-headers
+    HpackField* fields = arena_alloc(arena, max_fields * sizeof(HpackField));
+    size_t count;
+    if(!fields) {
+        c->error = ERROR_INTERNAL;
+        return -1;
+    }
+    int ret = hpack_decode(&c->decoder,
+                           c->block,
+                           c->block_len,
+                           arena,
+                           fields,
+                           max_fields,
+                           &count);
+    arena_reset(&c->scratch);
+    if(ret != 0) {
+        c->error = ERROR_COMPRESSION;
+        return -1;
+    }
+
+    if(!open_new) {
+        if(!s) {
+            c->error = ERROR_STREAM_CLOSED;
+            return -1;
+        }
+        // Trailers, ignored
+        if(c->block_end_stream) s->end_stream = true;
+        return 0;
+    }
+    if(!s) {
+        queue_rst_stream(c, id, ERROR_REFUSED_STREAM);
+        return 0;
+    }
+
+    s->id = id;
+    s->end_stream = c->block_end_stream;
+    s->answered = false;
+    s->window = c->initial_window;
+    c->active++;
+    if(build_request(s, fields, count) != 0)
+        reset_stream(c, s, ERROR_PROTOCOL);
+    return 0;
+}
+
+static int append_block(Connection* c, const uint8_t* data, size_t len) {
+    if(c->block_len + len > H2_HEADER_BLOCK) {
+        c->error = ERROR_ENHANCE_YOUR_CALM;
+        return -1;
+    }
+    memcpy(c->block + c->block_len, data, len);
+    c->block_len += len;
+    return 0;
+}
+
+// Handles one frame. Returns 0, or -1 with c->error set on a connection
+// error.
+static int process_frame(Connection* c,
+                         uint8_t type,
+                         uint8_t flags,
+                         uint32_t id,
+                         const uint8_t* p,
+                         size_t len) {
+    if(c->block_stream &&
+       (type != FRAME_CONTINUATION || id != c->block_stream)) {
+        c->error = ERROR_PROTOCOL;
+        return -1;
+    }
+
+    // Padding of DATA and HEADERS
+    size_t frame_len = len;
+    if((type == FRAME_DATA || type == FRAME_HEADERS) && (flags & FLAG_PADDED)) {
+        if(len < 1 || p[0] >= len) {
+            c->error = ERROR_PROTOCOL;
+            return -1;
+        }
+        size_t pad = p[0];
+        p++;
+        len -= pad + 1;
+    }
+
+    switch(type) {
+        case FRAME_DATA: {
+            if(id == 0) break;
+            Stream* s = find_stream(c, id);
+            // Padding counts against the window too; replenish what the
+            // frame used
+            if(frame_len) queue_window_update(c, 0, (uint32_t) frame_len);
+            if(!s) {
+                if(id > c->last_id) break;
+                queue_rst_stream(c, id, ERROR_STREAM_CLOSED);
+            } else if(s->end_stream) {
+                reset_stream(c, s, ERROR_STREAM_CLOSED);
+            } else {
+                if(frame_len && !(flags & FLAG_END_STREAM))
+                    queue_window_update(c, id, (uint32_t) frame_len);
+                if(flags & FLAG_END_STREAM) s->end_stream = true;
+            }
+            return 0;
+        }
+        case FRAME_HEADERS:
+            if(id == 0 || id % 2 == 0) break;
+            if(flags & FLAG_PRIORITY) {
+                if(len < 5) break;
+                p += 5;
+                len -= 5;
+            }
+            c->block_len = 0;
+            c->block_stream = id;
+            c->block_end_stream = flags & FLAG_END_STREAM;
+            if(append_block(c, p, len) != 0) return -1;
+            return flags & FLAG_END_HEADERS ? end_headers(c) : 0;
+        case FRAME_CONTINUATION:
+            if(!c->block_stream) break;
+            if(append_block(c, p, len) != 0) return -1;
+            return flags & FLAG_END_HEADERS ? end_headers(c) : 0;
+        case FRAME_PRIORITY: return 0;
+        case FRAME_RST_STREAM: {
+            if(id == 0 || id > c->last_id) break;
+            if(len != 4) {
+                c->error = ERROR_FRAME_SIZE;
+                return -1;
+            }
+            Stream* s = find_stream(c, id);
+            if(s) close_stream(c, s);
+            return 0;
+        }
+        case FRAME_SETTINGS:
+            if(id != 0) break;
+            if(flags & FLAG_ACK) return 0;
+            if(len % 6 != 0) {
+                c->error = ERROR_FRAME_SIZE;
+                return -1;
+            }
+            c->error = apply_settings(c, p, len);
+            if(c->error != ERROR_NONE) return -1;
+            c->error = -1;
+            queue_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+            return 0;
+        case FRAME_PING:
+            if(id != 0) break;
+            if(len != 8) {
+                c->error = ERROR_FRAME_SIZE;
+                return -1;
+            }
+            if(!(flags & FLAG_ACK))
+                queue_frame(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+            return 0;
+        case FRAME_GOAWAY:
+            if(id != 0) break;
+            c->peer_goaway = true;
+            return 0;
+        case FRAME_WINDOW_UPDATE: {
+            if(len != 4) {
+                c->error = ERROR_FRAME_SIZE;
+                return -1;
+            }
+            uint32_t inc = get32(p) & MAX_WINDOW;
+            if(id == 0) {
+                if(inc == 0) break;
+                c->window += inc;
+                if(c->window > MAX_WINDOW) {
+                    c->error = ERROR_FLOW_CONTROL;
+                    return -1;
+                }
+                return 0;
+            }
+            Stream* s = find_stream(c, id);
+            if(!s) return 0;
+            s->window += inc;
+            if(inc == 0) {
+                reset_stream(c, s, ERROR_PROTOCOL);
+            } else if(s->window > MAX_WINDOW) {
+                reset_stream(c, s, ERROR_FLOW_CONTROL);
+            }
+            return 0;
+        }
+        case FRAME_PUSH_PROMISE: break;    // Clients never push
+        default: return 0;                 // Unknown types are ignored
+    }
+    c->error = ERROR_PROTOCOL;
+    return -1;
+}
+
+// Connection-specific fields are not allowed in HTTP/2
+static bool hop_by_hop(const char* name) {
+    return strcmp(name, "connection") == 0 ||
+           strcmp(name, "keep-alive") == 0 ||
+           strcmp(name, "proxy-connection") == 0 ||
+           strcmp(name, "transfer-encoding") == 0 ||
+           strcmp(name, "upgrade") == 0;
+}
+
+// Runs the handler for a complete request and queues the response HEADERS.
+static void answer(Connection* c, Stream* s) {
+    Response* resp = &s->resp;
+    handle_request(&s->req, &s->arena, resp);
+    s->answered = true;
+    s->remaining = (off_t) resp->body_len +
+                   (resp->file.fd >= 0 ? resp->file_len : 0);
+
+    StrBuf block;
+    sb_init(&block, &s->arena, 256);
+    hpack_encode_begin(&c->encoder, &block);
+    char number[32];
+    snprintf(number, sizeof(number), "%d", resp->status);
+    hpack_encode_field(&c->encoder, &block, ":status", number, true);
+    if(resp->content_type)
+        hpack_encode_field(
+            &c->encoder, &block, "content-type", resp->content_type, true);
+    if(resp->content_encoding)
+        hpack_encode_field(&c->encoder,
+                           &block,
+                           "content-encoding",
+                           resp->content_encoding,
+                           true);
+    snprintf(number, sizeof(number), "%jd", (intmax_t) s->remaining);
+    hpack_encode_field(&c->encoder, &block, "content-length", number, false);
+
+    // Header lines, "Name: value\r\n" each
+    const char* line = resp->headers ? resp->headers : "";
+    while(*line) {
+        const char* eol = strstr(line, "\r\n");
+        if(!eol) eol = line + strlen(line);
+        const char* colon = memchr(line, ':', (size_t) (eol - line));
+        if(colon) {
+            char* name =
+                arena_strndup(&s->arena, line, (size_t) (colon - line));
+            const char* value = colon + 1;
+            while(*value == ' ') value++;
+            char* copy =
+                arena_strndup(&s->arena, value, (size_t) (eol - value));
+            if(name && copy) {
+                for(char* p = name; *p; p++) *p = (char) tolower(*p);
+                if(!hop_by_hop(name))
+                    hpack_encode_field(&c->encoder,
+                                       &block,
+                                       name,
+                                       copy,
+                                       strcmp(name, "content-range") != 0);
+            }
+        }
+        line = *eol ? eol + 2 : eol;
+    }
+
+    // HEADERS, then CONTINUATION frames for the rest of a large block
+    uint8_t end_stream = s->remaining == 0 ? FLAG_END_STREAM : 0;
+    size_t sent = 0;
+    do {
+        size_t len = block.len - sent;
+        if(len > H2_FRAME_SIZE) len = H2_FRAME_SIZE;
+        uint8_t type = sent ? FRAME_CONTINUATION : FRAME_HEADERS;
+        uint8_t flags = (uint8_t) ((sent ? 0 : end_stream) |
+                                   (sent + len == block.len ? FLAG_END_HEADERS :
+                                                              0));
+        queue_frame(c, type, flags, s->id, block.data + sent, len);
+        sent += len;
+    } while(sent < block.len);
+
+    if(s->remaining == 0) close_stream(c, s);
+}
+
+static bool can_send(const Connection* c, const Stream* s) {
+    return s->id && s->answered && c->window > 0 && s->window > 0;
+}
+
+// Sends one DATA frame of a stream. Returns -1 if the client went away.
+static int send_data(Connection* c, Stream* s) {
+    Response* resp = &s->resp;
+    off_t len = s->remaining;
+    if(len > H2_FRAME_SIZE) len = H2_FRAME_SIZE;
+    if(len > c->window) len = (off_t) c->window;
+    if(len > s->window) len = (off_t) s->window;
+
+    // The in-memory body goes first, then the file
+    off_t body_left = s->remaining - (resp->file.fd >= 0 ? resp->file_len : 0);
+    if(body_left > 0 && len > body_left) len = body_left;
+
+    bool last = len == s->remaining;
+    queue_frame_header(
+        c, (size_t) len, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id);
+    if(c->error != -1 || flush(c, true) != 0) return -1;
+
+    ssize_t ret;
+    if(body_left > 0) {
+        const char* body = resp->body + (resp->body_len - (size_t) body_left);
+        ret = rl_write(c->fd, body, (size_t) len, c->bucket, resp->traffic);
+    } else {
+        off_t offset = resp->file_offset + resp->file_len - s->remaining;
+        ret = rl_sendfile(c->fd,
+                          resp->file.fd,
+                          offset,
+                          (size_t) len,
+                          c->bucket,
+                          resp->traffic);
+    }
+    if(ret < 0) return -1;
+
+    c->window -= len;
+    s->window -= len;
+    s->remaining -= len;
+    if(last) close_stream(c, s);
+    return 0;
+}
+
+// Parses the complete frames in the input buffer. Returns 0, or -1 on a
+// connection error.
+static int process_input(Connection* c) {
+    size_t pos = 0;
+    if(!c->preface) {
+        if(c->in_len < H2_PREFACE_LEN) return 0;
+        if(memcmp(c->in, H2_PREFACE, H2_PREFACE_LEN) != 0) {
+            c->error = ERROR_PROTOCOL;
+            return -1;
+        }
+        c->preface = true;
+        pos = H2_PREFACE_LEN;
+    }
+
+    int ret = 0;
+    while(c->in_len - pos >= FRAME_HEADER) {
+        const uint8_t* h = c->in + pos;
+        size_t len = (size_t) h[0] << 16 | (size_t) h[1] << 8 | h[2];
+        if(len > H2_FRAME_SIZE) {
+            c->error = ERROR_FRAME_SIZE;
+            return -1;
+        }
+        if(c->in_len - pos < FRAME_HEADER + len) break;
+        ret = process_frame(
+            c, h[3], h[4], get32(h + 5) & MAX_WINDOW, h + FRAME_HEADER, len);
+        pos += FRAME_HEADER + len;
+        if(ret != 0) break;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return ret;
+}
+
+bool h2_upgrade_request(const Request* req) {
+    const char* upgrade = request_header(req, "Upgrade");
+    return upgrade && strcasecmp(upgrade, "h2c") == 0 &&
+           request_header(req, "HTTP2-Settings");
+}
+
+void h2_serve(int fd,
+              const char* data,
+              size_t len,
+              const Request* upgrade,
+              ClientBucket* bucket) {
+    Connection* c = calloc(1, sizeof(Connection));
+    if(c) {
+        c->in = malloc(INPUT_SIZE);
+        c->block = malloc(H2_HEADER_BLOCK);
+    }
+    if(!c || !c->in || !c->block || len > INPUT_SIZE) {
+        fprintf(stderr, "[Server] Could not allocate HTTP/2 connection\n");
+        if(c) {
+            free(c->in);
+            free(c->block);
+        }
+        free(c);
+        return;
+    }
+    c->fd = fd;
+    c->bucket = bucket;
+    // Streams share the socket, so it keeps the bulk profile: a small
+    // TCP_NOTSENT_LOWAT lets new requests and window updates be read while
+    // a segment is being sent. Frames are batched here (flush() with
+    // MSG_MORE), so Nagle would only hold back the tail of a flow-control
+    // window until the peer's delayed ACK, whatever the profile says.
+    SockProfile profile = SOCK_PROFILE_UNSET;
+    socktune_apply(fd, &profile, SOCK_PROFILE_BULK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->window = DEFAULT_WINDOW;
+    c->initial_window = DEFAULT_WINDOW;
+    c->error = -1;
+    hpack_init(&c->decoder, HPACK_TABLE_SIZE);
+    hpack_init(&c->encoder, HPACK_TABLE_SIZE);
+    arena_init(&c->scratch, H2_STREAM_ARENA);
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++)
+        arena_init(&c->streams[i].arena, H2_STREAM_ARENA);
+    if(data) memcpy(c->in, data, len);
+    c->in_len = data ? len : 0;
+
+    // Server connection preface
+    if(upgrade)
+        out_append(c, switching_protocols, sizeof(switching_protocols) - 1);
+    uint8_t settings[12] = {0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, 0,
+                            0, SETTINGS_MAX_HEADER_LIST_SIZE,  0, 0, 0, 0};
+    put32(settings + 2, H2_MAX_STREAMS);
+    put32(settings + 8, H2_HEADER_BLOCK);
+    queue_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+
+    if(upgrade) {
+        // The upgraded request becomes stream 1, half-closed by the client
+        uint8_t payload[256];
+        size_t n = decode_base64url(request_header(upgrade, "HTTP2-Settings"),
+                                    payload,
+                                    sizeof(payload));
+        if(n % 6 != 0 || apply_settings(c, payload, n) != ERROR_NONE)
+            c->error = ERROR_PROTOCOL;
+        Stream* s = &c->streams[0];
+        s->id = 1;
+        s->end_stream = true;
+        s->window = c->initial_window;
+        s->req = *upgrade;
+        c->last_id = 1;
+        c->active = 1;
+    }
+
+    for(;;) {
+        if(c->error == -1) process_input(c);
+        if(c->error != -1) {
+            queue_goaway(c, (uint32_t) c->error);
+            flush(c, false);
+            break;
+        }
+
+        for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+            Stream* s = &c->streams[i];
+            if(s->id && s->end_stream && !s->answered) answer(c, s);
+        }
+
+        // One DATA frame per stream and round, starting one further each time
+        bool sendable = false;
+        bool failed = false;
+        for(size_t n = 0; n < H2_MAX_STREAMS && !failed; n++) {
+            Stream* s = &c->streams[(c->next + n) % H2_MAX_STREAMS];
+            if(!can_send(c, s)) continue;
+            if(send_data(c, s) != 0) {
+                failed = true;
+                break;
+            }
+            sendable = sendable || can_send(c, s);
+        }
+        c->next = (c->next + 1) % H2_MAX_STREAMS;
+        if(failed) break;
+
+        if(server_draining() && !c->goaway) queue_goaway(c, ERROR_NONE);
+        if(flush(c, false) != 0 || c->error != -1) break;
+        if((c->goaway || c->peer_goaway) && c->active == 0) break;
+
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, sendable ? 0 : POLL_MS);
+        if(ready < 0 && errno != EINTR) break;
+        if(ready > 0) {
+            ssize_t n = read(fd, c->in + c->in_len, INPUT_SIZE - c->in_len);
+            if(n <= 0) break;
+            c->in_len += (size_t) n;
+        }
+    }
+
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++) {
+        Stream* s = &c->streams[i];
+        if(s->id) close_stream(c, s);
+        arena_free(&s->arena);
+    }
+    arena_free(&c->scratch);
+    hpack_free(&c->decoder);
+    hpack_free(&c->encoder);
+    free(c->out);
+    free(c->in);
+    free(c->block);
+    free(c);
+}
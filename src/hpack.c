@@ -0,0 +1,462 @@
+#define _DEFAULT_SOURCE
+#include "hpack.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATIC_COUNT  61
+#define ENTRY_OVERHEAD 32    // Per-entry size overhead from RFC 7541 4.1
+
+struct HpackEntry {
+    char* name;    // One allocation holding both strings
+    char* value;
+    size_t name_len;
+    size_t value_len;
+};
+
+typedef struct StaticEntry {
+    const char* name;
+    const char* value;
+} StaticEntry;
+
+// RFC 7541 Appendix A
+static const StaticEntry static_table[STATIC_COUNT] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// RFC 7541 Appendix B, codes right-aligned, indexed by symbol (256 = EOS)
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// Binary trie of the code, built once. Children are node indexes, or
+// -(symbol + 1) for leaves.
+static int16_t huffman_trie[512][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_trie(void) {
+    int nodes = 1;
+    for(int sym = 0; sym < 257; sym++) {
+        int node = 0;
+        for(int bit = huffman_lengths[sym] - 1; bit >= 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if(bit == 0) {
+                huffman_trie[node][b] = (int16_t) -(sym + 1);
+            } else {
+                if(huffman_trie[node][b] == 0)
+                    huffman_trie[node][b] = (int16_t) nodes++;
+                node = huffman_trie[node][b];
+            }
+        }
+    }
+}
+
+static int huffman_decode(const uint8_t* src,
+                          size_t len,
+                          char* dst,
+                          size_t* out_len) {
+    pthread_once(&huffman_once, build_trie);
+    size_t n = 0;
+    int node = 0;
+    int pad_bits = 0;    // Bits since the last symbol, all ones so far
+    bool pad_ones = true;
+    for(size_t i = 0; i < len; i++) {
+        for(int bit = 7; bit >= 0; bit--) {
+            int b = (src[i] >> bit) & 1;
+            int next = huffman_trie[node][b];
+            if(next < 0) {
+                int sym = -next - 1;
+                if(sym == 256) return -1;    // EOS inside a string
+                dst[n++] = (char) sym;
+                node = 0;
+                pad_bits = 0;
+                pad_ones = true;
+            } else {
+                node = next;
+                pad_bits++;
+                pad_ones = pad_ones && b;
+            }
+        }
+    }
+    // Padding: at most 7 bits, the most significant bits of EOS
+    if(pad_bits > 7 || !pad_ones) return -1;
+    *out_len = n;
+    return 0;
+}
+
+void hpack_init(HpackTable* table, size_t max_size) {
+    memset(table, 0, sizeof(*table));
+    table->max_size = max_size;
+    table->limit = max_size;
+}
+
+void hpack_free(HpackTable* table) {
+    for(size_t i = 0; i < table->count; i++) free(table->entries[i].name);
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+static void evict(HpackTable* table, size_t max_size) {
+    while(table->count > 0 && table->size > max_size) {
+        HpackEntry* oldest = &table->entries[--table->count];
+        table->size -= oldest->name_len + oldest->value_len + ENTRY_OVERHEAD;
+        free(oldest->name);
+    }
+}
+
+static void add_entry(HpackTable* table,
+                      const char* name,
+                      size_t name_len,
+                      const char* value,
+                      size_t value_len) {
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+    if(size > table->max_size) {
+        evict(table, 0);    // An entry larger than the table empties it
+        return;
+    }
+    evict(table, table->max_size - size);
+
+    if(table->count == table->cap) {
+        size_t cap = table->cap ? table->cap * 2 : 16;
+        HpackEntry* entries = realloc(table->entries, cap * sizeof(HpackEntry));
+        if(!entries) return;
+        table->entries = entries;
+        table->cap = cap;
+    }
+    char* copy = malloc(name_len + value_len + 2);
+    if(!copy) return;
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    memcpy(copy + name_len + 1, value, value_len);
+    copy[name_len + 1 + value_len] = '\0';
+
+    memmove(table->entries + 1,
+            table->entries,
+            table->count * sizeof(HpackEntry));
+    table->entries[0] =
+        (HpackEntry) {copy, copy + name_len + 1, name_len, value_len};
+    table->count++;
+    table->size += size;
+}
+
+// Looks up a 1-based index across the static and dynamic tables.
+static int lookup(const HpackTable* table,
+                  uint64_t index,
+                  const char** name,
+                  const char** value) {
+    if(index == 0) return -1;
+    if(index <= STATIC_COUNT) {
+        *name = static_table[index - 1].name;
+        *value = static_table[index - 1].value;
+        return 0;
+    }
+    index -= STATIC_COUNT + 1;
+    if(index >= table->count) return -1;
+    *name = table->entries[index].name;
+    *value = table->entries[index].value;
+    return 0;
+}
+
+static int decode_int(const uint8_t** p,
+                      const uint8_t* end,
+                      int prefix,
+                      uint64_t* out) {
+    if(*p >= end) return -1;
+    uint64_t max = (1u << prefix) - 1;
+    uint64_t value = **p & max;
+    (*p)++;
+    if(value < max) {
+        *out = value;
+        return 0;
+    }
+    for(int shift = 0; shift <= 28 && *p < end; shift += 7) {
+        uint8_t b = *(*p)++;
+        value += (uint64_t) (b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            *out = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static char* decode_string(const uint8_t** p,
+                           const uint8_t* end,
+                           Arena* arena) {
+    if(*p >= end) return NULL;
+    bool huffman = **p & 0x80;
+    uint64_t len;
+    if(decode_int(p, end, 7, &len) != 0 || len > (uint64_t) (end - *p))
+        return NULL;
+
+    // Huffman codes are at least 5 bits long
+    size_t cap = huffman ? len * 8 / 5 + 1 : len + 1;
+    char* str = arena_alloc(arena, cap);
+    if(!str) return NULL;
+    size_t out_len = len;
+    if(huffman) {
+        if(huffman_decode(*p, len, str, &out_len) != 0) return NULL;
+    } else {
+        memcpy(str, *p, len);
+    }
+    str[out_len] = '\0';
+    *p += len;
+    return str;
+}
+
+int hpack_decode(HpackTable* table,
+                 const uint8_t* block,
+                 size_t len,
+                 Arena* arena,
+                 HpackField* fields,
+                 size_t max_fields,
+                 size_t* count) {
+    const uint8_t* p = block;
+    const uint8_t* end = block + len;
+    *count = 0;
+    while(p < end) {
+        uint8_t b = *p;
+        uint64_t index;
+        const char* name;
+        const char* value;
+        char* name_copy = NULL;
+        char* value_copy;
+
+        if(b & 0x80) {    // Indexed field
+            if(decode_int(&p, end, 7, &index) != 0 ||
+               lookup(table, index, &name, &value) != 0)
+                return -1;
+            name_copy = arena_strndup(arena, name, strlen(name));
+            value_copy = arena_strndup(arena, value, strlen(value));
+        } else if((b & 0xe0) == 0x20) {    // Dynamic table size update
+            if(decode_int(&p, end, 5, &index) != 0 || index > table->limit)
+                return -1;
+            table->max_size = (size_t) index;
+            evict(table, table->max_size);
+            continue;
+        } else {
+            // Literal, with incremental indexing (01), without (0000) or
+            // never indexed (0001)
+            bool indexing = (b & 0xc0) == 0x40;
+            if(decode_int(&p, end, indexing ? 6 : 4, &index) != 0) return -1;
+            if(index == 0) {
+                name_copy = decode_string(&p, end, arena);
+            } else if(lookup(table, index, &name, &value) == 0) {
+                name_copy = arena_strndup(arena, name, strlen(name));
+            }
+            value_copy = decode_string(&p, end, arena);
+            if(!name_copy || !value_copy) return -1;
+            if(indexing)
+                add_entry(table,
+                          name_copy,
+                          strlen(name_copy),
+                          value_copy,
+                          strlen(value_copy));
+        }
+        if(!name_copy || !value_copy) return -1;
+        if(*count < max_fields) {
+            fields[*count].name = name_copy;
+            fields[*count].value = value_copy;
+            (*count)++;
+        }
+    }
+    return 0;
+}
+
+void hpack_set_limit(HpackTable* table, size_t limit) {
+    size_t max_size = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+    if(max_size == table->max_size) return;
+    table->limit = limit;
+    table->max_size = max_size;
+    table->size_update = true;
+    evict(table, max_size);
+}
+
+static void encode_int(StrBuf* out, uint8_t first, int prefix, uint64_t value) {
+    uint64_t max = (1u << prefix) - 1;
+    char buf[16];
+    size_t n = 0;
+    if(value < max) {
+        buf[n++] = (char) (first | value);
+    } else {
+        buf[n++] = (char) (first | max);
+        value -= max;
+        while(value >= 0x80) {
+            buf[n++] = (char) (0x80 | (value & 0x7f));
+            value >>= 7;
+        }
+        buf[n++] = (char) value;
+    }
+    sb_append(out, buf, n);
+}
+
+static void encode_string(StrBuf* out, const char* str, size_t len) {
+    encode_int(out, 0x00, 7, len);    // Sent without Huffman coding
+    sb_append(out, str, len);
+}
+
+void hpack_encode_begin(HpackTable* table, StrBuf* out) {
+    if(!table->size_update) return;
+    encode_int(out, 0x20, 5, table->max_size);
+    table->size_update = false;
+}
+
+void hpack_encode_field(HpackTable* table,
+                        StrBuf* out,
+                        const char* name,
+                        const char* value,
+                        bool index) {
+    size_t name_len = strlen(name), value_len = strlen(value);
+    uint64_t name_index = 0;
+    for(size_t i = 0; i < STATIC_COUNT; i++) {
+        if(strcmp(static_table[i].name, name) != 0) continue;
+        if(strcmp(static_table[i].value, value) == 0) {
+            encode_int(out, 0x80, 7, i + 1);
+            return;
+        }
+        if(!name_index) name_index = i + 1;
+    }
+    for(size_t i = 0; i < table->count; i++) {
+        const HpackEntry* entry = &table->entries[i];
+        if(entry->name_len != name_len ||
+           memcmp(entry->name, name, name_len) != 0)
+            continue;
+        if(entry->value_len == value_len &&
+           memcmp(entry->value, value, value_len) == 0) {
+            encode_int(out, 0x80, 7, STATIC_COUNT + 1 + i);
+            return;
+        }
+        if(!name_index) name_index = STATIC_COUNT + 1 + i;
+    }
+
+    if(index) {
+        encode_int(out, 0x40, 6, name_index);
+    } else {
+        encode_int(out, 0x00, 4, name_index);
+    }
+    if(!name_index) encode_string(out, name, name_len);
+    encode_string(out, value, value_len);
+    if(index) add_entry(table, name, name_len, value, value_len);
+}
@@ -9,20 +9,43 @@
 #include <signal.h>
 #include <errno.h>
 
+#include "cluster.h"
+#include "conversion.h"
+#include "pathcache.h"
+#include "server.h"
 #include "site.h"
+#include "snapshot.h"
+#include "socktune.h"
 
 #define PORT 8080                // Server listening port
-#define MAX_CONNECTIONS 5        // Maximum simultaneous client connections
+#define MAX_CONNECTIONS 256      // Maximum simultaneous client connections
 
 void printusage(char* progname, int fd);
+int parserate(const char* str, uint64_t* rate);
+void* signal_fn(void* arg);
+
+static char** saved_argv;        // Command line re-executed on hot restart
+static const char* snapshot_path; // Startup snapshot, NULL if disabled
 
 int main(int argc, char* argv[]) {
+	saved_argv = argv;
+	setvbuf(stdout, NULL, _IOLBF, 0);
 
 	int opt = -1;
 	int port = PORT;
 	int max_connections = MAX_CONNECTIONS;
+	uint64_t global_rate = 0;
+	uint64_t client_rate = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int listeners = cpus > 0 ? (int)cpus : 1;
+	int drain_timeout = DRAIN_TIMEOUT;
+	long cache_entries = PATHCACHE_ENTRIES;
+	const char* output_dir = NULL;
+	uint64_t output_quota = 0;
+	const char* cluster_peers = NULL;
+	const char* cluster_self = NULL;
 
-	while ((opt = getopt(argc, argv, "hp:c:")) != -1) {
+	while ((opt = getopt(argc, argv, "hp:c:l:d:b:B:f:o:q:s:t:P:n:")) != -1) {
 		switch (opt) {
 		case 'h':
 			printusage(argv[0], STDOUT_FILENO);
@@ -40,6 +63,60 @@ int main(int argc, char* argv[]) {
 				return 1;
 			}
 			break;
+		case 'l':
+			if ((listeners = strtol(optarg, NULL, 10)) < 1) {
+				printusage(argv[0], STDERR_FILENO);
+				return 1;
+			}
+			break;
+		case 'd':
+			if ((drain_timeout = strtol(optarg, NULL, 10)) < 0) {
+				printusage(argv[0], STDERR_FILENO);
+				return 1;
+			}
+			break;
+		case 'b':
+			if (parserate(optarg, &global_rate) != 0) {
+				printusage(argv[0], STDERR_FILENO);
+				return 1;
+			}
+			break;
+		case 'B':
+			if (parserate(optarg, &client_rate) != 0) {
+				printusage(argv[0], STDERR_FILENO);
+				return 1;
+			}
+			break;
+		case 'f':
+			if ((cache_entries = strtol(optarg, NULL, 10)) < 0) {
+				printusage(argv[0], STDERR_FILENO);
+				return 1;
+			}
+			break;
+		case 'o':
+			output_dir = optarg;
+			break;
+		case 'q':
+			if (parserate(optarg, &output_quota) != 0) {
+				printusage(argv[0], STDERR_FILENO);
+				return 1;
+			}
+			break;
+		case 's':
+			snapshot_path = optarg;
+			break;
+		case 't':
+			if (socktune_parse(optarg) != 0) {
+				printusage(argv[0], STDERR_FILENO);
+				return 1;
+			}
+			break;
+		case 'P':
+			cluster_peers = optarg;
+			break;
+		case 'n':
+			cluster_self = optarg;
+			break;
 		default:
 			printusage(argv[0], STDERR_FILENO);
 			return 1;
@@ -48,13 +125,6 @@ int main(int argc, char* argv[]) {
 	}
 
 
-	int socket_fd = -1;
-	if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		char msg[] = "Could not create socket!";
-		write(STDERR_FILENO, msg, sizeof(msg));
-		exit(1);
-	}
-
 	// Then set up SIGPIPE to be ignored
 	struct sigaction sa = {
 		.sa_handler = SIG_IGN,
@@ -65,55 +135,145 @@ int main(int argc, char* argv[]) {
 		exit(1);
 	}
 
-	// Enabling port reuse
-	opt = 1;
-	if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0) {
-		fprintf(stderr, "setsockopt(SO_REUSEADDR) failed: %s\n", strerror(errno));
+	rl_init(global_rate, client_rate);
+
+	// SIGUSR1 dumps the bandwidth counters, SIGTERM/SIGINT drain and exit,
+	// SIGUSR2 hands the sockets to a new process and drains. They are blocked
+	// here so every thread inherits the mask and only the signal thread
+	// receives them.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	pthread_t sig_thread;
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0 ||
+		pthread_create(&sig_thread, NULL, &signal_fn, NULL) != 0) {
+		fprintf(stderr, "Could not start signal thread\n");
 		exit(1);
 	}
+	pthread_detach(sig_thread);
 
-	// Bind
-	struct sockaddr_in addr = { .sin_family = AF_INET,
-          .sin_addr.s_addr = INADDR_ANY,
-          .sin_port = htons(port) };
-	if (bind(socket_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
-		char msg[] = "Could not bind socket!";
-		write(STDERR_FILENO, msg, sizeof(msg));
+	if (pathcache_init(".", (size_t)cache_entries) != 0) {
 		exit(1);
 	}
-
-	// Listen
-	if (listen(socket_fd, max_connections) != 0) {
-		fprintf(stderr, "listen() failed: %s\n", strerror(errno));
+	if (conversion_set_output(output_dir, output_quota) != 0) {
+		exit(1);
+	}
+	conversion_init(JOURNAL_FILE);
+	if (snapshot_path) {
+		snapshot_load(snapshot_path);
+	}
+	if (cluster_peers && cluster_init(cluster_self, cluster_peers) != 0) {
 		exit(1);
 	}
 
-	while (1) {
-		int* client_fd = (int*)malloc(sizeof(int));
-
-		socklen_t client_len = sizeof(addr);
-
-		// Accept
-		if ((*client_fd = accept(socket_fd, (struct sockaddr*)&addr, &client_len)) <
-			0) {
-			fprintf(stderr, "accept() failed: %s\n", strerror(errno));
-			exit(1);
-		}
-
-		// Thread
-		pthread_t thread;
-		if (pthread_create(&thread, NULL, &thread_fn, (void*)client_fd) != 0) {
-			fprintf(stderr, "pthread_create() failed: %s\n", strerror(errno));
-			free(client_fd);
-			exit(1);
-		}
+	ServerConfig config = {
+		.port = port,
+		.max_connections = max_connections,
+		.listeners = listeners,
+		.drain_timeout = drain_timeout,
+	};
+	if (server_run(&config) != 0) {
+		exit(1);
 	}
+	if (snapshot_path) {
+		snapshot_save(snapshot_path);
+	}
+	printf("[Server] Stopped\n");
 	return 0;
 }
 
 void printusage(char* progname, int fd){
-	dprintf(fd, "Usage: %s [-h] [-p port] [-c max_connections]\n", progname);
+	dprintf(fd, "Usage: %s [-h] [-p port] [-c max_connections] [-l listeners] [-d seconds] [-b rate] [-B rate] [-f entries] [-o dir] [-q size] [-s file] [-t tuning] [-P peers [-n self]]\n", progname);
 	dprintf(fd, "  -h        Show this help message and exit\n");
 	dprintf(fd, "  -p port   Specify the port to listen on (default: %d)\n", PORT);
 	dprintf(fd, "  -c max_connections   Specify the maximum simultaneous client connections (default: %d)\n", MAX_CONNECTIONS);
+	dprintf(fd, "            Connections over the limit get 503 Service Unavailable with Retry-After\n");
+	dprintf(fd, "  -l listeners   Number of SO_REUSEPORT listener threads (default: online CPUs)\n");
+	dprintf(fd, "  -d seconds   Time to let responses finish on shutdown (default: %d)\n", DRAIN_TIMEOUT);
+	dprintf(fd, "  -b rate   Global bandwidth limit in bytes/s, k/m/g suffixes allowed (default: unlimited)\n");
+	dprintf(fd, "  -B rate   Per-client-IP bandwidth limit in bytes/s (default: unlimited)\n");
+	dprintf(fd, "  -f entries   Open files and directories kept cached (default: %d, 0 = off)\n", PATHCACHE_ENTRIES);
+	dprintf(fd, "  -o dir    Write new HLS conversions to this cache directory (default: next to each .mkv)\n");
+	dprintf(fd, "  -q size   Evict the least recently watched conversions above this size, k/m/g suffixes allowed (default: unlimited)\n");
+	dprintf(fd, "  -s file   Save the cached directory listings and most served files to this file on exit, and warm up from it on start\n");
+	dprintf(fd, "  -t tuning   Socket options as key=value[,key=value...]: latency.nodelay, latency.lowat, bulk.nodelay,\n");
+	dprintf(fd, "            bulk.lowat (default %d), small (default %d), sndbuf, rcvbuf, defer (default %d), fastopen\n", SOCKTUNE_LOWAT, SOCKTUNE_SMALL, SOCKTUNE_DEFER);
+	dprintf(fd, "  -P peers  Origins of a cluster sharing this library, as host:port[,host:port...]; each conversion is made\n");
+	dprintf(fd, "            by one of them and proxied by the others (default: no cluster)\n");
+	dprintf(fd, "  -n self   This server's host:port in the -P list; without it the server is an edge that converts nothing\n");
+	dprintf(fd, "Send SIGUSR1 to print bandwidth, throttling, path cache, conversion and cluster counters and the socket tuning.\n");
+	dprintf(fd, "Send SIGTERM to drain and exit, SIGUSR2 to restart without dropping connections.\n");
+}
+
+int parserate(const char* str, uint64_t* rate){
+	char* end = NULL;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (errno != 0 || end == str || str[0] == '-') {
+		return -1;
+	}
+	uint64_t multiplier = 1;
+	switch (*end) {
+	case 'g': case 'G': multiplier *= 1024; // fall through
+	case 'm': case 'M': multiplier *= 1024; // fall through
+	case 'k': case 'K': multiplier *= 1024; end++; break;
+	case '\0': break;
+	default: return -1;
+	}
+	if (*end != '\0' || value > UINT64_MAX / multiplier) {
+		return -1;
+	}
+	*rate = value * multiplier;
+	return 0;
+}
+
+void* signal_fn(void* arg){
+	(void)arg;
+	sigset_t wait_set;
+	sigemptyset(&wait_set);
+	sigaddset(&wait_set, SIGUSR1);
+	sigaddset(&wait_set, SIGUSR2);
+	sigaddset(&wait_set, SIGTERM);
+	sigaddset(&wait_set, SIGINT);
+	int sig;
+	while (sigwait(&wait_set, &sig) == 0) {
+		switch (sig) {
+		case SIGUSR1:
+			rl_dump_stats(stdout);
+			pathcache_dump_stats(stdout);
+			conversion_dump_stats(stdout);
+			socktune_dump(stdout);
+			cluster_dump_stats(stdout);
+			break;
+		case SIGUSR2:
+			// Conversions keep running: the new process adopts their
+			// ffmpeg from the journal, so viewers keep their segments
+			printf("[Server] Hot restart requested\n");
+			conversion_handoff();
+			if (snapshot_path) {
+				snapshot_save(snapshot_path);
+			}
+			if (server_handoff(saved_argv) != 0) {
+				fprintf(stderr, "[Server] Hot restart failed, continuing\n");
+				conversion_init(JOURNAL_FILE);
+				break;
+			}
+			// The new process has loaded the snapshot and saves it next
+			snapshot_path = NULL;
+			server_stop();
+			break;
+		case SIGTERM:
+		case SIGINT:
+			printf("[Server] Shutting down, draining %d connection(s)\n",
+				server_active_connections());
+			conversion_checkpoint();
+			server_stop();
+			break;
+		}
+		fflush(stdout);
+	}
+	return NULL;
 }
\ No newline at end of file
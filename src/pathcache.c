@@ -0,0 +1,611 @@
+#define _GNU_SOURCE
+#include "pathcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define OPEN_FLAGS (O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)
+#define WATCH_MASK                                                          \
+    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |       \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |          \
+     IN_ONLYDIR)
+#define FD_SHARE 4    // At most 1/FD_SHARE of RLIMIT_NOFILE is kept open
+
+struct PathEntry {
+    char* path;    // Key, relative to the root ("." for the root)
+    size_t path_len;
+    uint32_t hash;
+    int fd;
+    struct stat st;
+    int wd;          // inotify watch of a directory, -1 for files
+    unsigned gen;    // Bumped on every event inside the directory
+    unsigned seen;    // Last event handled for this directory
+    int refs;        // Open handles plus cached children
+    bool stale;      // Out of the table, freed on the last release
+    PathEntry* parent;
+    PathEntry* next;        // Hash chain
+    PathEntry* lru_prev;    // Most recently used first
+    PathEntry* lru_next;
+    PathEntry* dir_next;    // Live directories, searched by watch
+};
+
+// A miss being opened. Concurrent misses on the same path wait for it and
+// share its entry instead of each walking the path again.
+typedef struct Flight {
+    const char* path;    // The leader's, valid until done
+    size_t path_len;
+    uint32_t hash;
+    bool done;
+    int err;            // errno of a failed open
+    PathEntry* entry;    // Result, with a reference held for each waiter
+    int waiters;
+    struct Flight* next;
+} Flight;
+
+static pthread_mutex_t pc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_cond = PTHREAD_COND_INITIALIZER;
+static Flight* flights;
+static PathEntry** table;
+static size_t table_size;    // Power of two
+static size_t capacity;
+static size_t count;
+static PathEntry* root;
+static PathEntry* lru_head;
+static PathEntry* lru_tail;
+static PathEntry* dirs;
+static int inotify_fd = -1;
+static int have_openat2 = 1;
+static unsigned event_seq;    // Numbers the inotify events, under pc_lock
+static uint64_t hits, misses, coalesced, invalidations, evictions;
+
+static uint32_t hash_path(const char* path, size_t len) {
+    uint32_t h = 2166136261u;    // FNV-1a
+    for(size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Opens path below dirfd. With openat2 the kernel refuses to leave dirfd,
+// through ".." or symlinks alike, failing with EXDEV.
+static int open_beneath(int dirfd, const char* path) {
+    if(__atomic_load_n(&have_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how = {
+            .flags = OPEN_FLAGS,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+        };
+        int fd = (int) syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+        if(fd >= 0 || errno != ENOSYS) return fd;
+        __atomic_store_n(&have_openat2, 0, __ATOMIC_RELAXED);
+    }
+    // Paths are already normalized, so only symlinks can point elsewhere
+    return openat(dirfd, path, OPEN_FLAGS);
+}
+
+static PathEntry* lookup(const char* path, size_t len, uint32_t hash) {
+    for(PathEntry* e = table[hash & (table_size - 1)]; e; e = e->next) {
+        if(e->hash == hash && e->path_len == len &&
+           memcmp(e->path, path, len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void lru_unlink(PathEntry* e) {
+    if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else
+        lru_head = e->lru_next;
+    if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else
+        lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(PathEntry* e) {
+    e->lru_next = lru_head;
+    if(lru_head) lru_head->lru_prev = e;
+    lru_head = e;
+    if(!lru_tail) lru_tail = e;
+}
+
+static void entry_get(PathEntry* e) {
+    e->refs++;
+    if(e != root && !e->stale) {
+        lru_unlink(e);
+        lru_push(e);
+    }
+}
+
+static void entry_put(PathEntry* e);
+
+static void entry_destroy(PathEntry* e) {
+    if(e->wd >= 0) {
+        // A live directory may share the watch (same inode, other path)
+        bool shared = false;
+        for(PathEntry* d = dirs; d; d = d->dir_next) shared |= d->wd == e->wd;
+        if(!shared) inotify_rm_watch(inotify_fd, e->wd);
+    }
+    close(e->fd);
+    PathEntry* parent = e->parent;
+    free(e->path);
+    free(e);
+    if(parent) entry_put(parent);
+}
+
+static void entry_put(PathEntry* e) {
+    if(--e->refs == 0 && e->stale) entry_destroy(e);
+}
+
+// Takes the entry out of the table; it is freed once nothing uses it.
+static void entry_unlink(PathEntry* e) {
+    PathEntry** link = &table[e->hash & (table_size - 1)];
+    while(*link != e) link = &(*link)->next;
+    *link = e->next;
+    lru_unlink(e);
+    if(e->wd >= 0) {
+        PathEntry** dlink = &dirs;
+        while(*dlink != e) dlink = &(*dlink)->dir_next;
+        *dlink = e->dir_next;
+    }
+    e->stale = true;
+    count--;
+    if(e->refs == 0) entry_destroy(e);
+}
+
+// Drops an entry and, for a directory, everything cached below it.
+static void invalidate(PathEntry* e) {
+    if(S_ISDIR(e->st.st_mode)) {
+        for(size_t i = 0; i < table_size; i++) {
+            PathEntry* next;
+            for(PathEntry* c = table[i]; c; c = next) {
+                next = c->next;
+                if(c == root) continue;
+                if(e == root || (c->path_len > e->path_len &&
+                                 c->path[e->path_len] == '/' &&
+                                 memcmp(c->path, e->path, e->path_len) == 0)) {
+                    entry_unlink(c);
+                    invalidations++;
+                }
+            }
+        }
+    }
+    if(e != root) {
+        entry_unlink(e);
+        invalidations++;
+    }
+}
+
+static bool evict_one(void) {
+    for(PathEntry* e = lru_tail; e; e = e->lru_prev) {
+        if(e->refs == 0) {
+            entry_unlink(e);
+            evictions++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds an opened file or directory below parent, returning it with a
+// reference held, or NULL if it cannot be cached (the caller keeps fd).
+// gen is the parent's generation before fd was opened: if an event arrived
+// since, the descriptor may already be out of date and is not cached.
+static PathEntry* entry_insert(const char* path,
+                               size_t len,
+                               int fd,
+                               const struct stat* st,
+                               PathEntry* parent,
+                               unsigned gen) {
+    uint32_t hash = hash_path(path, len);
+    PathEntry* e = lookup(path, len, hash);
+    if(e) {    // Raced with another thread, keep theirs
+        close(fd);
+        entry_get(e);
+        return e;
+    }
+    if(parent->stale || parent->gen != gen) return NULL;
+    if(!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)) return NULL;
+    if(count >= capacity && !evict_one()) return NULL;
+
+    int wd = -1;
+    if(S_ISDIR(st->st_mode)) {
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        wd = inotify_add_watch(inotify_fd, proc, WATCH_MASK);
+        if(wd < 0) return NULL;
+    }
+
+    e = calloc(1, sizeof(*e));
+    char* key = malloc(len + 1);
+    if(!e || !key) {
+        free(e);
+        free(key);
+        return NULL;
+    }
+    memcpy(key, path, len);
+    key[len] = '\0';
+    e->path = key;
+    e->path_len = len;
+    e->hash = hash;
+    e->fd = fd;
+    e->st = *st;
+    e->wd = wd;
+    e->refs = 1;
+    e->parent = parent;
+    parent->refs++;
+
+    PathEntry** bucket = &table[hash & (table_size - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    lru_push(e);
+    if(wd >= 0) {
+        e->dir_next = dirs;
+        dirs = e;
+    }
+    count++;
+    return e;
+}
+
+static void handle_event(const struct inotify_event* ev) {
+    if(ev->mask & IN_Q_OVERFLOW) {
+        invalidate(root);
+        return;
+    }
+
+    // A directory reached through several paths (symlinks) has one entry
+    // per path, all sharing the watch. invalidate() unlinks entries from
+    // dirs, so the scan starts over after each one, skipping those handled.
+    if(++event_seq == 0) event_seq = 1;    // 0 is a fresh entry's
+    bool changed;
+    do {
+        changed = false;
+        for(PathEntry* dir = dirs; dir; dir = dir->dir_next) {
+            if(dir->wd != ev->wd || dir->seen == event_seq) continue;
+            dir->seen = event_seq;
+            dir->gen++;
+
+            PathEntry* e = NULL;
+            if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                e = dir;
+            } else if(ev->len > 0) {
+                char key[PATH_MAX];
+                int len = dir == root ?
+                              snprintf(key, sizeof(key), "%s", ev->name) :
+                              snprintf(key,
+                                       sizeof(key),
+                                       "%s/%s",
+                                       dir->path,
+                                       ev->name);
+                if(len > 0 && (size_t) len < sizeof(key))
+                    e = lookup(key, (size_t) len, hash_path(key, (size_t) len));
+            }
+            if(e) {
+                invalidate(e);
+                changed = true;
+                break;
+            }
+        }
+    } while(changed);
+}
+
+static void* watch_fn(void* arg) {
+    (void) arg;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) continue;
+            fprintf(stderr, "[PathCache] inotify read failed, caching off\n");
+            pthread_mutex_lock(&pc_lock);
+            invalidate(root);
+            capacity = 0;
+            pthread_mutex_unlock(&pc_lock);
+            return NULL;
+        }
+        pthread_mutex_lock(&pc_lock);
+        for(char* p = buf; p < buf + n;) {
+            const struct inotify_event* ev = (const struct inotify_event*) p;
+            handle_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_mutex_unlock(&pc_lock);
+    }
+}
+
+int pathcache_init(const char* root_path, size_t entries) {
+    int fd = open(root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        fprintf(stderr,
+                "Could not open served directory %s: %s\n",
+                root_path,
+                strerror(errno));
+        return -1;
+    }
+    root = calloc(1, sizeof(*root));
+    if(!root) {
+        close(fd);
+        return -1;
+    }
+    root->path = strdup(".");
+    root->path_len = 1;
+    root->hash = hash_path(".", 1);
+    root->fd = fd;
+    root->refs = 1;    // Never freed
+    root->wd = -1;
+    fstat(fd, &root->st);
+
+    // Keep enough descriptors for the connections themselves
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+       entries > rl.rlim_cur / FD_SHARE)
+        entries = rl.rlim_cur / FD_SHARE;
+
+    table_size = 16;
+    while(table_size < entries) table_size *= 2;
+    table = calloc(table_size, sizeof(*table));
+    if(!table) return -1;
+    table[root->hash & (table_size - 1)] = root;
+    if(entries == 0) return 0;
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    if(inotify_fd >= 0)
+        root->wd = inotify_add_watch(inotify_fd, proc, WATCH_MASK);
+    pthread_t thread;
+    if(inotify_fd < 0 || root->wd < 0 ||
+       pthread_create(&thread, NULL, watch_fn, NULL) != 0) {
+        fprintf(stderr,
+                "[PathCache] inotify unavailable (%s), caching off\n",
+                strerror(errno));
+        return 0;
+    }
+    pthread_detach(thread);
+    dirs = root;
+    capacity = entries;
+    return 0;
+}
+
+// Opens the whole path from the root without caching anything.
+static int open_uncached(const char* path, PathHandle* out) {
+    return pathcache_open_at(root->fd, path, out);
+}
+
+int pathcache_open_at(int dirfd, const char* path, PathHandle* out) {
+    int fd = open_beneath(dirfd, path);
+    if(fd < 0) return -1;
+    if(fstat(fd, &out->st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    out->fd = fd;
+    out->entry = NULL;
+    return 0;
+}
+
+// Opens a path missing from the cache, called with the cache locked.
+// Returns with it unlocked.
+static int open_miss(const char* path, size_t len, PathHandle* out) {
+    // Deepest cached ancestor; the root is always there
+    PathEntry* dir = root;
+    for(size_t cut = len; cut > 0; cut--) {
+        if(path[cut - 1] != '/') continue;
+        PathEntry* anc = lookup(path, cut - 1, hash_path(path, cut - 1));
+        if(anc) {
+            dir = anc;
+            break;
+        }
+    }
+    entry_get(dir);
+    unsigned gen = dir->gen;
+    pthread_mutex_unlock(&pc_lock);
+
+    // Walk the remaining components, caching each directory on the way
+    char buf[PATH_MAX];
+    memcpy(buf, path, len + 1);
+    size_t start = dir == root ? 0 : dir->path_len + 1;
+    for(;;) {
+        char* slash = strchr(buf + start, '/');
+        size_t end = slash ? (size_t) (slash - buf) : len;
+        buf[end] = '\0';
+
+        // Relative to the cached directory; a symlink leaving it may still
+        // stay inside the root, so that case is resolved from the root.
+        int fd = open_beneath(dir->fd, buf + start);
+        if(fd < 0 && errno == EXDEV && dir != root)
+            fd = open_beneath(root->fd, buf);
+        struct stat st;
+        if(fd >= 0 && fstat(fd, &st) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if(fd >= 0 && slash && !S_ISDIR(st.st_mode)) {
+            close(fd);
+            fd = -1;
+            errno = ENOTDIR;
+        }
+        if(fd < 0) {
+            int err = errno;
+            pthread_mutex_lock(&pc_lock);
+            entry_put(dir);
+            pthread_mutex_unlock(&pc_lock);
+            errno = err;
+            return -1;
+        }
+
+        pthread_mutex_lock(&pc_lock);
+        PathEntry* child = entry_insert(buf, end, fd, &st, dir, gen);
+        entry_put(dir);
+        if(child) gen = child->gen;
+        pthread_mutex_unlock(&pc_lock);
+
+        if(!child) {
+            if(!slash) {
+                out->fd = fd;
+                out->st = st;
+                out->entry = NULL;
+                return 0;
+            }
+            close(fd);
+            return open_uncached(path, out);
+        }
+        if(!slash) {
+            out->fd = child->fd;
+            out->st = child->st;
+            out->entry = child;
+            return 0;
+        }
+        dir = child;
+        buf[end] = '/';
+        start = end + 1;
+    }
+}
+
+static Flight* flight_find(const char* path, size_t len, uint32_t hash) {
+    for(Flight* f = flights; f; f = f->next) {
+        if(f->hash == hash && f->path_len == len &&
+           memcmp(f->path, path, len) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+// Waits for the leader of a flight, called with the cache locked. Returns
+// with it unlocked.
+static int flight_wait(Flight* f, const char* path, PathHandle* out) {
+    f->waiters++;
+    coalesced++;
+    while(!f->done) pthread_cond_wait(&flight_cond, &pc_lock);
+    PathEntry* e = f->entry;
+    int err = f->err;
+    if(--f->waiters == 0) free(f);
+    pthread_mutex_unlock(&pc_lock);
+
+    if(e) {    // Reference taken by the leader
+        out->fd = e->fd;
+        out->st = e->st;
+        out->entry = e;
+        return 0;
+    }
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    // The leader got a descriptor it could not cache; it is its own
+    return open_uncached(path, out);
+}
+
+// Publishes the leader's result, called with the cache locked.
+static void flight_finish(Flight* f, PathEntry* entry, int err) {
+    Flight** link = &flights;
+    while(*link != f) link = &(*link)->next;
+    *link = f->next;
+    f->done = true;
+    f->entry = entry;
+    f->err = err;
+    if(entry) entry->refs += f->waiters;
+    if(f->waiters == 0) free(f);
+    else
+        pthread_cond_broadcast(&flight_cond);
+}
+
+int pathcache_open(const char* path, PathHandle* out) {
+    size_t len = strlen(path);
+    if(len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pc_lock);
+    if(capacity == 0) {
+        pthread_mutex_unlock(&pc_lock);
+        return open_uncached(path, out);
+    }
+    uint32_t hash = hash_path(path, len);
+    PathEntry* e = lookup(path, len, hash);
+    if(e) {
+        entry_get(e);
+        hits++;
+        out->fd = e->fd;
+        out->st = e->st;
+        out->entry = e;
+        pthread_mutex_unlock(&pc_lock);
+        return 0;
+    }
+    Flight* f = flight_find(path, len, hash);
+    if(f) return flight_wait(f, path, out);
+    misses++;
+
+    // Without memory for the flight, the miss is simply not shared
+    f = calloc(1, sizeof(*f));
+    if(f) {
+        f->path = path;
+        f->path_len = len;
+        f->hash = hash;
+        f->next = flights;
+        flights = f;
+    }
+    int ret = open_miss(path, len, out);
+    if(f) {
+        int err = errno;
+        pthread_mutex_lock(&pc_lock);
+        flight_finish(f, ret == 0 ? out->entry : NULL, ret == 0 ? 0 : err);
+        pthread_mutex_unlock(&pc_lock);
+        errno = err;
+    }
+    return ret;
+}
+
+void pathcache_release(PathHandle* handle) {
+    if(handle->entry) {
+        pthread_mutex_lock(&pc_lock);
+        entry_put(handle->entry);
+        pthread_mutex_unlock(&pc_lock);
+    } else if(handle->fd >= 0) {
+        close(handle->fd);
+    }
+    handle->fd = -1;
+    handle->entry = NULL;
+}
+
+void pathcache_foreach_file(void (*fn)(void* ctx,
+                                       const char* path,
+                                       const struct stat* st),
+                            void* ctx) {
+    pthread_mutex_lock(&pc_lock);
+    for(PathEntry* e = lru_head; e; e = e->lru_next) {
+        if(S_ISREG(e->st.st_mode)) fn(ctx, e->path, &e->st);
+    }
+    pthread_mutex_unlock(&pc_lock);
+}
+
+void pathcache_dump_stats(FILE* out) {
+    pthread_mutex_lock(&pc_lock);
+    fprintf(out,
+            "[PathCache] %zu/%zu entries, %" PRIu64 " hits, %" PRIu64
+            " misses, %" PRIu64 " coalesced, %" PRIu64
+            " invalidations, %" PRIu64 " evictions\n",
+            count,
+            capacity,
+            hits,
+            misses,
+            coalesced,
+            invalidations,
+            evictions);
+    pthread_mutex_unlock(&pc_lock);
+}
@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 200809L
+#include "ratelimit.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RL_QUANTUM     16384    // Largest grant handed out per bucket check
+#define RL_MIN_BURST   65536    // Smallest bucket depth, must exceed quantum
+#define CLIENT_BUCKETS 256      // Hash buckets for the per-IP table
+
+typedef struct Bucket {
+    uint64_t rate;    // Bytes per second, 0 = unlimited
+    double tokens;
+    double burst;
+    uint64_t last_ns;
+} Bucket;
+
+struct ClientBucket {
+    struct in_addr addr;
+    Bucket bucket;
+    int refs;
+    uint64_t bytes;
+    uint64_t throttled_ns;
+    ClientBucket* next;
+};
+
+static pthread_mutex_t rl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rl_cond;
+static Bucket global_bucket;
+static uint64_t client_rate;
+static ClientBucket* clients[CLIENT_BUCKETS];
+// A writer waiting for the global bucket, on its stack
+typedef struct Waiter {
+    struct Waiter* next;
+} Waiter;
+
+// Writers waiting for the global bucket, one queue per class, streaming
+// first. Only the head of the first non-empty queue may take tokens, one
+// grant at a time; a writer that wants more joins the tail again, so the
+// bandwidth goes round-robin between connections, RL_QUANTUM bytes per
+// turn, instead of to whichever thread wakes up first.
+static Waiter* queue_head[TRAFFIC_CLASS_COUNT];
+static Waiter* queue_tail[TRAFFIC_CLASS_COUNT];
+static uint64_t class_bytes[TRAFFIC_CLASS_COUNT];
+static uint64_t class_throttled_ns[TRAFFIC_CLASS_COUNT];
+
+static const char* class_names[TRAFFIC_CLASS_COUNT] = {"stream", "bulk"};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void bucket_init(Bucket* b, uint64_t rate) {
+    b->rate = rate;
+    b->burst = (double) (rate / 8 > RL_MIN_BURST ? rate / 8 : RL_MIN_BURST);
+    b->tokens = b->burst;
+    b->last_ns = now_ns();
+}
+
+static void bucket_refill(Bucket* b, uint64_t now) {
+    if(b->rate == 0) return;
+    b->tokens += (double) (now - b->last_ns) * (double) b->rate / 1e9;
+    if(b->tokens > b->burst) b->tokens = b->burst;
+    b->last_ns = now;
+}
+
+// Seconds until the bucket holds `need` tokens (0 when it already does)
+static double bucket_deficit(const Bucket* b, size_t need) {
+    if(b->rate == 0 || b->tokens >= (double) need) return 0.0;
+    return ((double) need - b->tokens) / (double) b->rate;
+}
+
+static unsigned hash_addr(struct in_addr addr) {
+    uint32_t h = addr.s_addr * 2654435761u;
+    return h % CLIENT_BUCKETS;
+}
+
+void rl_init(uint64_t global_rate, uint64_t per_client_rate) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rl_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    bucket_init(&global_bucket, global_rate);
+    client_rate = per_client_rate;
+}
+
+ClientBucket* rl_client_acquire(struct in_addr addr) {
+    if(client_rate == 0) return NULL;
+
+    pthread_mutex_lock(&rl_lock);
+    unsigned h = hash_addr(addr);
+    ClientBucket* c = clients[h];
+    while(c && c->addr.s_addr != addr.s_addr) c = c->next;
+    if(!c && (c = calloc(1, sizeof(ClientBucket))) != NULL) {
+        c->addr = addr;
+        bucket_init(&c->bucket, client_rate);
+        c->next = clients[h];
+        clients[h] = c;
+    }
+    if(c) c->refs++;
+    pthread_mutex_unlock(&rl_lock);
+    return c;
+}
+
+void rl_client_release(ClientBucket* client) {
+    if(!client) return;
+
+    pthread_mutex_lock(&rl_lock);
+    if(--client->refs == 0) {
+        ClientBucket** pp = &clients[hash_addr(client->addr)];
+        while(*pp != client) pp = &(*pp)->next;
+        *pp = client->next;
+        free(client);
+    }
+    pthread_mutex_unlock(&rl_lock);
+}
+
+static void queue_push(TrafficClass cls, Waiter* w) {
+    w->next = NULL;
+    if(queue_tail[cls]) queue_tail[cls]->next = w;
+    else
+        queue_head[cls] = w;
+    queue_tail[cls] = w;
+}
+
+static void queue_remove(TrafficClass cls, Waiter* w) {
+    Waiter* prev = NULL;
+    for(Waiter* q = queue_head[cls]; q != w; q = q->next) prev = q;
+    if(prev) prev->next = w->next;
+    else
+        queue_head[cls] = w->next;
+    if(queue_tail[cls] == w) queue_tail[cls] = prev;
+}
+
+// True if a writer of class cls would have to queue behind someone
+static bool queue_busy(TrafficClass cls) {
+    for(int c = 0; c <= (int) cls; c++) {
+        if(queue_head[c]) return true;
+    }
+    return false;
+}
+
+static bool queue_turn(TrafficClass cls, const Waiter* w) {
+    if(queue_head[cls] != w) return false;
+    for(int c = 0; c < (int) cls; c++) {
+        if(queue_head[c]) return false;
+    }
+    return true;
+}
+
+// Blocks until `want` (capped to the quantum) tokens are available in every
+// bucket that applies, deducts them and returns the granted byte count.
+static size_t rl_take(ClientBucket* client, TrafficClass cls, size_t want) {
+    size_t need = want < RL_QUANTUM ? want : RL_QUANTUM;
+    uint64_t wait_start = 0;
+    Waiter self;
+    bool queued = false;
+
+    pthread_mutex_lock(&rl_lock);
+    for(;;) {
+        uint64_t now = now_ns();
+        bucket_refill(&global_bucket, now);
+        if(client) bucket_refill(&client->bucket, now);
+
+        double global_wait = bucket_deficit(&global_bucket, need);
+        double client_wait = client ? bucket_deficit(&client->bucket, need) :
+                                      0.0;
+        double wait;
+        if(client_wait > 0.0) {
+            // Held back by its own client's limit: out of the queue, so it
+            // does not stall the other clients while it waits
+            if(queued) {
+                queue_remove(cls, &self);
+                queued = false;
+                pthread_cond_broadcast(&rl_cond);
+            }
+            wait = client_wait;
+        } else {
+            if(!queued && (global_wait > 0.0 || queue_busy(cls))) {
+                queue_push(cls, &self);
+                queued = true;
+            }
+            bool turn = !queued || queue_turn(cls, &self);
+            if(turn && global_wait == 0.0) break;
+            wait = turn ? global_wait : 0.0;    // Woken when the head leaves
+        }
+
+        if(!wait_start) wait_start = now;
+        if(wait == 0.0 || wait > 0.1) wait = 0.1;    // Recheck periodically
+        uint64_t deadline = now + (uint64_t) (wait * 1e9);
+        struct timespec ts = {.tv_sec = (time_t) (deadline / 1000000000ull),
+                              .tv_nsec = (long) (deadline % 1000000000ull)};
+        pthread_cond_timedwait(&rl_cond, &rl_lock, &ts);
+    }
+
+    if(queued) {
+        queue_remove(cls, &self);
+        pthread_cond_broadcast(&rl_cond);
+    }
+    if(wait_start) {
+        uint64_t waited = now_ns() - wait_start;
+        class_throttled_ns[cls] += waited;
+        if(client) client->throttled_ns += waited;
+    }
+    if(global_bucket.rate) global_bucket.tokens -= (double) need;
+    if(client && client->bucket.rate) client->bucket.tokens -= (double) need;
+    pthread_mutex_unlock(&rl_lock);
+    return need;
+}
+
+static ssize_t sendfile_all(int fd, int file_fd, off_t offset, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = sendfile(fd, file_fd, &offset, len - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;    // Error, or the file shrank
+        done += (size_t) n;
+    }
+    return (ssize_t) done;
+}
+
+static ssize_t write_all(int fd, const char* buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        done += (size_t) n;
+    }
+    return (ssize_t) done;
+}
+
+ssize_t rl_write(int fd,
+                 const void* buf,
+                 size_t len,
+                 ClientBucket* client,
+                 TrafficClass cls) {
+    const char* p = buf;
+    size_t done = 0;
+
+    if(global_bucket.rate == 0 && !client) {
+        if(write_all(fd, p, len) < 0) return -1;
+        __atomic_fetch_add(&class_bytes[cls], len, __ATOMIC_RELAXED);
+        return (ssize_t) len;
+    }
+
+    while(done < len) {
+        size_t grant = rl_take(client, cls, len - done);
+        if(write_all(fd, p + done, grant) < 0) return -1;
+        done += grant;
+        __atomic_fetch_add(&class_bytes[cls], grant, __ATOMIC_RELAXED);
+        if(client) __atomic_fetch_add(&client->bytes, grant, __ATOMIC_RELAXED);
+    }
+    return (ssize_t) done;
+}
+
+ssize_t rl_sendfile(int fd,
+                    int file_fd,
+                    off_t offset,
+                    size_t len,
+                    ClientBucket* client,
+                    TrafficClass cls) {
+    size_t done = 0;
+    while(done < len) {
+        size_t grant = len - done;
+        if(global_bucket.rate != 0 || client)
+            grant = rl_take(client, cls, grant);
+        if(sendfile_all(fd, file_fd, offset + (off_t) done, grant) < 0)
+            return -1;
+        done += grant;
+        __atomic_fetch_add(&class_bytes[cls], grant, __ATOMIC_RELAXED);
+        if(client) __atomic_fetch_add(&client->bytes, grant, __ATOMIC_RELAXED);
+    }
+    return (ssize_t) done;
+}
+
+void rl_dump_stats(FILE* out) {
+    pthread_mutex_lock(&rl_lock);
+    fprintf(out,
+            "[RateLimit] global limit: %" PRIu64 " B/s, client limit: %" PRIu64
+            " B/s\n",
+            global_bucket.rate,
+            client_rate);
+    for(int i = 0; i < TRAFFIC_CLASS_COUNT; i++) {
+        fprintf(out,
+                "[RateLimit] %-6s sent %" PRIu64 " B, throttled %.3f s\n",
+                class_names[i],
+                __atomic_load_n(&class_bytes[i], __ATOMIC_RELAXED),
+                (double) class_throttled_ns[i] / 1e9);
+    }
+    for(int h = 0; h < CLIENT_BUCKETS; h++) {
+        for(ClientBucket* c = clients[h]; c; c = c->next) {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &c->addr, ip, sizeof(ip));
+            fprintf(out,
+                    "[RateLimit] client %s (%d conn) sent %" PRIu64
+                    " B, throttled %.3f s\n",
+                    ip,
+                    c->refs,
+                    __atomic_load_n(&c->bytes, __ATOMIC_RELAXED),
+                    (double) c->throttled_ns / 1e9);
+        }
+    }
+    pthread_mutex_unlock(&rl_lock);
+    fflush(out);
+}
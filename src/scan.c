@@ -0,0 +1,294 @@
+#include "scan.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Every kernel takes the start offset and returns the offset it stopped at:
+// the match, or the first position it did not examine. Vector kernels stop
+// short of the tail and leave it to the scalar kernel.
+
+typedef size_t (*QuadFn)(const char* buf, size_t len, const char pat[4]);
+typedef size_t (*PairFn)(const char* buf, size_t len, char a, char b);
+typedef uint32_t (*MaskFn)(const char* buf, char a, char b);
+
+// --- Scalar kernels, also used for the tails of the vector loops ---
+
+static size_t quad_scalar(const char* buf, size_t len, const char pat[4]) {
+    for(size_t i = 0; i + 4 <= len; i++) {
+        if(buf[i] == pat[0] && buf[i + 3] == pat[3] &&
+           memcmp(buf + i + 1, pat + 1, 2) == 0)
+            return i;
+    }
+    return len;
+}
+
+static size_t pair_scalar(const char* buf, size_t len, char a, char b) {
+    for(size_t i = 0; i + 2 <= len; i++) {
+        if(buf[i] == a && buf[i + 1] == b) return i;
+    }
+    return len;
+}
+
+static size_t any2_scalar(const char* buf, size_t len, char a, char b) {
+    for(size_t i = 0; i < len; i++) {
+        if(buf[i] == a || buf[i] == b) return i;
+    }
+    return len;
+}
+
+#ifdef SCAN_X86
+
+#define SCAN_BLOCK 32    // Bytes per mask_* call
+
+// quad: compare the first and the last byte of the pattern at every position
+// of the block and verify the few candidates, so only two loads per block.
+
+__attribute__((target("avx2"))) static size_t quad_avx2(const char* buf,
+                                                        size_t len,
+                                                        const char pat[4]) {
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[3]);
+    size_t i = 0;
+    for(; i + 32 + 3 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (buf + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (buf + i + 3));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(x, first), _mm256_cmpeq_epi8(y, last)));
+        while(mask) {
+            size_t at = i + (size_t) __builtin_ctz(mask);
+            if(memcmp(buf + at + 1, pat + 1, 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return i + quad_scalar(buf + i, len - i, pat);
+}
+
+static size_t quad_sse2(const char* buf, size_t len, const char pat[4]) {
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[3]);
+    size_t i = 0;
+    for(; i + 16 + 3 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (buf + i));
+        __m128i y = _mm_loadu_si128((const __m128i*) (buf + i + 3));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(x, first), _mm_cmpeq_epi8(y, last)));
+        while(mask) {
+            size_t at = i + (size_t) __builtin_ctz(mask);
+            if(memcmp(buf + at + 1, pat + 1, 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return i + quad_scalar(buf + i, len - i, pat);
+}
+
+__attribute__((target("avx2"))) static size_t pair_avx2(const char* buf,
+                                                        size_t len,
+                                                        char a,
+                                                        char b) {
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    size_t i = 0;
+    for(; i + 32 + 1 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (buf + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (buf + i + 1));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(y, vb)));
+        if(mask) return i + (size_t) __builtin_ctz(mask);
+    }
+    return i + pair_scalar(buf + i, len - i, a, b);
+}
+
+static size_t pair_sse2(const char* buf, size_t len, char a, char b) {
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    size_t i = 0;
+    for(; i + 16 + 1 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (buf + i));
+        __m128i y = _mm_loadu_si128((const __m128i*) (buf + i + 1));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(y, vb)));
+        if(mask) return i + (size_t) __builtin_ctz(mask);
+    }
+    return i + pair_scalar(buf + i, len - i, a, b);
+}
+
+// mask: bit n set if buf[n] is a or b, for SCAN_BLOCK bytes at buf.
+
+__attribute__((target("avx2"))) static uint32_t mask_avx2(const char* buf,
+                                                          char a,
+                                                          char b) {
+    __m256i x = _mm256_loadu_si256((const __m256i*) buf);
+    return (uint32_t) _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(a)),
+                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8(b))));
+}
+
+static uint32_t mask_sse2(const char* buf, char a, char b) {
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    __m128i x = _mm_loadu_si128((const __m128i*) buf);
+    __m128i y = _mm_loadu_si128((const __m128i*) (buf + 16));
+    uint32_t lo = (uint32_t) _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+    uint32_t hi = (uint32_t) _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(y, va), _mm_cmpeq_epi8(y, vb)));
+    return lo | hi << 16;
+}
+
+__attribute__((target("avx2"))) static size_t any2_avx2(const char* buf,
+                                                        size_t len,
+                                                        char a,
+                                                        char b) {
+    size_t i = 0;
+    for(; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+        uint32_t mask = mask_avx2(buf + i, a, b);
+        if(mask) return i + (size_t) __builtin_ctz(mask);
+    }
+    return i + any2_scalar(buf + i, len - i, a, b);
+}
+
+static size_t any2_sse2(const char* buf, size_t len, char a, char b) {
+    size_t i = 0;
+    for(; i + SCAN_BLOCK <= len; i += SCAN_BLOCK) {
+        uint32_t mask = mask_sse2(buf + i, a, b);
+        if(mask) return i + (size_t) __builtin_ctz(mask);
+    }
+    return i + any2_scalar(buf + i, len - i, a, b);
+}
+
+static QuadFn quad_fn = quad_sse2;
+static PairFn pair_fn = pair_sse2;
+static PairFn any2_fn = any2_sse2;
+static MaskFn mask_fn = mask_sse2;
+
+// Picks the kernels once at load time instead of testing the CPU per call.
+__attribute__((constructor)) static void scan_select(void) {
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        quad_fn = quad_avx2;
+        pair_fn = pair_avx2;
+        any2_fn = any2_avx2;
+        mask_fn = mask_avx2;
+    }
+}
+
+#else
+
+static QuadFn quad_fn = quad_scalar;
+static PairFn pair_fn = pair_scalar;
+static PairFn any2_fn = any2_scalar;
+
+#endif    // SCAN_X86
+
+const char* scan_quad(const char* buf, size_t len, const char pat[4]) {
+    size_t at = quad_fn(buf, len, pat);
+    return at < len ? buf + at : NULL;
+}
+
+const char* scan_pair(const char* buf, size_t len, char a, char b) {
+    size_t at = pair_fn(buf, len, a, b);
+    return at < len ? buf + at : NULL;
+}
+
+const char* scan_any2(const char* buf, size_t len, char a, char b) {
+    size_t at = any2_fn(buf, len, a, b);
+    return at < len ? buf + at : NULL;
+}
+
+static int hexval(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return c - 'A' + 10;
+}
+
+// Closes the segment dst[*seg, out): drops empty and "." segments, resolves
+// ".." against the previous segment, otherwise appends a separator. Returns
+// the new output length.
+static size_t end_segment(char* dst, size_t out, size_t* seg) {
+    size_t len = out - *seg;
+    const char* s = dst + *seg;
+    if(len == 0 || (len == 1 && s[0] == '.')) {
+        out = *seg;
+    } else if(len == 2 && s[0] == '.' && s[1] == '.') {
+        out = *seg;
+        if(out > 0) {
+            out--;    // Previous separator
+            while(out > 0 && dst[out - 1] != '/') out--;
+        }
+    } else {
+        dst[out++] = '/';
+    }
+    *seg = out;
+    return out;
+}
+
+// Handles the '%' or '/' at src[i]. Returns the index after it.
+static size_t decode_special(const char* src,
+                             size_t len,
+                             size_t i,
+                             char* dst,
+                             size_t* out,
+                             size_t* seg,
+                             int* bad) {
+    if(src[i] == '/') {
+        *out = end_segment(dst, *out, seg);
+        return i + 1;
+    }
+    if(len - i >= 3 && isxdigit((unsigned char) src[i + 1]) &&
+       isxdigit((unsigned char) src[i + 2])) {
+        char c = (char) (hexval(src[i + 1]) * 16 + hexval(src[i + 2]));
+        if(c == '\0') *bad = 1;
+        if(c == '/') {
+            *out = end_segment(dst, *out, seg);
+        } else {
+            dst[(*out)++] = c;
+        }
+        return i + 3;
+    }
+    dst[(*out)++] = '%';    // Stray '%' is kept literally
+    return i + 1;
+}
+
+int scan_decode_path(char* dst, const char* src, size_t len) {
+    size_t i = 0, out = 0, seg = 0;
+    int bad = 0;
+
+#ifdef SCAN_X86
+    // One mask per block gives every special byte in it; the ordinary runs
+    // between them are copied whole.
+    while(i + SCAN_BLOCK <= len && !bad) {
+        size_t base = i;
+        uint32_t mask = mask_fn(src + base, '%', '/');
+        while(mask) {
+            size_t at = base + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+            if(at < i) continue;    // Inside an escape already consumed
+            memcpy(dst + out, src + i, at - i);
+            out += at - i;
+            i = decode_special(src, len, at, dst, &out, &seg, &bad);
+        }
+        if(i < base + SCAN_BLOCK) {
+            memcpy(dst + out, src + i, base + SCAN_BLOCK - i);
+            out += base + SCAN_BLOCK - i;
+            i = base + SCAN_BLOCK;
+        }
+    }
+#endif
+    while(i < len && !bad) {
+        if(src[i] == '%' || src[i] == '/') {
+            i = decode_special(src, len, i, dst, &out, &seg, &bad);
+        } else {
+            dst[out++] = src[i++];
+        }
+    }
+    if(bad) return -1;
+    out = end_segment(dst, out, &seg);
+
+    if(out > 0) out--;    // Trailing separator
+    if(out == 0) dst[out++] = '.';
+    dst[out] = '\0';
+    return (int) out;
+}
@@ -0,0 +1,408 @@
+#define _DEFAULT_SOURCE
+#include "seekindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libavformat/avformat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEEK_MAGIC     "MSK1"
+#define CLUSTER_SEARCH 65536    // Bytes searched back from a keyframe block
+
+typedef enum IndexState {
+    INDEX_BUILDING,
+    INDEX_READY,
+    INDEX_FAILED
+} IndexState;
+
+typedef struct SeekIndex {
+    char path[PATH_MAX];
+    off_t size;    // Source size and mtime the index was built for
+    struct timespec mtime;
+    IndexState state;
+    int waiters;    // Lookups waiting for the build, pins the entry
+    uint32_t count;
+    uint32_t* ms;     // Keyframe times in milliseconds, ascending
+    uint64_t* pos;    // Offsets of the clusters holding them
+    struct SeekIndex* next;    // Most recently used first
+    struct SeekIndex* queued;    // Next build waiting for a worker
+} SeekIndex;
+
+// On-disk layout: this header, count uint32 times, count uint64 offsets
+typedef struct SeekFileHeader {
+    char magic[4];
+    uint32_t count;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+} SeekFileHeader;
+
+static pthread_mutex_t seek_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seek_cond = PTHREAD_COND_INITIALIZER;
+static SeekIndex* indexes = NULL;
+
+// Builds waiting for one of the SEEK_WORKERS threads, oldest first. Queued
+// entries are INDEX_BUILDING, so they are not evicted.
+static SeekIndex* build_head = NULL;
+static SeekIndex* build_tail = NULL;
+static pthread_cond_t build_cond = PTHREAD_COND_INITIALIZER;
+static int workers;
+
+static void free_index(SeekIndex* idx) {
+    free(idx->ms);
+    free(idx->pos);
+    free(idx);
+}
+
+static bool matches(const SeekIndex* idx, const struct stat* st) {
+    return idx->size == st->st_size &&
+           idx->mtime.tv_sec == st->st_mtim.tv_sec &&
+           idx->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Appends a keyframe, keeping both arrays ascending (B-frame reordering and
+// repeated cue points would otherwise break the binary search).
+static int push_keyframe(SeekIndex* idx,
+                         size_t* cap,
+                         int64_t ms,
+                         uint64_t pos) {
+    if(ms < 0) ms = 0;
+    if(ms > UINT32_MAX) return 0;
+    if(idx->count > 0 && ((uint32_t) ms <= idx->ms[idx->count - 1] ||
+                          pos <= idx->pos[idx->count - 1]))
+        return 0;
+    if(idx->count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 1024;
+        uint32_t* ms_arr = realloc(idx->ms, new_cap * sizeof(uint32_t));
+        if(!ms_arr) return -1;
+        idx->ms = ms_arr;
+        uint64_t* pos_arr = realloc(idx->pos, new_cap * sizeof(uint64_t));
+        if(!pos_arr) return -1;
+        idx->pos = pos_arr;
+        *cap = new_cap;
+    }
+    idx->ms[idx->count] = (uint32_t) ms;
+    idx->pos[idx->count] = pos;
+    idx->count++;
+    return 0;
+}
+
+// Packet positions point at the block; players need to start at the
+// enclosing Cluster element, whose ID is searched for just before it.
+static uint64_t cluster_start(int fd, uint64_t block_pos) {
+    static const unsigned char cluster_id[4] = {0x1F, 0x43, 0xB6, 0x75};
+    unsigned char buf[CLUSTER_SEARCH];
+    uint64_t from = block_pos > CLUSTER_SEARCH ? block_pos - CLUSTER_SEARCH : 0;
+    ssize_t n = pread(fd, buf, (size_t) (block_pos - from), (off_t) from);
+    for(ssize_t i = n - 4; i >= 0; i--) {
+        if(memcmp(buf + i, cluster_id, 4) == 0) return from + (uint64_t) i;
+    }
+    return block_pos;
+}
+
+// Fills idx from the file's Cues if it has them, else by reading every
+// packet of the video stream. Returns 0 on success.
+static int build_index(SeekIndex* idx, bool* from_cues) {
+    AVFormatContext* fmt_ctx = NULL;
+    av_log_set_level(AV_LOG_QUIET);
+    if(avformat_open_input(&fmt_ctx, idx->path, NULL, NULL) < 0) return -1;
+    if(avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+    int video =
+        av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if(video < 0) {
+        avformat_close_input(&fmt_ctx);
+        return -1;
+    }
+
+    AVStream* st = fmt_ctx->streams[video];
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    AVRational ms_base = {1, 1000};
+    size_t cap = 0;
+    int ret = 0;
+
+    // Matroska Cues are loaded into the stream index, with cluster offsets
+    int entries = avformat_index_get_entries_count(st);
+    for(int i = 0; i < entries && ret == 0; i++) {
+        const AVIndexEntry* e = avformat_index_get_entry(st, i);
+        if(!(e->flags & AVINDEX_KEYFRAME) || e->pos < 0) continue;
+        int64_t ms =
+            av_rescale_q(e->timestamp - start, st->time_base, ms_base);
+        ret = push_keyframe(idx, &cap, ms, (uint64_t) e->pos);
+    }
+    *from_cues = idx->count > 0;
+
+    if(!*from_cues && ret == 0) {
+        int fd = open(idx->path, O_RDONLY | O_CLOEXEC);
+        AVPacket* pkt = av_packet_alloc();
+        for(unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
+            if((int) i != video) fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+        while(fd >= 0 && pkt && ret == 0 && av_read_frame(fmt_ctx, pkt) >= 0) {
+            if(pkt->stream_index == video && (pkt->flags & AV_PKT_FLAG_KEY) &&
+               pkt->pos >= 0 && pkt->pts != AV_NOPTS_VALUE) {
+                int64_t ms =
+                    av_rescale_q(pkt->pts - start, st->time_base, ms_base);
+                ret = push_keyframe(
+                    idx, &cap, ms, cluster_start(fd, (uint64_t) pkt->pos));
+            }
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        if(fd >= 0) close(fd);
+    }
+
+    avformat_close_input(&fmt_ctx);
+    return ret == 0 && idx->count > 0 ? 0 : -1;
+}
+
+static void write_index(const SeekIndex* idx) {
+    char path[PATH_MAX + 16], tmp[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s" SEEK_INDEX_SUFFIX, idx->path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    SeekFileHeader header = {
+        .magic = SEEK_MAGIC,
+        .count = idx->count,
+        .source_size = (uint64_t) idx->size,
+        .source_mtime_sec = idx->mtime.tv_sec,
+        .source_mtime_nsec = idx->mtime.tv_nsec,
+    };
+    FILE* f = fopen(tmp, "wb");
+    if(!f) {
+        fprintf(stderr, "[Seek] Could not write %s\n", tmp);
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(idx->ms, sizeof(uint32_t), idx->count, f) == idx->count &&
+              fwrite(idx->pos, sizeof(uint64_t), idx->count, f) == idx->count;
+    if(fclose(f) != 0 || !ok) {
+        unlink(tmp);
+        return;
+    }
+    rename(tmp, path);
+}
+
+// Checks what build_index guarantees: both arrays strictly ascending and
+// every offset inside the source, as seek_lookup's binary search needs.
+static bool index_valid(const SeekIndex* idx, uint32_t count) {
+    for(uint32_t i = 0; i < count; i++) {
+        if(idx->pos[i] >= (uint64_t) idx->size) return false;
+        if(i > 0 && (idx->ms[i] <= idx->ms[i - 1] ||
+                     idx->pos[i] <= idx->pos[i - 1]))
+            return false;
+    }
+    return true;
+}
+
+// Loads the persisted index if it was built for the current source. A
+// damaged file is rejected, and the index is built again.
+static int read_index(SeekIndex* idx) {
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s" SEEK_INDEX_SUFFIX, idx->path);
+    FILE* f = fopen(path, "rb");
+    if(!f) return -1;
+
+    // Offsets are distinct and below the source size, and the file holds
+    // exactly count entries, so a bad count cannot cause a huge allocation
+    SeekFileHeader header;
+    struct stat st;
+    int ret = -1;
+    if(fread(&header, sizeof(header), 1, f) == 1 &&
+       memcmp(header.magic, SEEK_MAGIC, 4) == 0 && header.count > 0 &&
+       header.source_size == (uint64_t) idx->size &&
+       header.source_mtime_sec == idx->mtime.tv_sec &&
+       header.source_mtime_nsec == idx->mtime.tv_nsec &&
+       header.count <= header.source_size && fstat(fileno(f), &st) == 0 &&
+       (uint64_t) st.st_size ==
+           sizeof(header) + (uint64_t) header.count *
+                                (sizeof(uint32_t) + sizeof(uint64_t))) {
+        idx->ms = malloc(header.count * sizeof(uint32_t));
+        idx->pos = malloc(header.count * sizeof(uint64_t));
+        if(idx->ms && idx->pos &&
+           fread(idx->ms, sizeof(uint32_t), header.count, f) == header.count &&
+           fread(idx->pos, sizeof(uint64_t), header.count, f) ==
+               header.count &&
+           index_valid(idx, header.count)) {
+            idx->count = header.count;
+            ret = 0;
+        }
+    }
+    fclose(f);
+    if(ret != 0) {
+        free(idx->ms);
+        free(idx->pos);
+        idx->ms = NULL;
+        idx->pos = NULL;
+    }
+    return ret;
+}
+
+static void* index_worker(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&seek_lock);
+    for(;;) {
+        while(!build_head) pthread_cond_wait(&build_cond, &seek_lock);
+        SeekIndex* idx = build_head;
+        build_head = idx->queued;
+        if(!build_head) build_tail = NULL;
+        pthread_mutex_unlock(&seek_lock);
+
+        // The entry is not evicted while building, and nothing else touches
+        // the arrays until the state changes
+        bool from_cues = false;
+        int ret = build_index(idx, &from_cues);
+        if(ret == 0) {
+            printf("[Seek] Indexed %s: %u keyframes%s\n",
+                   idx->path,
+                   idx->count,
+                   from_cues ? " from cues" : "");
+            write_index(idx);
+        } else {
+            fprintf(stderr, "[Seek] Could not index %s\n", idx->path);
+        }
+
+        pthread_mutex_lock(&seek_lock);
+        idx->state = ret == 0 ? INDEX_READY : INDEX_FAILED;
+        pthread_cond_broadcast(&seek_cond);
+    }
+    return NULL;
+}
+
+// Queues the build of idx, starting another worker while there are fewer
+// than SEEK_WORKERS. Caller holds seek_lock.
+static int queue_build(SeekIndex* idx) {
+    if(workers < SEEK_WORKERS) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, index_worker, NULL) == 0) {
+            pthread_detach(thread);
+            workers++;
+        } else if(workers == 0) {
+            return -1;
+        }
+    }
+    idx->queued = NULL;
+    if(build_tail) build_tail->queued = idx;
+    else
+        build_head = idx;
+    build_tail = idx;
+    pthread_cond_signal(&build_cond);
+    return 0;
+}
+
+// Drops the least recently used indexes over SEEK_CACHE. Caller holds
+// seek_lock.
+static void evict_indexes(void) {
+    int kept = 0;
+    for(SeekIndex** pp = &indexes; *pp;) {
+        SeekIndex* idx = *pp;
+        if(++kept > SEEK_CACHE && idx->state != INDEX_BUILDING &&
+           idx->waiters == 0) {
+            *pp = idx->next;
+            free_index(idx);
+        } else {
+            pp = &idx->next;
+        }
+    }
+}
+
+// Finds or creates the index entry of path and moves it to the front.
+// Caller holds seek_lock.
+static SeekIndex* get_index(const char* path, const struct stat* st) {
+    SeekIndex* idx = NULL;
+    for(SeekIndex** pp = &indexes; *pp; pp = &(*pp)->next) {
+        if(strcmp((*pp)->path, path) != 0) continue;
+        idx = *pp;
+        *pp = idx->next;
+        break;
+    }
+
+    // The source changed: rebuild, unless a build is still running
+    if(idx && !matches(idx, st) && idx->state != INDEX_BUILDING &&
+       idx->waiters == 0) {
+        free_index(idx);
+        idx = NULL;
+    }
+
+    if(!idx) {
+        idx = calloc(1, sizeof(SeekIndex));
+        if(!idx) return NULL;
+        snprintf(idx->path, sizeof(idx->path), "%s", path);
+        idx->size = st->st_size;
+        idx->mtime = st->st_mtim;
+        if(read_index(idx) == 0) {
+            idx->state = INDEX_READY;
+        } else {
+            idx->state = INDEX_BUILDING;
+            if(queue_build(idx) != 0) idx->state = INDEX_FAILED;
+        }
+    }
+
+    idx->next = indexes;
+    indexes = idx;
+    evict_indexes();
+    return idx;
+}
+
+int seek_lookup(const char* path,
+                const struct stat* st,
+                double seconds,
+                off_t* offset,
+                double* time) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SEEK_WAIT_MS / 1000;
+    deadline.tv_nsec += (SEEK_WAIT_MS % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&seek_lock);
+    SeekIndex* idx = get_index(path, st);
+    if(!idx) {
+        pthread_mutex_unlock(&seek_lock);
+        return -1;
+    }
+
+    // Indexes from Cues are usually ready well within the wait
+    idx->waiters++;
+    while(idx->state == INDEX_BUILDING) {
+        if(pthread_cond_timedwait(&seek_cond, &seek_lock, &deadline) ==
+           ETIMEDOUT)
+            break;
+    }
+    idx->waiters--;
+
+    int ret = idx->state == INDEX_READY ? 0 :
+              idx->state == INDEX_BUILDING ? 1 :
+                                             -1;
+    if(ret == 0) {
+        // Last keyframe at or before the requested time
+        uint32_t target = seconds <= 0 ? 0 :
+                          seconds >= UINT32_MAX / 1000.0 ?
+                                         UINT32_MAX :
+                                         (uint32_t) (seconds * 1000.0);
+        uint32_t lo = 0, hi = idx->count;
+        while(hi - lo > 1) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if(idx->ms[mid] <= target) lo = mid;
+            else
+                hi = mid;
+        }
+        *offset = (off_t) idx->pos[lo];
+        *time = idx->ms[lo] / 1000.0;
+    }
+    pthread_mutex_unlock(&seek_lock);
+    return ret;
+}
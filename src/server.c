@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "site.h"
+#include "socktune.h"
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x)  STRINGIFY_(x)
+
+static const char overload_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: " STRINGIFY(RETRY_AFTER) "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+extern char** environ;
+
+static int max_in_flight;
+static int active_connections;
+
+static int* listen_fds = NULL;
+static int listen_count = 0;
+
+// Written once by server_stop(); never drained, so every listener wakes up
+static int stop_pipe[2] = {-1, -1};
+static bool draining = false;
+
+// Spare descriptor released when accept() hits EMFILE so the pending
+// connection can still be accepted, told to retry and closed.
+static int reserve_fd = -1;
+static pthread_mutex_t reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_attr_t client_attr;
+
+int server_active_connections(void) {
+    return __atomic_load_n(&active_connections, __ATOMIC_RELAXED);
+}
+
+bool server_draining(void) {
+    return __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+}
+
+void server_stop(void) {
+    if(__atomic_exchange_n(&draining, true, __ATOMIC_ACQ_REL)) return;
+    if(stop_pipe[1] >= 0) {
+        char c = 0;
+        (void) !write(stop_pipe[1], &c, 1);
+    }
+}
+
+// Finds the program argv[0] names the way execvp() would, so the child only
+// has to call execve(). Returns 0 with the path in out.
+static int resolve_program(const char* name, char* out, size_t size) {
+    if(strchr(name, '/')) {
+        if((size_t) snprintf(out, size, "%s", name) >= size) return -1;
+        return access(out, X_OK);
+    }
+    const char* path = getenv("PATH");
+    if(!path) path = "/bin:/usr/bin";
+    while(*path) {
+        size_t len = strcspn(path, ":");
+        int n = snprintf(
+            out, size, "%.*s/%s", (int) len, len ? path : ".", name);
+        if(n > 0 && (size_t) n < size && access(out, X_OK) == 0) return 0;
+        path += len;
+        if(*path == ':') path++;
+    }
+    return -1;
+}
+
+int server_handoff(char* const argv[]) {
+    char program[PATH_MAX];
+    if(resolve_program(argv[0], program, sizeof(program)) != 0) {
+        fprintf(stderr, "Could not find %s for the handoff\n", argv[0]);
+        return -1;
+    }
+
+    char fds_env[256];
+    int len = snprintf(fds_env, sizeof(fds_env), "%s=", LISTEN_FDS_ENV);
+    for(int i = 0; i < listen_count && len < (int) sizeof(fds_env); i++) {
+        len += snprintf(fds_env + len,
+                        sizeof(fds_env) - len,
+                        i ? ",%d" : "%d",
+                        listen_fds[i]);
+    }
+    if(listen_count == 0 || len >= (int) sizeof(fds_env)) return -1;
+
+    // Environment for the new process: ours plus the socket list
+    size_t env_count = 0;
+    while(environ[env_count]) env_count++;
+    char** envp = calloc(env_count + 2, sizeof(char*));
+    if(!envp) return -1;
+    size_t j = 0;
+    for(size_t i = 0; i < env_count; i++) {
+        if(strncmp(environ[i], LISTEN_FDS_ENV "=", strlen(LISTEN_FDS_ENV) + 1))
+            envp[j++] = environ[i];
+    }
+    envp[j++] = fds_env;
+    envp[j] = NULL;
+
+    // The sockets stay close-on-exec here: ffmpeg may be forked by a
+    // conversion thread meanwhile and must not inherit them. Only the child
+    // clears the flag, with async-signal-safe calls up to the exec.
+    pid_t pid = fork();
+    if(pid == 0) {
+        for(int i = 0; i < listen_count; i++) {
+            fcntl(listen_fds[i], F_SETFD, 0);
+        }
+        execve(program, argv, envp);
+        _exit(127);
+    }
+    free(envp);
+
+    if(pid < 0) {
+        fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    printf("[Server] Handed listening sockets to pid %d\n", (int) pid);
+    return 0;
+}
+
+static void reject(int fd) {
+    // Best effort: the socket is fresh, so the send buffer has room
+    send(fd, overload_response, sizeof(overload_response) - 1,
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+static void release_slot(void* arg) {
+    (void) arg;
+    __atomic_fetch_sub(&active_connections, 1, __ATOMIC_RELEASE);
+}
+
+// Connection thread entry: keeps the in-flight counter balanced however
+// thread_fn terminates (it ends with pthread_exit).
+static void* connection_main(void* arg) {
+    pthread_cleanup_push(release_slot, NULL);
+    thread_fn(arg);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+// Returns false if there was no spare descriptor to shed a connection with,
+// in which case the caller backs off instead of retrying accept() at once.
+static bool recover_emfile(int listen_fd) {
+    pthread_mutex_lock(&reserve_lock);
+    // Lost when a previous reopen failed; descriptors may have been freed
+    if(reserve_fd < 0) reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    bool shed = reserve_fd >= 0;
+    if(shed) {
+        close(reserve_fd);
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd >= 0) reject(fd);
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    pthread_mutex_unlock(&reserve_lock);
+    fprintf(stderr,
+            shed ? "accept() ran out of file descriptors, shedding load\n" :
+                   "accept() ran out of file descriptors, backing off\n");
+    return shed;
+}
+
+static void dispatch(int fd, const struct sockaddr_in* addr) {
+    int in_flight =
+        __atomic_add_fetch(&active_connections, 1, __ATOMIC_ACQUIRE);
+    if(in_flight > max_in_flight) {
+        __atomic_fetch_sub(&active_connections, 1, __ATOMIC_RELEASE);
+        reject(fd);
+        return;
+    }
+
+    Client* client = malloc(sizeof(Client));
+    if(!client) {
+        __atomic_fetch_sub(&active_connections, 1, __ATOMIC_RELEASE);
+        reject(fd);
+        return;
+    }
+    client->fd = fd;
+    client->addr = *addr;
+
+    pthread_t thread;
+    int err = pthread_create(&thread, &client_attr, &connection_main, client);
+    if(err != 0) {
+        fprintf(stderr, "pthread_create() failed: %s\n", strerror(err));
+        free(client);
+        __atomic_fetch_sub(&active_connections, 1, __ATOMIC_RELEASE);
+        reject(fd);
+    }
+}
+
+static void* listener_fn(void* arg) {
+    int listen_fd = (int) (intptr_t) arg;
+    struct pollfd pfds[2] = {{.fd = listen_fd, .events = POLLIN},
+                             {.fd = stop_pipe[0], .events = POLLIN}};
+
+    while(!server_draining()) {
+        if(poll(pfds, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+            break;
+        }
+        if(pfds[1].revents) break;
+
+        // Drain the accept queue in batches before sleeping again
+        for(int i = 0; i < ACCEPT_BATCH; i++) {
+            struct sockaddr_in addr;
+            socklen_t addr_len = sizeof(addr);
+            int fd = accept4(
+                listen_fd, (struct sockaddr*) &addr, &addr_len, SOCK_CLOEXEC);
+            if(fd < 0) {
+                if(errno == EMFILE || errno == ENFILE) {
+                    if(recover_emfile(listen_fd)) continue;
+                    // Sleep until descriptors may be free, or until stopped
+                    poll(&pfds[1], 1, EMFILE_BACKOFF_MS);
+                    break;
+                }
+                if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if(errno == EINTR || errno == ECONNABORTED) continue;
+                fprintf(stderr, "accept() failed: %s\n", strerror(errno));
+                if(errno == ENOBUFS || errno == ENOMEM) usleep(10000);
+                break;
+            }
+            dispatch(fd, &addr);
+        }
+    }
+    close(listen_fd);
+    return NULL;
+}
+
+// Parses the socket list left by server_handoff() in the previous process
+static int inherit_listeners(const char* list, int** out) {
+    int count = 1;
+    for(const char* p = list; *p; p++) count += *p == ',';
+    int* fds = calloc(count, sizeof(int));
+    if(!fds) return -1;
+
+    int n = 0;
+    const char* p = list;
+    while(*p && n < count) {
+        char* end;
+        long fd = strtol(p, &end, 10);
+        if(end == p || fd < 0) break;
+        fcntl((int) fd, F_SETFD, FD_CLOEXEC);
+        fcntl((int) fd, F_SETFL, fcntl((int) fd, F_GETFL) | O_NONBLOCK);
+        fds[n++] = (int) fd;
+        p = *end == ',' ? end + 1 : end;
+    }
+    if(n == 0) {
+        free(fds);
+        return -1;
+    }
+    *out = fds;
+    return n;
+}
+
+static int open_listener(int port, bool reuse_port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int opt = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0 ||
+       (reuse_port &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0)) {
+        fprintf(stderr, "setsockopt() failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_addr.s_addr = INADDR_ANY,
+                               .sin_port = htons(port)};
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not bind socket: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    socktune_listener(fd);
+    if(listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "listen() failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int server_run(const ServerConfig* config) {
+    max_in_flight = config->max_connections;
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    pthread_attr_init(&client_attr);
+    pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&client_attr, CONNECTION_STACK_SIZE);
+
+    if(pipe2(stop_pipe, O_CLOEXEC) != 0) {
+        fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int count = config->listeners;
+    int* fds = NULL;
+    const char* inherited = getenv(LISTEN_FDS_ENV);
+    if(inherited) {
+        if((count = inherit_listeners(inherited, &fds)) < 0) {
+            fprintf(stderr, "Invalid %s: %s\n", LISTEN_FDS_ENV, inherited);
+            return -1;
+        }
+        unsetenv(LISTEN_FDS_ENV);
+        printf("[Server] Took over %d listening socket(s)\n", count);
+    } else {
+        if(!(fds = calloc(count, sizeof(int)))) return -1;
+        for(int i = 0; i < count; i++) {
+            if((fds[i] = open_listener(config->port, count > 1)) < 0) {
+                while(i--) close(fds[i]);
+                free(fds);
+                return -1;
+            }
+        }
+    }
+    listen_fds = fds;
+    listen_count = count;
+
+    pthread_t* threads = calloc(count, sizeof(pthread_t));
+    if(!threads) {
+        for(int i = 0; i < count; i++) close(fds[i]);
+        free(fds);
+        return -1;
+    }
+
+    int started = 0;
+    for(int i = 0; i < count; i++) {
+        if(pthread_create(&threads[started],
+                          NULL,
+                          &listener_fn,
+                          (void*) (intptr_t) fds[i]) != 0) {
+            fprintf(stderr, "Could not start listener %d\n", i);
+            close(fds[i]);
+            continue;
+        }
+        started++;
+    }
+
+    for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    listen_count = 0;
+    free(threads);
+
+    // Listeners are gone; give in-flight responses until the deadline
+    time_t deadline = time(NULL) + config->drain_timeout;
+    int remaining;
+    while((remaining = server_active_connections()) > 0 &&
+          time(NULL) < deadline) {
+        usleep(100000);
+    }
+    if(remaining > 0) {
+        fprintf(stderr,
+                "[Server] Drain timed out with %d connection(s) open\n",
+                remaining);
+    }
+    return started > 0 ? 0 : -1;
+}
@@ -1,495 +1,840 @@
 #define _POSIX_C_SOURCE 200809L
 #include "site.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cluster.h"
+#include "compress.h"
+#include "conversion.h"
 #include "ffmpeg_utils.h"
+#include "h2.h"
+#include "scan.h"
+#include "seekindex.h"
+#include "server.h"
+#include "snapshot.h"
+#include "socktune.h"
+#include "thumbnails.h"
+
+#define IDLE_POLL_MS 1000    // How often idle connections check for drain
+#define LIVE_WAIT_MS 15000    // How long a player waits for the first segments
 
 const char error_response[] =
     "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
 
+static const char processing_page[] =
+    "<html><head><meta http-equiv='refresh' content='5'></head><body "
+    "style='background:#111;color:white;text-align:center;padding-top:20%;"
+    "font-family:sans-serif;'>"
+    "<h1>Processing Video...</h1><p>Please wait...</p></body></html>";
+
+static const char failed_page[] =
+    "<html><body style='background:#111;color:red;text-align:center;"
+    "font-family:sans-serif;padding-top:20%;'>"
+    "<h1>Conversion Failed</h1><p>Check server logs.</p></body></html>";
+
+// Player page, formatted with the title, the master playlist URL and the
+// thumbnail directory URL
+static const char player_page_fmt[] =
+    "<!DOCTYPE html><html><head><title>Play</title><script "
+    "src=\"https://cdn.jsdelivr.net/npm/hls.js@latest\"></script>"
+    "<style>body{background:#111;color:white;text-align:center;font-family:"
+    "sans-serif;} select{padding:10px;margin:10px;background:#333;"
+    "color:white;border:1px solid #555;}</style></head>"
+    "<body><h2>%s</h2><div><label>Audio: <select "
+    "id='audioSelect'></select></label><label>Subs: "
+    "<select id='subSelect'></select></label></div>"
+    "<div style='position:relative;width:80%%;max-width:1000px;"
+    "margin:20px auto 0'><video id='video' controls style='width:100%%'>"
+    "</video><div id='thumb'></div></div>"
+    "<script>"
+    "var v=document.getElementById('video');var src='%s';var tb='%s';"
+    "v.poster=tb+'/poster.jpg';"
+    // Seek-bar previews from the WebVTT thumbnail track, once it exists
+    "var cues=[],th=document.getElementById('thumb');"
+    "fetch(tb+'/thumbnails.vtt').then(r=>r.ok?r.text():'').then(t=>{"
+    "t.split('\\n\\n').forEach(b=>{var l=b.trim().split('\\n');"
+    "if(l.length<2||l[0].indexOf('-->')<0)return;"
+    "var s=l[0].split(' --> ').map(x=>x.split(':')"
+    ".reduce((a,c)=>a*60+parseFloat(c),0));var m=l[1].split('#xywh=');"
+    "cues.push({s:s[0],e:s[1],u:tb+'/'+m[0],r:m[1].split(',')});});});"
+    "v.onmousemove=function(e){var c=null;"
+    "if(v.duration&&e.offsetY>v.clientHeight-50){"
+    "var t=e.offsetX/v.clientWidth*v.duration;"
+    "c=cues.find(q=>t>=q.s&&t<q.e);}"
+    "if(!c){th.style.display='none';return;}"
+    "th.style.cssText='position:absolute;pointer-events:none;"
+    "border:1px solid #555;width:'+c.r[2]+'px;height:'+c.r[3]+'px;"
+    "background:url(\"'+c.u+'\") -'+c.r[0]+'px -'+c.r[1]+'px;left:'+"
+    "(e.offsetX-c.r[2]/2)+'px;top:'+(v.clientHeight-60-c.r[3])+'px';};"
+    "v.onmouseleave=function(){th.style.display='none';};"
+    "if(Hls.isSupported()){var h=new Hls({startPosition:0});"
+    "h.loadSource(src);h.attachMedia(v);"
+    "h.on(Hls.Events.MANIFEST_PARSED,function(){v.play();updateTracks();});"
+    "h.on(Hls.Events.AUDIO_TRACKS_UPDATED, updateTracks);"
+    "h.on(Hls.Events.SUBTITLE_TRACKS_UPDATED, updateTracks);"
+    "function updateTracks(){"
+    "var as=document.getElementById('audioSelect');as.innerHTML='';"
+    "h.audioTracks.forEach((t,i)=>{var o=document.createElement('option');"
+    "o.value=i;o.text=t.name||t.lang||'Track '+(i+1);"
+    "if(i===h.audioTrack)o.selected=true;as.add(o);});"
+    "var ss=document.getElementById('subSelect');ss.innerHTML='';"
+    "var off=document.createElement('option');off.value=-1;"
+    "off.text='Off';if(h.subtitleTrack===-1)off.selected=true;ss.add(off);"
+    "h.subtitleTracks.forEach((t,i)=>{var o=document.createElement('option');"
+    "o.value=i;o.text=t.name||t.lang||'Sub '+(i+1);"
+    "if(i===h.subtitleTrack)o.selected=true;ss.add(o);});}"
+    "document.getElementById('audioSelect').onchange="
+    "function(){h.audioTrack=parseInt(this.value);};"
+    "document.getElementById('subSelect').onchange="
+    "function(){h.subtitleTrack=parseInt(this.value);};"
+    "}else if(v.canPlayType('application/vnd.apple.mpegurl')){v.src=src;}"
+    "</script></body></html>";
+
 // --- Prototypes ---
-void urldecode(char* dst, const char* src);
-void urlencode(char* dest, const char* src);
-void makeabsolute(char* dest, const char* src);
 void getcontenttype(char* dest, const char* filename);
-int getcontentrange(char* content, off_t* start, off_t* end);
-void normalizeranges(off_t* start, off_t* end, const off_t file_size);
-int check_or_start_hls(const char* mkv_path, char* out_hls_dir);
-int exists(const char* path);
+TrafficClass classifytraffic(const Request* req, off_t len);
+int getqueryvalue(char* dest, size_t len, const char* query, const char* name);
+
+// Waits for the next request on a keep-alive connection. Returns false when
+// the connection should be closed instead: the peer hung up, or the server is
+// draining and the connection is idle.
+static bool wait_for_request(int client_fd) {
+    struct pollfd pfd = {.fd = client_fd, .events = POLLIN};
+    for(;;) {
+        int ready = poll(&pfd, 1, IDLE_POLL_MS);
+        if(ready > 0) return true;
+        if(ready < 0 && errno != EINTR) return false;
+        if(server_draining()) return false;
+    }
+}
 
-typedef struct {
-    char mkv_path[PATH_MAX];
-    char hls_dir[PATH_MAX];
-} ConversionTask;
-
-void* conversion_worker(void* arg) {
-    ConversionTask* task = (ConversionTask*) arg;
-    printf("[Worker] Starting: %s\n", task->mkv_path);
-
-    int ret = generate_hls_with_tracks(task->mkv_path, task->hls_dir);
-
-    // Remove the lock file to signal completion
-    char lock_file[PATH_MAX + 16];
-    snprintf(lock_file, sizeof(lock_file), "%s/.processing", task->hls_dir);
-    unlink(lock_file);    // Delete .processing
-
-    if(ret != 0) {
-        char error_file[PATH_MAX + 16];
-        snprintf(error_file, sizeof(error_file), "%s/error.txt", task->hls_dir);
-        FILE* f = fopen(error_file, "w");
-        if(f) {
-            fprintf(f, "Failed: %d\n", ret);
-            fclose(f);
+// With more set, the kernel holds a partial segment back for the data that
+// follows instead of sending it on its own
+static ssize_t write_all(int fd, const char* buf, size_t len, bool more) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = send(fd,
+                         buf + done,
+                         len - done,
+                         MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            return -1;
         }
-    } else {
-        printf("[Worker] Finished Successfully: %s\n", task->mkv_path);
+        done += (size_t) n;
     }
+    return (ssize_t) done;
+}
 
-    free(task);
-    return NULL;
+void request_init(Request* req) {
+    memset(req, 0, sizeof(*req));
+    req->keep_alive = true;
+    req->range_end = -1;
+    req->query = "";
+    req->version = "";
 }
 
-int check_or_start_hls(const char* mkv_path, char* out_hls_dir) {
-    snprintf(out_hls_dir, PATH_MAX, "%s.hls", mkv_path);
-
-    char master_pl[PATH_MAX];
-    snprintf(master_pl, sizeof(master_pl), "%s/master.m3u8", out_hls_dir);
-
-    char lock_file[PATH_MAX];
-    snprintf(lock_file, sizeof(lock_file), "%s/.processing", out_hls_dir);
-
-    if(exists(lock_file)) {
-        printf("[Manager] Found stale lock file. Cleaning up %s...\n",
-               out_hls_dir);
-        char cmd[PATH_MAX + 16];
-        snprintf(cmd, sizeof(cmd), "rm -rf \"%s\"", out_hls_dir);
-        system(cmd);
-    } else if(exists(out_hls_dir) && !exists(master_pl)) {
-        printf("[Manager] Found corrupt folder. Cleaning up %s...\n",
-               out_hls_dir);
-        char cmd[PATH_MAX + 16];
-        snprintf(cmd, sizeof(cmd), "rm -rf \"%s\"", out_hls_dir);
-        system(cmd);
-    } else if(exists(master_pl)) {
-        return 0;
+int request_set_target(Request* req, Arena* arena, char* target, size_t len) {
+    if(len == 0 || target[0] != '/') return -1;
+
+    char* query_start = memchr(target, '?', len);
+    if(query_start) {
+        // Split path and query
+        *query_start = '\0';
+        req->query = query_start + 1;
+        len = (size_t) (query_start - target);
     }
 
-#ifdef _WIN32
-    _mkdir(out_hls_dir);
-#else
-    mkdir(out_hls_dir, 0755);
-#endif
+    req->path = arena_alloc(arena, len + 2);
+    if(!req->path) return -1;
+    return scan_decode_path(req->path, target, len) < 0 ? -1 : 0;
+}
 
-    FILE* f = fopen(lock_file, "w");
-    if(f) fclose(f);
+int request_add_header(Request* req,
+                       Arena* arena,
+                       const char* name,
+                       const char* value) {
+    if(!req->headers) {
+        req->headers = arena_alloc(arena, MAX_HEADERS * sizeof(HeaderField));
+        if(!req->headers) return -1;
+    }
+    if(req->header_count == MAX_HEADERS) return 0;
+    req->headers[req->header_count].name = name;
+    req->headers[req->header_count].value = value;
+    req->header_count++;
+
+    if(strcasecmp(name, "Range") == 0) {
+        if(getcontentrange(value, &req->range_start, &req->range_end) == 0)
+            req->range_request = true;
+    } else if(strcasecmp(name, "Connection") == 0) {
+        if(strcasecmp(value, "close") == 0) req->keep_alive = false;
+    }
+    return 0;
+}
 
-    ConversionTask* task = malloc(sizeof(ConversionTask));
-    if(!task) return -1;
-    snprintf(task->mkv_path, PATH_MAX, "%s", mkv_path);
-    snprintf(task->hls_dir, PATH_MAX, "%s", out_hls_dir);
+// Parses the request in buffer (len bytes, NUL-terminated, modified in
+// place). Returns 0 on success, -1 if the request is malformed.
+static int parse_request(char* buffer, size_t len, Arena* arena, Request* req) {
+    request_init(req);
+
+    const char* header_end = scan_quad(buffer, len, "\r\n\r\n");
+    if(!header_end) return -1;
+    char* end = buffer + (header_end - buffer) + 2;    // Past the last CRLF
+
+    // Request line: METHOD SP TARGET SP VERSION
+    char* line = buffer;
+    char* eol = (char*) scan_pair(line, (size_t) (end - line), '\r', '\n');
+    *eol = '\0';
+
+    char* target = memchr(line, ' ', (size_t) (eol - line));
+    if(!target) return -1;
+    *target++ = '\0';
+    req->method = line;
+    char* version = memchr(target, ' ', (size_t) (eol - target));
+    if(version) *version++ = '\0';
+    if(version) req->version = version;
+
+    size_t target_len = (size_t) ((version ? version - 1 : eol) - target);
+    if(request_set_target(req, arena, target, target_len) != 0) return -1;
+
+    for(line = eol + 2; line < end; line = eol + 2) {
+        eol = (char*) scan_pair(line, (size_t) (end - line), '\r', '\n');
+        *eol = '\0';
+
+        char* colon = memchr(line, ':', (size_t) (eol - line));
+        if(!colon) continue;
+        *colon = '\0';
+        char* value = colon + 1;
+        while(*value == ' ' || *value == '\t') value++;
+        if(request_add_header(req, arena, line, value) != 0) return -1;
+    }
+    return 0;
+}
 
-    pthread_t thread;
-    if(pthread_create(&thread, NULL, conversion_worker, task) == 0) {
-        pthread_detach(thread);
-        return 1;    // Processing
+const char* request_header(const Request* req, const char* name) {
+    for(size_t i = 0; i < req->header_count; i++) {
+        if(strcasecmp(req->headers[i].name, name) == 0)
+            return req->headers[i].value;
     }
-    free(task);
-    return -1;
+    return NULL;
 }
 
-void* thread_fn(void* arg) {
-    int client_fd = *((int*) arg);
-    free(arg);
-    Header header = {
-        .keep_alive = true, .range_request = false, .headers = NULL};
-
-    while(header.keep_alive) {
-        char buffer[BUFFER_SIZE];
-        ssize_t read_bytes = read(client_fd, buffer, sizeof(buffer) - 1);
-        if(read_bytes <= 0) {
-            close(client_fd);
-            pthread_exit((void*) 1);
-        }
-        buffer[read_bytes] = '\0';
-        // printf("Request:\n%s\n", buffer); // <-- REMOVED LOGGING
+static void set_body(Response* resp,
+                     int status,
+                     const char* reason,
+                     const char* content_type,
+                     const char* body,
+                     size_t body_len) {
+    resp->status = status;
+    resp->reason = reason;
+    resp->content_type = content_type;
+    resp->body = body;
+    resp->body_len = body_len;
+}
 
-        if(!strstr(buffer, "\r\n\r\n")) {
-            close(client_fd);
-            pthread_exit(NULL);
+// Holds a player request while a fresh conversion writes its first segments,
+// watching the output directory instead of having the browser poll. Returns
+// true once the live playlists can be served.
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool wait_for_playlists(const char* hls_dir) {
+    if(conversion_playlists_ready(hls_dir)) return true;
+
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if(fd < 0) return false;
+    bool ready = false;
+    if(inotify_add_watch(fd,
+                         hls_dir,
+                         IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF |
+                             IN_ONLYDIR) >= 0) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        char events[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        // poll() returns on every file ffmpeg writes, so the wait is bounded
+        // by a deadline rather than by counting passes
+        int64_t deadline = now_ms() + LIVE_WAIT_MS;
+        for(int64_t left = LIVE_WAIT_MS; left > 0; left = deadline - now_ms()) {
+            // Checked after the watch exists, so no write can be missed
+            if((ready = conversion_playlists_ready(hls_dir))) break;
+            if(server_draining()) break;
+            int timeout = left < IDLE_POLL_MS ? (int) left : IDLE_POLL_MS;
+            if(poll(&pfd, 1, timeout) > 0 &&
+               read(fd, events, sizeof(events)) < 0 && errno != EAGAIN)
+                break;
         }
+    }
+    close(fd);
+    return ready;
+}
 
-        char* save_ptr;
-        char* token = strtok_r(buffer, " \r\n", &save_ptr);
-        if(!token) {
-            close(client_fd);
-            pthread_exit(NULL);
+static void serve_hls_page(const Request* req,
+                           Arena* arena,
+                           const struct stat* st,
+                           Response* resp) {
+    char hls_dir[PATH_MAX];
+    int status = check_or_start_hls(req->path, st, hls_dir);
+    thumb_request(req->path, st);    // Queued now, ready for the player
+
+    // A running conversion is played live once its first segments exist
+    if(status == 1 && wait_for_playlists(hls_dir)) status = 0;
+
+    if(status == 1) {    // PROCESSING
+        set_body(resp,
+                 200,
+                 "OK",
+                 "text/html",
+                 processing_page,
+                 sizeof(processing_page) - 1);
+    } else if(status == -1) {    // ERROR
+        set_body(resp,
+                 500,
+                 "Error",
+                 "text/html",
+                 failed_page,
+                 sizeof(failed_page) - 1);
+    } else {    // READY
+        // Both URLs end up in a script string, so they are encoded
+        char url[PATH_MAX];
+        char thumbs[PATH_MAX];
+        char thumbs_dir[PATH_MAX];
+        conversion_url(hls_dir, url);
+        conversion_thumb_dir(req->path, thumbs_dir);
+        conversion_url(thumbs_dir, thumbs);
+        char* encoded_url = arena_alloc(arena, strlen(url) * 3 + 1);
+        char* encoded_thumbs = arena_alloc(arena, strlen(thumbs) * 3 + 1);
+        if(!encoded_url || !encoded_thumbs) {
+            set_body(resp, 500, "Error", NULL, NULL, 0);
+            return;
+        }
+        urlencode(encoded_url, url);
+        urlencode(encoded_thumbs, thumbs);
+        char* playlist_url =
+            arena_sprintf(arena, "/%s/master.m3u8", encoded_url);
+        char* thumbs_url = arena_sprintf(arena, "/%s", encoded_thumbs);
+        char* page = arena_sprintf(
+            arena, player_page_fmt, req->path, playlist_url, thumbs_url);
+        if(!page) {
+            set_body(resp, 500, "Error", NULL, NULL, 0);
+            return;
         }
-        strncpy(header.method, token, sizeof(header.method) - 1);
+        set_body(resp, 200, "OK", "text/html", page, strlen(page));
+        resp->headers = "Cache-Control: no-cache, no-store, must-revalidate\r\n";
+    }
+}
 
-        token = strtok_r(NULL, " \r\n", &save_ptr);
-        if(!token) {
-            close(client_fd);
-            pthread_exit(NULL);
+static void serve_file(const Request* req,
+                       Arena* arena,
+                       PathHandle* file,
+                       Response* resp) {
+    const struct stat* st = &file->st;
+    char* content_type = arena_alloc(arena, 256);
+    getcontenttype(content_type, req->path);
+
+    resp->content_type = content_type;
+    resp->file = *file;
+
+    // Playlists of running conversions are rewritten every segment
+    const char* ext = strrchr(req->path, '.');
+    const char* cache_control =
+        ext && strcmp(ext, ".m3u8") == 0 ? "Cache-Control: no-cache\r\n" : "";
+    resp->headers = cache_control;
+
+    if(req->range_request) {
+        off_t start = req->range_start, end = req->range_end;
+        if(normalizeranges(&start, &end, st->st_size) != 0) {
+            pathcache_release(&resp->file);
+            set_body(resp, 416, "Range Not Satisfiable", NULL, NULL, 0);
+            resp->headers = arena_sprintf(arena,
+                                          "Content-Range: bytes */%jd\r\n",
+                                          (intmax_t) st->st_size);
+            return;
         }
+        resp->status = 206;
+        resp->reason = "Partial Content";
+        resp->headers = arena_sprintf(arena,
+                                      "%sContent-Range: bytes %jd-%jd/%jd\r\n",
+                                      cache_control,
+                                      (intmax_t) start,
+                                      (intmax_t) end,
+                                      (intmax_t) st->st_size);
+        resp->file_offset = start;
+        resp->file_len = end - start + 1;
+    } else {
+        resp->status = 200;
+        resp->reason = "OK";
+        resp->file_offset = 0;
+        resp->file_len = st->st_size;
+    }
+    resp->traffic = classifytraffic(req, resp->file_len);
+}
+
+// Parses the "t" of a seek: a finite, non-negative number of seconds
+static int parse_seconds(const char* str, double* seconds) {
+    char* end;
+    double value = strtod(str, &end);
+    if(end == str || *end != '\0' || !isfinite(value) || value < 0) {
+        return -1;
+    }
+    *seconds = value;
+    return 0;
+}
+
+// Serves "?t=<seconds>" on a Matroska file: the rest of the file from the
+// cluster holding the last keyframe at or before that time, as a 206.
+static void serve_seek(const Request* req,
+                       Arena* arena,
+                       PathHandle* file,
+                       double seconds,
+                       Response* resp) {
+    off_t offset;
+    double time;
+    int status = seek_lookup(req->path, &file->st, seconds, &offset, &time);
+    if(status == 1) {    // Packet scan still running, retried by the client
+        pathcache_release(file);
+        set_body(resp, 503, "Service Unavailable", NULL, NULL, 0);
+        resp->headers =
+            arena_sprintf(arena, "Retry-After: %d\r\n", RETRY_AFTER);
+        return;
+    }
+    if(status != 0) {    // Not indexable, serve it whole
+        serve_file(req, arena, file, resp);
+        return;
+    }
+
+    Request ranged = *req;
+    ranged.range_request = true;
+    ranged.range_start = offset;
+    ranged.range_end = -1;
+    serve_file(&ranged, arena, file, resp);
+    resp->headers =
+        arena_sprintf(arena, "%sX-Seek-Time: %.3f\r\n", resp->headers, time);
+}
+
+static bool has_suffix(const char* name, const char* suffix) {
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
 
-        char* query_start = strchr(token, '?');
-        if(query_start) {
-            // Split path and query
-            *query_start = '\0';
-            query_start++;    // Move past '?'
-            strncpy(header.query, query_start, sizeof(header.query) - 1);
-            header.query[sizeof(header.query) - 1] = '\0';
+static void serve_directory(const Request* req,
+                            Arena* arena,
+                            const PathHandle* handle,
+                            Response* resp) {
+    // Listings are cached in the coding the client asked for until the
+    // directory's mtime changes, read with fstat(): the path cache does not
+    // refresh a directory's stat when its entries change.
+    Encoding encoding = compress_preferred(
+        compress_accepted(request_header(req, "Accept-Encoding")));
+    struct stat dir_st;
+    bool cacheable = fstat(handle->fd, &dir_st) == 0;
+    const char* cached;
+    size_t cached_len;
+    Encoding used;
+    if(cacheable && compress_cache_get(req->path,
+                                       &dir_st,
+                                       encoding,
+                                       arena,
+                                       &cached,
+                                       &cached_len,
+                                       &used) == 0) {
+        set_body(resp, 200, "OK", "text/html", cached, cached_len);
+        if(used != ENCODING_IDENTITY)
+            resp->content_encoding = compress_name(used);
+        return;
+    }
+    // After a restart, the listing may still be in the startup snapshot
+    if(cacheable && snapshot_listing(req->path,
+                                     &dir_st,
+                                     encoding,
+                                     arena,
+                                     &cached,
+                                     &cached_len,
+                                     &used) == 0) {
+        compress_cache_put(req->path,
+                           &dir_st,
+                           encoding,
+                           cached,
+                           cached_len,
+                           used);
+        set_body(resp, 200, "OK", "text/html", cached, cached_len);
+        if(used != ENCODING_IDENTITY)
+            resp->content_encoding = compress_name(used);
+        return;
+    }
+
+    // A fresh open file description, the cached one is shared by threads
+    int fd = openat(handle->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if(!dir) {
+        if(fd >= 0) close(fd);
+        set_body(resp, 404, "Not Found", NULL, NULL, 0);
+        resp->close = true;
+        return;
+    }
+
+    StrBuf body;
+    sb_init(&body, arena, 4096);
+    sb_puts(&body, "<h1>Directory Listing</h1>Directory: ");
+    sb_puts(&body, req->path);
+    sb_puts(&body, "<hr><ul>");
+
+    // Not cached while posters are pending, they appear without the
+    // directory changing
+    bool complete = true;
+    struct dirent* dirent;
+    char* path = arena_alloc(arena, PATH_MAX);
+    char* encoded = arena_alloc(arena, PATH_MAX * 3);
+    char* thumb_dir = arena_alloc(arena, PATH_MAX);
+    char* thumb_path = arena_alloc(arena, PATH_MAX);
+    char* thumb_url = arena_alloc(arena, PATH_MAX * 3);
+    while((dirent = readdir(dir)) != NULL) {
+        if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+            continue;
+        // Seek indexes, written next to the movies
+        if(has_suffix(dirent->d_name, SEEK_INDEX_SUFFIX) ||
+           has_suffix(dirent->d_name, SEEK_INDEX_SUFFIX ".tmp"))
+            continue;
+        if(strcmp(req->path, ".") != 0) {
+            snprintf(path, PATH_MAX, "%s/%s", req->path, dirent->d_name);
+        } else {
+            snprintf(path, PATH_MAX, "%s", dirent->d_name);
+        }
+        urlencode(encoded, path);
+
+        // Is this a video file?
+        int is_video = has_suffix(dirent->d_name, ".mkv");
+
+        // 0. The Poster, once the background thumbnailer has made it
+        struct stat st;
+        int thumbs = is_video &&
+                             fstatat(dirfd(dir), dirent->d_name, &st, 0) == 0 &&
+                             S_ISREG(st.st_mode) ?
+                         thumb_request(path, &st) :
+                         -1;
+        if(thumbs == 1) complete = false;
+        if(thumbs == 0) {
+            conversion_thumb_dir(path, thumb_dir);
+            conversion_url(thumb_dir, thumb_path);
+            urlencode(thumb_url, thumb_path);
+            sb_printf(&body,
+                      "<li><img src=\"/%s/poster.jpg\" "
+                      "loading='lazy' style='height:90px;"
+                      "vertical-align:middle;margin-right:10px;'>",
+                      thumb_url);
         } else {
-            header.query[0] = '\0';
+            sb_puts(&body, "<li>");
         }
 
-        char tmp[BUFFER_SIZE];
-        size_t path_len = strlen(token);
-        if(path_len >= sizeof(header.path)) path_len = sizeof(header.path) - 1;
-        strncpy(header.path, token, path_len);
-        header.path[path_len] = '\0';
-
-        urldecode(tmp, header.path);
-        makeabsolute(header.path, tmp);
-
-        token = strtok_r(NULL, " \r\n", &save_ptr);
-        strcpy(header.version, token ? token : "");
-
-        char* content_type = strtok_r(NULL, ":", &save_ptr);
-        char* content = strtok_r(NULL, "\r\n", &save_ptr);
-        header.headers = create_list(content_type, content);
-        while(content && content_type) {
-            append_list(header.headers, content_type, content);
-            if(strcasecmp(content_type, "Range") == 0) {
-                if(getcontentrange(
-                       content, &header.range_start, &header.range_end) == 0)
-                    header.range_request = true;
-            }
-            content_type = strtok_r(NULL, ": \r\n", &save_ptr);
-            content = strtok_r(NULL, "\r\n", &save_ptr);
+        // 1. The File Link
+        sb_printf(&body,
+                  "<a href=\"/%s\">%s</a>",
+                  encoded,
+                  dirent->d_name);
+
+        // 2. The Stream Button (Only if Video)
+        if(is_video) {
+            sb_printf(&body,
+                      " <a href=\"/%s?mode=hls\" "
+                      "style='background:#d35400;color:white;padding:2px "
+                      "6px;text-decoration:none;border-radius:3px;"
+                      "font-size:0.8em;margin-left:10px;'>[Stream]</a>",
+                      encoded);
         }
 
-        if(header.path[0] != '/') {
-            close(client_fd);
-            pthread_exit(NULL);
+        // 3. Close List Item
+        sb_puts(&body, "</li>");
+    }
+    closedir(dir);
+    sb_puts(&body, "</ul><hr>");
+
+    set_body(resp, 200, "OK", "text/html", body.data, body.len);
+    used = ENCODING_IDENTITY;
+    char* encoded_body;
+    size_t encoded_len;
+    if(encoding != ENCODING_IDENTITY && body.len >= COMPRESS_MIN &&
+       compress_buffer(
+           encoding, body.data, body.len, arena, &encoded_body, &encoded_len) ==
+           0) {
+        resp->body = encoded_body;
+        resp->body_len = encoded_len;
+        resp->content_encoding = compress_name(encoding);
+        used = encoding;
+    }
+    if(cacheable && complete) {
+        compress_cache_put(
+            req->path, &dir_st, encoding, resp->body, resp->body_len, used);
+    }
+}
+
+// Opens a request path, below the cache directory for converted output
+// moved there
+static int open_path(const char* path, PathHandle* out) {
+    size_t prefix = strlen(OUTPUT_URL_PREFIX);
+    if(conversion_output_enabled() &&
+       strncmp(path, OUTPUT_URL_PREFIX, prefix) == 0)
+        return conversion_open_output(path + prefix, out);
+    return pathcache_open(path, out);
+}
+
+// Serves a fresh precompressed sibling of the file in resp, written when its
+// conversion finished. Returns 0 if one was found.
+static int serve_sibling(const Request* req,
+                         Arena* arena,
+                         unsigned accepted,
+                         Response* resp) {
+    for(int e = ENCODING_COUNT - 1; e > ENCODING_IDENTITY; e--) {
+        if(!(accepted & (1u << e))) continue;
+        char* path = arena_sprintf(
+            arena, "%s%s", req->path, compress_suffix((Encoding) e));
+        PathHandle sibling;
+        if(!path || open_path(path, &sibling) != 0) continue;
+
+        // One older than the file belongs to a previous version of it
+        const struct stat* src = &resp->file.st;
+        if(S_ISREG(sibling.st.st_mode) &&
+           (sibling.st.st_mtim.tv_sec > src->st_mtim.tv_sec ||
+            (sibling.st.st_mtim.tv_sec == src->st_mtim.tv_sec &&
+             sibling.st.st_mtim.tv_nsec >= src->st_mtim.tv_nsec))) {
+            pathcache_release(&resp->file);
+            resp->file = sibling;
+            resp->file_offset = 0;
+            resp->file_len = sibling.st.st_size;
+            resp->content_encoding = compress_name((Encoding) e);
+            return 0;
         }
-        memmove(header.path, header.path + 1, strlen(header.path));
-        if(strcmp(header.path, "") == 0) strcpy(header.path, ".");
-
-        int file_fd = -1;
-        if((file_fd = open(header.path, O_RDONLY)) < 0) {
-            write(client_fd,
-                  "HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n",
-                  45);
-            header.keep_alive = false;
-        } else {
-            struct stat st;
-            fstat(file_fd, &st);
-            if(S_ISREG(st.st_mode)) {
-                char resp[BUFFER_SIZE];
-                resp[0] = '\0';
-                char content_type_str[256];
-                getcontenttype(content_type_str, header.path);
-
-                if(strstr(content_type_str, "video") &&
-                   strstr(header.path, ".mkv") && !header.range_request &&
-                   strcmp(header.query, "mode=hls") == 0) {
-                    char hls_dir[PATH_MAX];
-                    int status = check_or_start_hls(header.path, hls_dir);
-
-                    if(status == 1) {    // PROCESSING
-                        snprintf(
-                            resp,
-                            sizeof(resp),
-                            "HTTP/1.1 200 OK\r\nContent-Type: "
-                            "text/html\r\nConnection: close\r\n\r\n"
-                            "<html><head><meta http-equiv='refresh' "
-                            "content='5'></head><body "
-                            "style='background:#111;color:white;text-align:"
-                            "center;padding-top:20%%;font-family:sans-"
-                            "serif;'>"
-                            "<h1>Processing Video...</h1><p>Please "
-                            "wait...</p></body></html>");
-                        write(client_fd, resp, strlen(resp));
-                        close(file_fd);
-                        free_list(header.headers);
-                        close(client_fd);
-                        pthread_exit(NULL);
-                    } else if(status == -1) {    // ERROR
-                        snprintf(
-                            resp,
-                            sizeof(resp),
-                            "HTTP/1.1 500 Error\r\nContent-Type: "
-                            "text/html\r\nConnection: close\r\n\r\n"
-                            "<html><body "
-                            "style='background:#111;color:red;text-align:"
-                            "center;font-family:sans-serif;padding-top:20%%"
-                            ";'>"
-                            "<h1>Conversion Failed</h1><p>Check server "
-                            "logs.</p></body></html>");
-                        write(client_fd, resp, strlen(resp));
-                        close(file_fd);
-                        free_list(header.headers);
-                        close(client_fd);
-                        pthread_exit(NULL);
-                    } else {    // READY
-                        char playlist_url[PATH_MAX + 128];
-                        snprintf(playlist_url,
-                                 sizeof(playlist_url),
-                                 "/%s/master.m3u8",
-                                 hls_dir);
-                        char html_resp[BUFFER_SIZE * 4];
-                        int n = snprintf(
-                            html_resp,
-                            sizeof(html_resp),
-                            "HTTP/1.1 200 OK\r\n"
-                            "Content-Type: text/html\r\n"
-                            "Cache-Control: no-cache, no-store, "
-                            "must-revalidate\r\n"
-                            "Connection: close\r\n\r\n"
-                            "<!DOCTYPE "
-                            "html><html><head><title>Play</title><script "
-                            "src=\"https://cdn.jsdelivr.net/npm/"
-                            "hls.js@latest\"></script>"
-                            "<style>body{background:#111;color:white;text-"
-                            "align:center;font-family:sans-serif;} "
-                            "select{padding:10px;margin:10px;background:#"
-                            "333;"
-                            "color:white;border:1px solid "
-                            "#555;}</style></head>"
-                            "<body><h2>%s</h2><div><label>Audio: <select "
-                            "id='audioSelect'></select></"
-                            "label><label>Subs: "
-                            "<select id='subSelect'></select></label></div>"
-                            "<video id='video' controls "
-                            "style='width:80%%;max-width:1000px;margin-top:"
-                            "20px'></video>"
-                            "<script>"
-                            "var v=document.getElementById('video');var "
-                            "src='%s';"
-                            "if(Hls.isSupported()){var h=new "
-                            "Hls();h.loadSource(src);h.attachMedia(v);"
-                            "h.on(Hls.Events.MANIFEST_PARSED,function(){v."
-                            "play("
-                            ");updateTracks();});"
-                            "h.on(Hls.Events.AUDIO_TRACKS_UPDATED, "
-                            "updateTracks);"
-                            "h.on(Hls.Events.SUBTITLE_TRACKS_UPDATED, "
-                            "updateTracks);"
-                            "function updateTracks(){"
-                            "var "
-                            "as=document.getElementById('audioSelect');as."
-                            "innerHTML='';"
-                            "h.audioTracks.forEach((t,i)=>{var "
-                            "o=document.createElement('option');o.value=i;"
-                            "o."
-                            "text=t.name||t.lang||'Track "
-                            "'+(i+1);if(i===h.audioTrack)o.selected=true;"
-                            "as."
-                            "add(o);});"
-                            "var "
-                            "ss=document.getElementById('subSelect');ss."
-                            "innerHTML='';"
-                            "var "
-                            "off=document.createElement('option');off."
-                            "value=-1;"
-                            "off.text='Off';if(h.subtitleTrack===-1)off."
-                            "selected=true;ss.add(off);"
-                            "h.subtitleTracks.forEach((t,i)=>{var "
-                            "o=document.createElement('option');o.value=i;"
-                            "o."
-                            "text=t.name||t.lang||'Sub "
-                            "'+(i+1);if(i===h.subtitleTrack)o.selected="
-                            "true;ss."
-                            "add(o);});}"
-                            "document.getElementById('audioSelect')."
-                            "onchange="
-                            "function(){h.audioTrack=parseInt(this.value);}"
-                            ";"
-                            "document.getElementById('subSelect').onchange="
-                            "function(){h.subtitleTrack=parseInt(this."
-                            "value);};"
-                            "}else "
-                            "if(v.canPlayType('application/"
-                            "vnd.apple.mpegurl')){v.src=src;}"
-                            "</script></body></html>",
-                            header.path,
-                            playlist_url);
-                        if(n > 0) write(client_fd, html_resp, n);
-                        close(file_fd);
-                        free_list(header.headers);
-                        close(client_fd);
-                        pthread_exit(NULL);
-                    }
-                }
-
-                if(header.range_request) {
-                    strcat(resp,
-                           "HTTP/1.1 206 Partial Content\r\nContent-Range: "
-                           "bytes ");
-                    char r_start[32], r_end[32], r_total[32];
-                    normalizeranges(
-                        &header.range_start, &header.range_end, st.st_size);
-                    sprintf(r_start, "%jd", (intmax_t) header.range_start);
-                    sprintf(r_end, "%jd", (intmax_t) header.range_end);
-                    sprintf(r_total, "%jd", (intmax_t) st.st_size);
-                    strcat(resp, r_start);
-                    strcat(resp, "-");
-                    strcat(resp, r_end);
-                    strcat(resp, "/");
-                    strcat(resp, r_total);
-                    strcat(resp, "\r\n");
-                    strcat(resp, "Connection: close\r\n");
-                    char cl[64];
-                    sprintf(
-                        cl,
-                        "Content-Length: %jd\r\n",
-                        (intmax_t) (header.range_end - header.range_start + 1));
-                    strcat(resp, cl);
-                    strcat(resp, "Content-Type: ");
-                    strcat(resp, content_type_str);
-                    strcat(resp, "\r\n\r\n");
-                    write(client_fd, resp, strlen(resp));
-                    lseek(file_fd, header.range_start, SEEK_SET);
-                    off_t remaining =
-                        (header.range_end - header.range_start + 1);
-                    while(
-                        remaining > 0 &&
-                        (read_bytes = read(file_fd,
-                                           buffer,
-                                           (remaining < (off_t) sizeof(buffer) ?
-                                                remaining :
-                                                (off_t) sizeof(buffer)))) > 0) {
-                        write(client_fd, buffer, read_bytes);
-                        remaining -= read_bytes;
-                    }
-                } else {
-                    strcat(resp,
-                           "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n");
-                    char cl[64];
-                    sprintf(
-                        cl, "Content-Length: %jd\r\n", (intmax_t) st.st_size);
-                    strcat(resp, cl);
-                    strcat(resp, "Content-Type: ");
-                    strcat(resp, content_type_str);
-                    strcat(resp, "\r\n\r\n");
-                    write(client_fd, resp, strlen(resp));
-                    while((read_bytes = read(file_fd, buffer, sizeof(buffer))) >
-                          0)
-                        write(client_fd, buffer, read_bytes);
-                }
-            } else if(S_ISDIR(st.st_mode)) {
-                // Directory listing logic
-                const char resp_prefix[] =
-                    "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nConnection: "
-                    "keep-alive\r\nContent-Length: ";
-                const char resp_suffix[] = "\r\n\r\n";
-                const char html_prefix[] =
-                    "<h1>Directory Listing</h1>Directory: ";
-
-                // --- RESTORED TO ORIGINAL LIST FORMAT ---
-                const char list_begin[] = "<hr><ul>";
-                const char list_end[] = "</ul><hr>";
-
-                char body[BODY_MAX_SIZE];
-                body[0] = '\0';
-                strcat(body, html_prefix);
-                strcat(body, header.path);
-                strcat(body, list_begin);
-
-                DIR* dir = opendir(header.path);
-                struct dirent* dirent;
-                while((dirent = readdir(dir)) != NULL) {
-                    if(strcmp(dirent->d_name, ".") != 0 &&
-                       strcmp(dirent->d_name, "..") != 0) {
-                        char path[PATH_MAX], encoded[PATH_MAX * 3];
-                        if(strcmp(header.path, ".") != 0) {
-                            strcpy(path, header.path);
-                            strcat(path, "/");
-                            strcat(path, dirent->d_name);
-                        } else {
-                            strcpy(path, dirent->d_name);
-                        }
-                        urlencode(encoded, path);
-
-                        // Is this a video file?
-                        int is_video = (strstr(dirent->d_name, ".mkv") != NULL);
-
-                        // 1. Open List Item
-                        strcat(body, "<li>");
-
-                        // 2. The File Link
-                        strcat(body, "<a href=\"/");
-                        strcat(body, encoded);
-                        strcat(body, "\">");
-                        strcat(body, dirent->d_name);
-                        strcat(body, "</a>");
-
-                        // 3. The Stream Button (Only if Video)
-                        if(is_video) {
-                            strcat(body, " <a href=\"/");
-                            strcat(body, encoded);
-                            strcat(body,
-                                   "?mode=hls\" "
-                                   "style='background:#d35400;color:white;"
-                                   "padding:2px "
-                                   "6px;text-decoration:none;border-radius:3px;"
-                                   "font-size:0.8em;margin-left:10px;'>[Stream]"
-                                   "</a>");
-                        }
-
-                        // 4. Close List Item
-                        strcat(body, "</li>");
-                    }
-                }
-                closedir(dir);
-                strcat(body, list_end);
-
-                char cl[32];
-                sprintf(cl, "%ld", strlen(body));
-                write(client_fd, resp_prefix, strlen(resp_prefix));
-                write(client_fd, cl, strlen(cl));
-                write(client_fd, resp_suffix, strlen(resp_suffix));
-                write(client_fd, body, strlen(body));
-            }
-            close(file_fd);
+        pathcache_release(&sibling);
+    }
+    return -1;
+}
+
+// Applies Accept-Encoding to whole text responses. Files are served from a
+// precompressed sibling when there is one (finished conversions), small ones
+// are compressed here (playlists of running conversions), as are generated
+// pages that did not do it themselves.
+static void encode_response(const Request* req, Arena* arena, Response* resp) {
+    if(resp->status != 200 || !resp->content_type ||
+       !compress_text_type(resp->content_type))
+        return;
+    resp->headers = arena_sprintf(arena,
+                                  "%sVary: Accept-Encoding\r\n",
+                                  resp->headers ? resp->headers : "");
+    if(resp->content_encoding) return;
+
+    unsigned accepted =
+        compress_accepted(request_header(req, "Accept-Encoding"));
+    if(!accepted) return;
+
+    if(resp->file.fd >= 0) {
+        if(serve_sibling(req, arena, accepted, resp) == 0) return;
+        if(resp->file_len < COMPRESS_MIN ||
+           resp->file_len > COMPRESS_INLINE_MAX)
+            return;
+        char* data = arena_alloc(arena, (size_t) resp->file_len);
+        if(!data) return;
+        size_t got = 0;
+        while(got < (size_t) resp->file_len) {
+            ssize_t n = pread(resp->file.fd,
+                              data + got,
+                              (size_t) resp->file_len - got,
+                              resp->file_offset + (off_t) got);
+            if(n <= 0) return;
+            got += (size_t) n;
         }
-        free_list(header.headers);
+        pathcache_release(&resp->file);
+        resp->body = data;
+        resp->body_len = got;
+    }
+
+    Encoding encoding = compress_preferred(accepted);
+    char* out;
+    size_t out_len;
+    if(resp->body_len >= COMPRESS_MIN &&
+       compress_buffer(
+           encoding, resp->body, resp->body_len, arena, &out, &out_len) == 0 &&
+       out_len < resp->body_len) {
+        resp->body = out;
+        resp->body_len = out_len;
+        resp->content_encoding = compress_name(encoding);
     }
-    close(client_fd);
-    pthread_exit(NULL);
 }
 
-// Helpers
-void urldecode(char* dst, const char* src) {
-    char a, b;
-    while(*src) {
-        if((*src == '%') && ((a = src[1]) && (b = src[2])) &&
-           (isxdigit(a) && isxdigit(b))) {
-            if(a >= 'a') a -= 'a' - 'A';
-            if(a >= 'A') a -= ('A' - 10);
-            else
-                a -= '0';
-            if(b >= 'a') b -= 'a' - 'A';
-            if(b >= 'A') b -= ('A' - 10);
-            else
-                b -= '0';
-            *dst++ = 16 * a + b;
-            src += 3;
+static void dispatch_request(const Request* req, Arena* arena, Response* resp) {
+    PathHandle file;
+    if(open_path(req->path, &file) != 0) {
+        set_body(resp, 404, "Not Found", NULL, NULL, 0);
+        resp->close = true;
+        return;
+    }
+
+    if(S_ISREG(file.st.st_mode)) {
+        conversion_touch(req->path);
+        const char* ext = strrchr(req->path, '.');
+        bool is_mkv = ext && strcmp(ext, ".mkv") == 0;
+        char seek[32];
+        if(is_mkv && !req->range_request &&
+           strcmp(req->query, "mode=hls") == 0) {
+            struct stat st = file.st;
+            pathcache_release(&file);
+            serve_hls_page(req, arena, &st, resp);
+            return;
+        }
+        if(is_mkv && !req->range_request &&
+           getqueryvalue(seek, sizeof(seek), req->query, "t") == 0) {
+            double seconds;
+            if(parse_seconds(seek, &seconds) != 0) {
+                pathcache_release(&file);
+                set_body(resp, 400, "Bad Request", NULL, NULL, 0);
+                return;
+            }
+            serve_seek(req, arena, &file, seconds, resp);
+            return;
+        }
+        serve_file(req, arena, &file, resp);
+    } else {
+        if(S_ISDIR(file.st.st_mode)) {
+            serve_directory(req, arena, &file, resp);
         } else {
-            *dst++ = *src++;
+            set_body(resp, 404, "Not Found", NULL, NULL, 0);
+            resp->close = true;
         }
+        pathcache_release(&file);
+    }
+}
+
+void handle_request(const Request* req, Arena* arena, Response* resp) {
+    memset(resp, 0, sizeof(*resp));
+    resp->file.fd = -1;
+    resp->traffic = TRAFFIC_STREAM;
+    if(cluster_proxy(req, arena, resp) != 0) dispatch_request(req, arena, resp);
+    encode_response(req, arena, resp);
+}
+
+// Serializes a response as HTTP/1.1. Returns -1 if the client went away.
+static int send_response(int client_fd,
+                         Response* resp,
+                         Arena* arena,
+                         ClientBucket* bucket,
+                         SockProfile* profile) {
+    off_t content_length =
+        resp->file.fd >= 0 ? resp->file_len : (off_t) resp->body_len;
+    socktune_apply(client_fd, profile, socktune_profile(content_length));
+
+    StrBuf head;
+    sb_init(&head, arena, 512);
+    sb_printf(&head,
+              "HTTP/1.1 %d %s\r\nConnection: %s\r\nContent-Length: %jd\r\n",
+              resp->status,
+              resp->reason,
+              resp->close ? "close" : "keep-alive",
+              (intmax_t) content_length);
+    if(resp->content_type)
+        sb_printf(&head, "Content-Type: %s\r\n", resp->content_type);
+    if(resp->content_encoding)
+        sb_printf(&head, "Content-Encoding: %s\r\n", resp->content_encoding);
+    if(resp->headers) sb_puts(&head, resp->headers);
+    sb_puts(&head, "\r\n");
+
+    // The head waits for the body, so a small response leaves in one segment
+    int ret = 0;
+    if(write_all(client_fd, head.data, head.len, content_length > 0) < 0)
+        ret = -1;
+
+    if(ret == 0 && resp->body_len > 0) {
+        if(rl_write(client_fd,
+                    resp->body,
+                    resp->body_len,
+                    bucket,
+                    resp->traffic) < 0)
+            ret = -1;
+    }
+
+    if(resp->file.fd >= 0) {
+        if(ret == 0 && resp->file_len > 0 &&
+           rl_sendfile(client_fd,
+                       resp->file.fd,
+                       resp->file_offset,
+                       (size_t) resp->file_len,
+                       bucket,
+                       resp->traffic) < 0)
+            ret = -1;    // Or the file shrank, Content-Length can't be honored
+        pathcache_release(&resp->file);
     }
-    *dst++ = '\0';
+    return ret;
 }
+
+void* thread_fn(void* arg) {
+    Client* client = (Client*) arg;
+    int client_fd = client->fd;
+    ClientBucket* bucket = rl_client_acquire(client->addr.sin_addr);
+    free(client);
+
+    Arena arena;
+    arena_init(&arena, ARENA_BLOCK_SIZE);
+
+    bool keep_alive = true;
+    SockProfile profile = SOCK_PROFILE_UNSET;
+    while(keep_alive && wait_for_request(client_fd)) {
+        char* buffer = arena_alloc(&arena, BUFFER_SIZE);
+        if(!buffer) break;
+
+        ssize_t read_bytes = read(client_fd, buffer, BUFFER_SIZE - 1);
+        if(read_bytes <= 0) break;
+        buffer[read_bytes] = '\0';
+
+        // HTTP/2 with prior knowledge
+        if(read_bytes >= H2_PREFACE_LEN &&
+           memcmp(buffer, H2_PREFACE, H2_PREFACE_LEN) == 0) {
+            h2_serve(client_fd, buffer, (size_t) read_bytes, NULL, bucket);
+            break;
+        }
+
+        Request req;
+        if(parse_request(buffer, (size_t) read_bytes, &arena, &req) != 0) {
+            write_all(client_fd,
+                      error_response,
+                      sizeof(error_response) - 1,
+                      false);
+            break;
+        }
+        if(h2_upgrade_request(&req)) {
+            h2_serve(client_fd, NULL, 0, &req, bucket);
+            break;
+        }
+
+        Response resp;
+        handle_request(&req, &arena, &resp);
+        // Finish the current response, then let the connection go
+        if(!req.keep_alive || server_draining()) resp.close = true;
+        if(send_response(client_fd, &resp, &arena, bucket, &profile) != 0)
+            break;
+        keep_alive = !resp.close;
+        // Idle connections only keep the first block
+        arena_reset(&arena);
+    }
+
+    arena_free(&arena);
+    close(client_fd);
+    rl_client_release(bucket);
+    return NULL;
+}
+
+// Helpers
 void urlencode(char* dest, const char* src) {
     const char* hex = "0123456789abcdef";
     int pos = 0;
@@ -507,27 +852,6 @@ void urlencode(char* dest, const char* src) {
     }
     dest[pos] = '\0';
 }
-void makeabsolute(char* dest, const char* src) {
-    const char* start = src;
-    const char* end = strchr(start, '/');
-    size_t len = end ? (size_t) (end - start) : strlen(start);
-    strncpy(dest, start, len);
-    dest[len] = '\0';
-    while(end != NULL) {
-        start = end + 1;
-        end = strchr(start, '/');
-        len = end ? (size_t) (end - start) : strlen(start);
-        char token[BUFFER_SIZE];
-        strncpy(token, start, len);
-        token[len] = '\0';
-        if(strcmp(token, ".") == 0 || strcmp(token, "..") == 0) {
-            continue;
-        } else {
-            strcat(dest, "/");
-            strcat(dest, token);
-        }
-    }
-}
 void getcontenttype(char* dest, const char* filename) {
     char* index = strrchr(filename, '.');
     if(!index) {
@@ -535,31 +859,82 @@ void getcontenttype(char* dest, const char* filename) {
         return;
     }
     if(strcmp(index, ".mkv") == 0) strcpy(dest, "video/mp4");
+    else if(strcmp(index, ".m3u8") == 0)
+        strcpy(dest, "application/vnd.apple.mpegurl");
+    else if(strcmp(index, ".ts") == 0) strcpy(dest, "video/mp2t");
+    else if(strcmp(index, ".vtt") == 0) strcpy(dest, "text/vtt");
+    else if(strcmp(index, ".jpg") == 0) strcpy(dest, "image/jpeg");
     else
         strcpy(dest, "application/octet-stream");
 }
-int getcontentrange(char* content, off_t* start, off_t* end) {
-    char* p = strstr(content, "bytes=");
+// Reads a byte position, digits only
+static int parse_position(const char* p, char** next, off_t* out) {
+    if(!isdigit((unsigned char) *p)) return -1;
+    errno = 0;
+    long long value = strtoll(p, next, 10);
+    if(errno != 0) return -1;
+    *out = (off_t) value;
+    return 0;
+}
+int getcontentrange(const char* content, off_t* start, off_t* end) {
+    const char* p = strstr(content, "bytes=");
     if(!p) return -1;
     p += 6;
-    char buf[128];
-    strncpy(buf, p, sizeof(buf) - 1);
-    buf[sizeof(buf) - 1] = '\0';
-    char* dash = strchr(buf, '-');
-    if(!dash) return -1;
-    *dash = '\0';
-    *start = atoll(buf);
-    if(*(dash + 1)) *end = atoll(dash + 1);
-    else
-        *end = -1;
+    char* next;
+    if(*p == '-') {    // Suffix: the last n bytes
+        if(parse_position(p + 1, &next, end) != 0) return -1;
+        *start = -1;
+    } else {
+        if(parse_position(p, &next, start) != 0 || *next != '-') return -1;
+        p = next + 1;
+        if(*p == '\0' || *p == ',') {
+            *end = -1;
+            next = (char*) p;
+        } else if(parse_position(p, &next, end) != 0 || *end < *start) {
+            return -1;
+        }
+    }
+    // Only the first range of a list is served
+    return *next == '\0' || *next == ',' ? 0 : -1;
+}
+int normalizeranges(off_t* start, off_t* end, const off_t file_size) {
+    if(*start == -1) {
+        if(*end == 0 || file_size == 0) return -1;
+        *start = *end < file_size ? file_size - *end : 0;
+        *end = file_size - 1;
+        return 0;
+    }
+    if(*start >= file_size) return -1;
+    if(*end == -1 || *end >= file_size) *end = file_size - 1;
     return 0;
 }
-void normalizeranges(off_t* start, off_t* end, const off_t file_size) {
-    if(*end == -1) *end = file_size - 1;
-    if(*start < 0) *start = 0;
-    if(*end >= file_size) *end = file_size - 1;
+int getqueryvalue(char* dest, size_t len, const char* query, const char* name) {
+    size_t name_len = strlen(name);
+    for(const char* p = query; *p;) {
+        size_t field_len = strcspn(p, "&");
+        if(field_len > name_len && strncmp(p, name, name_len) == 0 &&
+           p[name_len] == '=') {
+            size_t value_len = field_len - name_len - 1;
+            if(value_len >= len) return -1;
+            memcpy(dest, p + name_len + 1, value_len);
+            dest[value_len] = '\0';
+            return 0;
+        }
+        p += field_len;
+        if(*p == '&') p++;
+    }
+    return -1;
 }
-int exists(const char* path) {
-    struct stat st;
-    return stat(path, &st) == 0;
+TrafficClass classifytraffic(const Request* req, off_t len) {
+    // Players fetch HLS playlists/segments and issue short ranged reads;
+    // whole files and long ranges (a resumed download, the rest of a big
+    // file) are treated as bulk downloads.
+    if(strstr(req->path, ".hls/")) return TRAFFIC_STREAM;
+    const char* ext = strrchr(req->path, '.');
+    if(ext && (strcmp(ext, ".ts") == 0 || strcmp(ext, ".m3u8") == 0 ||
+               strcmp(ext, ".vtt") == 0)) {
+        return TRAFFIC_STREAM;
+    }
+    if(req->range_request && len <= STREAM_RANGE_MAX) return TRAFFIC_STREAM;
+    return TRAFFIC_BULK;
 }
\ No newline at end of file
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pathcache.h"
+
+#define SNAPSHOT_MAGIC "MSSNAP1\n"
+#define WARM_NICE      10    // Warm-up thread priority below the requests
+
+// The file is a header followed by the listing records, then the hot file
+// records. Each record is followed by its strings (NUL-terminated) and
+// padded to 8 bytes, so records can be read in place from the mapping.
+// Values are in host byte order; the snapshot is not meant to be moved.
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t listings;
+    uint32_t hot;
+    uint64_t size;    // Of the whole file, catches truncation
+} SnapshotHeader;
+
+typedef struct ListingRecord {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t key_len;     // With the NUL
+    uint32_t body_len;    // Body follows the key
+    uint8_t encoding;
+    uint8_t used;
+    uint8_t pad[6];
+} ListingRecord;
+
+typedef struct HotRecord {
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path_len;    // With the NUL
+    uint32_t pad;
+} HotRecord;
+
+// The mapping and the records found in it, read-only once loaded
+static const char* map;
+static size_t map_size;
+static const ListingRecord** listings;
+static size_t listing_count;
+static const HotRecord** hot;
+static size_t hot_count;
+
+static size_t pad8(size_t len) {
+    return (len + 7) & ~(size_t) 7;
+}
+
+static const char* listing_key(const ListingRecord* rec) {
+    return (const char*) (rec + 1);
+}
+
+static const char* listing_body(const ListingRecord* rec) {
+    return listing_key(rec) + rec->key_len;
+}
+
+static const char* hot_path(const HotRecord* rec) {
+    return (const char*) (rec + 1);
+}
+
+// Checks that the strings of the record at off, whose head is known to be
+// mapped, lie within the mapping and that the first one is terminated.
+// Returns the size of the record, 0 if it is broken.
+static size_t check_record(size_t off, size_t head, size_t str, size_t rest) {
+    if(str == 0) return 0;
+    size_t avail = map_size - off - head;
+    if(str > avail || rest > avail - str) return 0;
+    if(map[off + head + str - 1] != '\0') return 0;
+    return pad8(head + str + rest);
+}
+
+static int parse(void) {
+    const SnapshotHeader* header = (const SnapshotHeader*) map;
+    if(map_size < sizeof(*header) ||
+       memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+       header->size != map_size || header->listings > SNAPSHOT_LISTINGS ||
+       header->hot > SNAPSHOT_HOT)
+        return -1;
+    listings = calloc(header->listings + 1, sizeof(*listings));
+    hot = calloc(header->hot + 1, sizeof(*hot));
+    if(!listings || !hot) return -1;
+
+    size_t off = sizeof(*header);
+    for(uint32_t i = 0; i < header->listings; i++) {
+        const ListingRecord* rec = (const ListingRecord*) (map + off);
+        if(map_size - off < sizeof(*rec)) return -1;
+        size_t len =
+            check_record(off, sizeof(*rec), rec->key_len, rec->body_len);
+        if(len == 0 || rec->encoding >= ENCODING_COUNT ||
+           rec->used >= ENCODING_COUNT)
+            return -1;
+        listings[listing_count++] = rec;
+        off += len;
+    }
+    for(uint32_t i = 0; i < header->hot; i++) {
+        const HotRecord* rec = (const HotRecord*) (map + off);
+        if(map_size - off < sizeof(*rec)) return -1;
+        size_t len = check_record(off, sizeof(*rec), rec->path_len, 0);
+        if(len == 0) return -1;
+        hot[hot_count++] = rec;
+        off += len;
+    }
+    return off == map_size ? 0 : -1;
+}
+
+static bool same_mtime(int64_t sec, int64_t nsec, const struct stat* st) {
+    return sec == (int64_t) st->st_mtim.tv_sec &&
+           nsec == (int64_t) st->st_mtim.tv_nsec;
+}
+
+static double elapsed_ms(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) * 1e3 +
+           (double) (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void* warm_fn(void* arg) {
+    (void) arg;
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), WARM_NICE);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t dirs = 0, files = 0;
+    for(size_t i = 0; i < listing_count; i++) {
+        PathHandle handle;
+        if(pathcache_open(listing_key(listings[i]), &handle) != 0) continue;
+        dirs++;
+        pathcache_release(&handle);
+    }
+
+    // Every hot file is reopened, but only the most recently served ones
+    // that fit the budget are read ahead; a large file played directly does
+    // not use up the budget of the segments served after it
+    bool* read_ahead = calloc(hot_count ? hot_count : 1, sizeof(bool));
+    uint64_t budget = 0;
+    for(size_t i = 0; read_ahead && i < hot_count; i++) {
+        if(hot[i]->size < 0 ||
+           budget + (uint64_t) hot[i]->size > SNAPSHOT_WARM_MAX)
+            continue;
+        budget += (uint64_t) hot[i]->size;
+        read_ahead[i] = true;
+    }
+
+    // Coldest first, so the hottest end up first in the path cache's LRU
+    size_t opened = 0;
+    uint64_t bytes = 0;
+    for(size_t i = hot_count; i-- > 0;) {
+        const HotRecord* rec = hot[i];
+        PathHandle handle;
+        if(pathcache_open(hot_path(rec), &handle) != 0) continue;
+        opened++;
+        if(read_ahead && read_ahead[i] && S_ISREG(handle.st.st_mode) &&
+           handle.st.st_size == rec->size &&
+           same_mtime(rec->mtime_sec, rec->mtime_nsec, &handle.st) &&
+           posix_fadvise(handle.fd, 0, rec->size, POSIX_FADV_WILLNEED) == 0) {
+            files++;
+            bytes += (uint64_t) rec->size;
+        }
+        pathcache_release(&handle);
+    }
+    free(read_ahead);
+    printf("[Snapshot] Reopened %zu directories and %zu files, read ahead "
+           "%zu files (%.1f MB) in %.1f ms\n",
+           dirs,
+           opened,
+           files,
+           (double) bytes / (1024 * 1024),
+           elapsed_ms(&start));
+    return NULL;
+}
+
+int snapshot_load(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return -1;
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+        addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) return -1;
+    map = addr;
+    map_size = (size_t) st.st_size;
+
+    if(parse() != 0) {
+        fprintf(stderr, "[Snapshot] Ignoring malformed snapshot %s\n", path);
+        munmap(addr, map_size);
+        free(listings);
+        free(hot);
+        map = NULL;
+        map_size = 0;
+        listings = NULL;
+        hot = NULL;
+        listing_count = hot_count = 0;
+        return -1;
+    }
+    printf("[Snapshot] Loaded %zu listings and %zu hot files from %s\n",
+           listing_count,
+           hot_count,
+           path);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, warm_fn, NULL) != 0) {
+        fprintf(stderr, "[Snapshot] Could not start the warm-up thread\n");
+    } else {
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+int snapshot_listing(const char* key,
+                     const struct stat* st,
+                     Encoding encoding,
+                     Arena* arena,
+                     const char** body,
+                     size_t* len,
+                     Encoding* used) {
+    for(size_t i = 0; i < listing_count; i++) {
+        const ListingRecord* rec = listings[i];
+        if(rec->encoding != encoding || strcmp(listing_key(rec), key) != 0)
+            continue;
+        if(rec->dev != (uint64_t) st->st_dev ||
+           rec->ino != (uint64_t) st->st_ino ||
+           !same_mtime(rec->mtime_sec, rec->mtime_nsec, st))
+            return -1;
+        char* copy = arena_alloc(arena, rec->body_len);
+        if(!copy) return -1;
+        memcpy(copy, listing_body(rec), rec->body_len);
+        *body = copy;
+        *len = rec->body_len;
+        *used = (Encoding) rec->used;
+        return 0;
+    }
+    return -1;
+}
+
+typedef struct SaveState {
+    FILE* f;
+    uint32_t listings;
+    uint32_t hot;
+    uint64_t size;
+    bool failed;
+    bool* replaced;    // Loaded listings regenerated since
+} SaveState;
+
+static void put(SaveState* s, const void* data, size_t len) {
+    if(fwrite(data, 1, len, s->f) != len) s->failed = true;
+    s->size += len;
+}
+
+// Ends a record
+static void align(SaveState* s) {
+    static const char zeros[8];
+    put(s, zeros, pad8(s->size) - s->size);
+}
+
+static void put_listing(SaveState* s,
+                        const ListingRecord* rec,
+                        const char* key,
+                        const char* body) {
+    put(s, rec, sizeof(*rec));
+    put(s, key, rec->key_len);
+    put(s, body, rec->body_len);
+    align(s);
+    s->listings++;
+}
+
+static void save_cached(void* ctx,
+                        const char* key,
+                        const struct stat* st,
+                        Encoding encoding,
+                        Encoding used,
+                        const char* body,
+                        size_t len) {
+    SaveState* s = ctx;
+    size_t key_len = strlen(key) + 1;
+    if(s->listings >= SNAPSHOT_LISTINGS || len > UINT32_MAX) return;
+    ListingRecord rec = {
+        .dev = (uint64_t) st->st_dev,
+        .ino = (uint64_t) st->st_ino,
+        .mtime_sec = (int64_t) st->st_mtim.tv_sec,
+        .mtime_nsec = (int64_t) st->st_mtim.tv_nsec,
+        .key_len = (uint32_t) key_len,
+        .body_len = (uint32_t) len,
+        .encoding = (uint8_t) encoding,
+        .used = (uint8_t) used,
+    };
+    put_listing(s, &rec, key, body);
+    for(size_t i = 0; i < listing_count; i++) {
+        if(listings[i]->encoding == encoding &&
+           strcmp(listing_key(listings[i]), key) == 0)
+            s->replaced[i] = true;
+    }
+}
+
+static void save_hot(void* ctx, const char* path, const struct stat* st) {
+    SaveState* s = ctx;
+    size_t path_len = strlen(path) + 1;
+    if(s->hot >= SNAPSHOT_HOT) return;
+    HotRecord rec = {
+        .size = (int64_t) st->st_size,
+        .mtime_sec = (int64_t) st->st_mtim.tv_sec,
+        .mtime_nsec = (int64_t) st->st_mtim.tv_nsec,
+        .path_len = (uint32_t) path_len,
+    };
+    put(s, &rec, sizeof(rec));
+    put(s, path, path_len);
+    align(s);
+    s->hot++;
+}
+
+int snapshot_save(const char* path) {
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    SaveState s = {
+        .f = fopen(tmp, "wb"),
+        .replaced = calloc(listing_count + 1, sizeof(bool)),
+    };
+    if(!s.f || !s.replaced) {
+        fprintf(stderr, "[Snapshot] Could not write %s\n", tmp);
+        if(s.f) fclose(s.f);
+        free(s.replaced);
+        return -1;
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    put(&s, &header, sizeof(header));
+
+    // Listings generated in this run, then the loaded ones still unused
+    compress_cache_foreach(save_cached, &s);
+    for(size_t i = 0; i < listing_count; i++) {
+        const ListingRecord* rec = listings[i];
+        if(s.listings >= SNAPSHOT_LISTINGS) break;
+        if(!s.replaced[i])
+            put_listing(&s, rec, listing_key(rec), listing_body(rec));
+    }
+    free(s.replaced);
+    pathcache_foreach_file(save_hot, &s);
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.listings = s.listings;
+    header.hot = s.hot;
+    header.size = s.size;
+    if(fseek(s.f, 0, SEEK_SET) != 0 ||
+       fwrite(&header, sizeof(header), 1, s.f) != 1)
+        s.failed = true;
+    if(fclose(s.f) != 0 || s.failed || rename(tmp, path) != 0) {
+        fprintf(stderr, "[Snapshot] Could not write %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    printf("[Snapshot] Saved %u listings and %u hot files to %s\n",
+           s.listings,
+           s.hot,
+           path);
+    return 0;
+}
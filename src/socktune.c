@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "socktune.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+typedef struct Profile {
+    bool nodelay;
+    int lowat;    // TCP_NOTSENT_LOWAT, 0 for the system default
+} Profile;
+
+static Profile profiles[SOCK_PROFILE_COUNT] = {
+    [SOCK_PROFILE_LATENCY] = {.nodelay = true, .lowat = 0},
+    [SOCK_PROFILE_BULK] = {.nodelay = true, .lowat = SOCKTUNE_LOWAT},
+};
+static const Profile unset = {.nodelay = false, .lowat = 0};
+static const char* const profile_names[SOCK_PROFILE_COUNT] = {"latency",
+                                                              "bulk"};
+static off_t small = SOCKTUNE_SMALL;
+static int sndbuf = 0;
+static int rcvbuf = 0;
+static int defer = SOCKTUNE_DEFER;
+static int fastopen = 0;
+
+// Parses a size with an optional k/m/g suffix, up to INT_MAX
+static int parse_size(const char* str, size_t len, int* out) {
+    char buf[32];
+    if(len == 0 || len >= sizeof(buf) || str[0] == '-') return -1;
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(buf, &end, 10);
+    if(errno != 0 || end == buf) return -1;
+    unsigned long long multiplier = 1;
+    switch(*end) {
+        case 'g':
+        case 'G': multiplier *= 1024;    // fall through
+        case 'm':
+        case 'M': multiplier *= 1024;    // fall through
+        case 'k':
+        case 'K':
+            multiplier *= 1024;
+            end++;
+            break;
+        default: break;
+    }
+    if(*end != '\0' || value > INT_MAX / multiplier) return -1;
+    *out = (int) (value * multiplier);
+    return 0;
+}
+
+static bool key_is(const char* key, size_t len, const char* name) {
+    return strlen(name) == len && memcmp(key, name, len) == 0;
+}
+
+// Sets "<profile>.<option>"
+static int set_profile_option(const char* key, size_t len, int value) {
+    for(int i = 0; i < SOCK_PROFILE_COUNT; i++) {
+        size_t name_len = strlen(profile_names[i]);
+        if(len <= name_len + 1 || key[name_len] != '.' ||
+           memcmp(key, profile_names[i], name_len) != 0)
+            continue;
+        const char* option = key + name_len + 1;
+        size_t option_len = len - name_len - 1;
+        if(key_is(option, option_len, "nodelay") && value <= 1) {
+            profiles[i].nodelay = value == 1;
+            return 0;
+        }
+        if(key_is(option, option_len, "lowat")) {
+            profiles[i].lowat = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int socktune_parse(const char* spec) {
+    const char* p = spec;
+    while(*p) {
+        size_t len = strcspn(p, ",");
+        const char* eq = memchr(p, '=', len);
+        int value;
+        if(!eq || parse_size(eq + 1, len - (size_t) (eq + 1 - p), &value) != 0)
+            return -1;
+        size_t key_len = (size_t) (eq - p);
+
+        if(key_is(p, key_len, "small")) {
+            small = value;
+        } else if(key_is(p, key_len, "sndbuf")) {
+            sndbuf = value;
+        } else if(key_is(p, key_len, "rcvbuf")) {
+            rcvbuf = value;
+        } else if(key_is(p, key_len, "defer")) {
+            defer = value;
+        } else if(key_is(p, key_len, "fastopen")) {
+            fastopen = value;
+        } else if(set_profile_option(p, key_len, value) != 0) {
+            return -1;
+        }
+
+        p += len;
+        if(*p == ',') p++;
+    }
+    return 0;
+}
+
+static void set_option(int fd,
+                       int level,
+                       int name,
+                       int value,
+                       const char* what) {
+    if(setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+        fprintf(stderr,
+                "[Server] Could not set %s: %s\n",
+                what,
+                strerror(errno));
+    }
+}
+
+void socktune_listener(int fd) {
+    // Buffer sizes must be set before listen() to be inherited with the
+    // matching window scale
+    if(sndbuf) set_option(fd, SOL_SOCKET, SO_SNDBUF, sndbuf, "SO_SNDBUF");
+    if(rcvbuf) set_option(fd, SOL_SOCKET, SO_RCVBUF, rcvbuf, "SO_RCVBUF");
+    if(defer) {
+        set_option(fd,
+                   IPPROTO_TCP,
+                   TCP_DEFER_ACCEPT,
+                   defer,
+                   "TCP_DEFER_ACCEPT");
+    }
+    if(fastopen)
+        set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen, "TCP_FASTOPEN");
+}
+
+SockProfile socktune_profile(off_t body_len) {
+    return body_len <= small ? SOCK_PROFILE_LATENCY : SOCK_PROFILE_BULK;
+}
+
+void socktune_apply(int fd, SockProfile* current, SockProfile profile) {
+    if(*current == profile) return;
+    const Profile* from = *current == SOCK_PROFILE_UNSET ? &unset :
+                                                           &profiles[*current];
+    const Profile* to = &profiles[profile];
+    // Errors are ignored: the peer may be gone already, and kernels before
+    // 3.12 lack TCP_NOTSENT_LOWAT
+    if(from->nodelay != to->nodelay) {
+        int value = to->nodelay;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+    }
+    if(from->lowat != to->lowat) {
+        setsockopt(fd,
+                   IPPROTO_TCP,
+                   TCP_NOTSENT_LOWAT,
+                   &to->lowat,
+                   sizeof(to->lowat));
+    }
+    *current = profile;
+}
+
+void socktune_dump(FILE* out) {
+    for(int i = 0; i < SOCK_PROFILE_COUNT; i++) {
+        fprintf(out,
+                "[Server] %-7s profile: nodelay %d, notsent lowat %d\n",
+                profile_names[i],
+                profiles[i].nodelay,
+                profiles[i].lowat);
+    }
+    fprintf(out,
+            "[Server] latency up to %jd B, sndbuf %d, rcvbuf %d, "
+            "defer accept %d s, fastopen %d\n",
+            (intmax_t) small,
+            sndbuf,
+            rcvbuf,
+            defer,
+            fastopen);
+}
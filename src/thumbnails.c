@@ -0,0 +1,440 @@
+#define _DEFAULT_SOURCE
+#include "thumbnails.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "conversion.h"
+
+#define THUMB_QUALITY      5       // MJPEG qscale, 2 (best) to 31
+#define THUMB_NICE         10      // Worker priority below the request threads
+#define THUMB_SEEK_PACKETS 4096    // Packets read after a seek for a keyframe
+
+typedef struct ThumbJob {
+    char path[PATH_MAX];
+    struct ThumbJob* next;
+} ThumbJob;
+
+// Demuxer and decoder state while one file is processed
+typedef struct Thumbnailer {
+    AVFormatContext* fmt;
+    AVCodecContext* dec;
+    AVStream* st;
+    int video;
+    AVPacket* pkt;
+    AVFrame* frame;       // Last decoded keyframe
+    int64_t frame_pts;    // Its pts, AV_NOPTS_VALUE if there is none
+    struct SwsContext* sws;
+    struct timespec next_decode;    // Earliest time of the next decode
+} Thumbnailer;
+
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thumb_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t worker_once = PTHREAD_ONCE_INIT;
+static bool worker_started = false;
+static ThumbJob* queue_head = NULL;
+static ThumbJob* queue_tail = NULL;
+static int queued = 0;
+static char current[PATH_MAX];    // File being processed, "" when idle
+
+// True if a was modified at or after b
+static bool not_older(const struct stat* a, const struct stat* b) {
+    return a->st_mtim.tv_sec > b->st_mtim.tv_sec ||
+           (a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+            a->st_mtim.tv_nsec >= b->st_mtim.tv_nsec);
+}
+
+// Sleeps so that decodes are spaced by 1 / THUMB_RATE seconds.
+static void rate_limit(struct timespec* next) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(now.tv_sec > next->tv_sec ||
+       (now.tv_sec == next->tv_sec && now.tv_nsec >= next->tv_nsec)) {
+        *next = now;
+    } else {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+    }
+    next->tv_nsec += 1000000000L / THUMB_RATE;
+    if(next->tv_nsec >= 1000000000L) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000L;
+    }
+}
+
+static int write_file(const char* path, const void* data, size_t len) {
+    char tmp[PATH_MAX + 64];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    if(!f) return -1;
+    bool ok = fwrite(data, 1, len, f) == len;
+    if(fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int open_input(Thumbnailer* t, const char* path) {
+    av_log_set_level(AV_LOG_QUIET);
+    if(avformat_open_input(&t->fmt, path, NULL, NULL) < 0) return -1;
+    if(avformat_find_stream_info(t->fmt, NULL) < 0) return -1;
+
+    const AVCodec* codec = NULL;
+    t->video =
+        av_find_best_stream(t->fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if(t->video < 0 || !codec) return -1;
+    t->st = t->fmt->streams[t->video];
+    for(unsigned i = 0; i < t->fmt->nb_streams; i++) {
+        if((int) i != t->video) t->fmt->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    t->dec = avcodec_alloc_context3(codec);
+    if(!t->dec || avcodec_parameters_to_context(t->dec, t->st->codecpar) < 0)
+        return -1;
+    t->dec->thread_count = 1;
+    t->dec->skip_frame = AVDISCARD_NONKEY;    // Only keyframes are wanted
+    if(avcodec_open2(t->dec, codec, NULL) < 0) return -1;
+
+    t->pkt = av_packet_alloc();
+    t->frame = av_frame_alloc();
+    return t->pkt && t->frame ? 0 : -1;
+}
+
+static void close_input(Thumbnailer* t) {
+    sws_freeContext(t->sws);
+    av_frame_free(&t->frame);
+    av_packet_free(&t->pkt);
+    avcodec_free_context(&t->dec);
+    if(t->fmt) avformat_close_input(&t->fmt);
+}
+
+// Decodes the keyframe at or before ts (in stream time base) into t->frame.
+// Only that one packet is decoded. Returns 0 on success.
+static int decode_at(Thumbnailer* t, int64_t ts) {
+    if(av_seek_frame(t->fmt, t->video, ts, AVSEEK_FLAG_BACKWARD) < 0)
+        return -1;
+    for(int i = 0; i < THUMB_SEEK_PACKETS; i++) {
+        if(av_read_frame(t->fmt, t->pkt) < 0) return -1;
+        if(t->pkt->stream_index != t->video ||
+           !(t->pkt->flags & AV_PKT_FLAG_KEY)) {
+            av_packet_unref(t->pkt);
+            continue;
+        }
+
+        // With long GOPs several tiles land on the same keyframe
+        int64_t pts = t->pkt->pts;
+        if(pts != AV_NOPTS_VALUE && pts == t->frame_pts) {
+            av_packet_unref(t->pkt);
+            return 0;
+        }
+
+        rate_limit(&t->next_decode);
+        avcodec_flush_buffers(t->dec);
+        av_frame_unref(t->frame);
+        t->frame_pts = AV_NOPTS_VALUE;
+        int ret = avcodec_send_packet(t->dec, t->pkt);
+        av_packet_unref(t->pkt);
+        if(ret < 0) return -1;
+        avcodec_send_packet(t->dec, NULL);    // Drain: output it right away
+        if(avcodec_receive_frame(t->dec, t->frame) < 0) return -1;
+        t->frame_pts = pts;
+        return 0;
+    }
+    return -1;
+}
+
+// Allocates a black YUVJ420P image.
+static AVFrame* new_image(int width, int height) {
+    AVFrame* img = av_frame_alloc();
+    if(!img) return NULL;
+    img->format = AV_PIX_FMT_YUVJ420P;
+    img->width = width;
+    img->height = height;
+    if(av_frame_get_buffer(img, 0) < 0) {
+        av_frame_free(&img);
+        return NULL;
+    }
+    memset(img->data[0], 0, (size_t) img->linesize[0] * height);
+    memset(img->data[1], 128, (size_t) img->linesize[1] * (height / 2));
+    memset(img->data[2], 128, (size_t) img->linesize[2] * (height / 2));
+    return img;
+}
+
+// Scales the current keyframe into the w x h area of img at (x, y), both
+// even so the chroma planes line up.
+static int scale_into(Thumbnailer* t,
+                      AVFrame* img,
+                      int x,
+                      int y,
+                      int w,
+                      int h) {
+    const AVFrame* f = t->frame;
+    t->sws = sws_getCachedContext(t->sws,
+                                  f->width,
+                                  f->height,
+                                  (enum AVPixelFormat) f->format,
+                                  w,
+                                  h,
+                                  AV_PIX_FMT_YUVJ420P,
+                                  SWS_BILINEAR,
+                                  NULL,
+                                  NULL,
+                                  NULL);
+    if(!t->sws) return -1;
+    uint8_t* planes[4] = {
+        img->data[0] + y * img->linesize[0] + x,
+        img->data[1] + y / 2 * img->linesize[1] + x / 2,
+        img->data[2] + y / 2 * img->linesize[2] + x / 2,
+        NULL,
+    };
+    int strides[4] = {img->linesize[0], img->linesize[1], img->linesize[2], 0};
+    sws_scale(t->sws,
+              (const uint8_t* const*) f->data,
+              f->linesize,
+              0,
+              f->height,
+              planes,
+              strides);
+    return 0;
+}
+
+static int write_jpeg(AVFrame* img, const char* path) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    AVCodecContext* enc = codec ? avcodec_alloc_context3(codec) : NULL;
+    if(!enc) return -1;
+    enc->width = img->width;
+    enc->height = img->height;
+    enc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    enc->time_base = (AVRational) {1, 25};
+    enc->flags |= AV_CODEC_FLAG_QSCALE;
+    enc->global_quality = THUMB_QUALITY * FF_QP2LAMBDA;
+    img->quality = enc->global_quality;
+    img->pts = 0;
+
+    int ret = -1;
+    AVPacket* pkt = av_packet_alloc();
+    if(pkt && avcodec_open2(enc, codec, NULL) >= 0 &&
+       avcodec_send_frame(enc, img) >= 0 &&
+       avcodec_send_frame(enc, NULL) >= 0 &&
+       avcodec_receive_packet(enc, pkt) >= 0) {
+        ret = write_file(path, pkt->data, (size_t) pkt->size);
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    avcodec_free_context(&enc);
+    return ret;
+}
+
+// WebVTT timestamp, hh:mm:ss.ttt
+static void vtt_time(char* dest, size_t len, double seconds) {
+    long ms = (long) (seconds * 1000.0 + 0.5);
+    snprintf(dest,
+             len,
+             "%02ld:%02ld:%02ld.%03ld",
+             ms / 3600000,
+             ms / 60000 % 60,
+             ms / 1000 % 60,
+             ms % 1000);
+}
+
+static int64_t stream_ts(const Thumbnailer* t, double seconds) {
+    int64_t start =
+        t->st->start_time != AV_NOPTS_VALUE ? t->st->start_time : 0;
+    return start + av_rescale_q((int64_t) (seconds * 1000.0),
+                                (AVRational) {1, 1000},
+                                t->st->time_base);
+}
+
+// Writes the poster, the sprite sheets and, last, the WebVTT track into dir.
+static int build_thumbnails(Thumbnailer* t, const char* dir) {
+    const AVCodecParameters* par = t->st->codecpar;
+    double duration = (double) t->fmt->duration / AV_TIME_BASE;
+    if(par->width <= 0 || par->height <= 0 || duration <= 0) return -1;
+
+    int tile_w = THUMB_WIDTH;
+    int tile_h = (THUMB_WIDTH * par->height / par->width + 1) & ~1;
+    double interval = duration / THUMB_MAX > THUMB_INTERVAL ?
+                          duration / THUMB_MAX :
+                          THUMB_INTERVAL;
+    int tiles = (int) (duration / interval);
+    if(tiles * interval < duration) tiles++;
+
+    // Room for dir (under PATH_MAX) and the longest file name
+    char path[PATH_MAX + 64];
+    if(decode_at(t, stream_ts(t, duration / 10)) == 0) {
+        int poster_h = (THUMB_POSTER * par->height / par->width + 1) & ~1;
+        AVFrame* poster = new_image(THUMB_POSTER, poster_h);
+        snprintf(path, sizeof(path), "%s/poster.jpg", dir);
+        if(poster && scale_into(t, poster, 0, 0, THUMB_POSTER, poster_h) == 0)
+            write_jpeg(poster, path);
+        av_frame_free(&poster);
+    }
+
+    char vtt_tmp[PATH_MAX + 64];
+    snprintf(vtt_tmp, sizeof(vtt_tmp), "%s/thumbnails.vtt.tmp", dir);
+    FILE* vtt = fopen(vtt_tmp, "w");
+    if(!vtt) return -1;
+    fputs("WEBVTT\n\n", vtt);
+
+    int per_sheet = THUMB_COLUMNS * THUMB_ROWS;
+    int ret = 0;
+    for(int sheet = 0; sheet * per_sheet < tiles && ret == 0; sheet++) {
+        int count = tiles - sheet * per_sheet;
+        if(count > per_sheet) count = per_sheet;
+        int cols = count < THUMB_COLUMNS ? count : THUMB_COLUMNS;
+        int rows = (count + THUMB_COLUMNS - 1) / THUMB_COLUMNS;
+        AVFrame* sprite = new_image(cols * tile_w, rows * tile_h);
+        if(!sprite) {
+            ret = -1;
+            break;
+        }
+
+        for(int i = 0; i < count; i++) {
+            double from = (sheet * per_sheet + i) * interval;
+            double to = from + interval < duration ? from + interval : duration;
+            int x = i % THUMB_COLUMNS * tile_w, y = i / THUMB_COLUMNS * tile_h;
+
+            // A failed seek repeats the previous keyframe, or stays black
+            decode_at(t, stream_ts(t, from));
+            if(t->frame_pts != AV_NOPTS_VALUE)
+                scale_into(t, sprite, x, y, tile_w, tile_h);
+
+            char start[32], end[32];
+            vtt_time(start, sizeof(start), from);
+            vtt_time(end, sizeof(end), to);
+            fprintf(vtt,
+                    "%s --> %s\nsprite_%03d.jpg#xywh=%d,%d,%d,%d\n\n",
+                    start,
+                    end,
+                    sheet,
+                    x,
+                    y,
+                    tile_w,
+                    tile_h);
+        }
+
+        snprintf(path, sizeof(path), "%s/sprite_%03d.jpg", dir, sheet);
+        ret = write_jpeg(sprite, path);
+        av_frame_free(&sprite);
+    }
+
+    snprintf(path, sizeof(path), "%s/thumbnails.vtt", dir);
+    if(fclose(vtt) != 0 || ret != 0 || rename(vtt_tmp, path) != 0) {
+        unlink(vtt_tmp);
+        return -1;
+    }
+    compress_file(path);
+    return 0;
+}
+
+static int make_thumbnails(const char* path) {
+    // The parent ("<source>.hls" or the conversion's directory) first
+    char dir[PATH_MAX];
+    conversion_thumb_dir(path, dir);
+    char* slash = strrchr(dir, '/');
+    *slash = '\0';
+    mkdir(dir, 0755);
+    *slash = '/';
+    mkdir(dir, 0755);
+
+    Thumbnailer t = {.video = -1, .frame_pts = AV_NOPTS_VALUE};
+    int ret = open_input(&t, path);
+    if(ret == 0) ret = build_thumbnails(&t, dir);
+    close_input(&t);
+
+    if(ret != 0) {
+        char error_file[PATH_MAX + 32];
+        snprintf(error_file, sizeof(error_file), "%s/error.txt", dir);
+        FILE* f = fopen(error_file, "w");
+        if(f) {
+            fprintf(f, "Failed\n");
+            fclose(f);
+        }
+    }
+    return ret;
+}
+
+static void* thumb_worker(void* arg) {
+    (void) arg;
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), THUMB_NICE);
+
+    pthread_mutex_lock(&thumb_lock);
+    for(;;) {
+        while(!queue_head) pthread_cond_wait(&thumb_cond, &thumb_lock);
+        ThumbJob* job = queue_head;
+        queue_head = job->next;
+        if(!queue_head) queue_tail = NULL;
+        queued--;
+        snprintf(current, sizeof(current), "%s", job->path);
+        pthread_mutex_unlock(&thumb_lock);
+
+        if(make_thumbnails(job->path) == 0) {
+            printf("[Thumbs] Generated: %s\n", job->path);
+        } else {
+            fprintf(stderr, "[Thumbs] Failed: %s\n", job->path);
+        }
+        free(job);
+
+        pthread_mutex_lock(&thumb_lock);
+        current[0] = '\0';
+    }
+    return NULL;
+}
+
+static void start_worker(void) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, thumb_worker, NULL) != 0) {
+        fprintf(stderr, "[Thumbs] Could not start the worker thread\n");
+        return;
+    }
+    pthread_detach(thread);
+    worker_started = true;
+}
+
+int thumb_request(const char* path, const struct stat* st) {
+    char dir[PATH_MAX];
+    char file[PATH_MAX + 32];
+    struct stat out;
+    conversion_thumb_dir(path, dir);
+    snprintf(file, sizeof(file), "%s/thumbnails.vtt", dir);
+    if(stat(file, &out) == 0 && not_older(&out, st)) return 0;
+    snprintf(file, sizeof(file), "%s/error.txt", dir);
+    if(stat(file, &out) == 0 && not_older(&out, st)) return -1;
+
+    pthread_once(&worker_once, start_worker);
+    if(!worker_started) return -1;
+
+    pthread_mutex_lock(&thumb_lock);
+    bool known = strcmp(current, path) == 0;
+    for(ThumbJob* job = queue_head; job && !known; job = job->next) {
+        known = strcmp(job->path, path) == 0;
+    }
+    // A full queue drops the request, the next listing asks again
+    if(!known && queued < THUMB_QUEUE) {
+        ThumbJob* job = calloc(1, sizeof(ThumbJob));
+        if(job) {
+            snprintf(job->path, sizeof(job->path), "%s", path);
+            if(queue_tail) queue_tail->next = job;
+            else
+                queue_head = job;
+            queue_tail = job;
+            queued++;
+            pthread_cond_signal(&thumb_cond);
+        }
+    }
+    pthread_mutex_unlock(&thumb_lock);
+    return 1;
+}
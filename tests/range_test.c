@@ -0,0 +1,133 @@
+// Range header parsing and the responses built from it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "pathcache.h"
+#include "site.h"
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if(!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            failures++;                                                     \
+        }                                                                   \
+    } while(0)
+
+static void check_parse(void) {
+    off_t start, end;
+    CHECK(getcontentrange("bytes=10-20", &start, &end) == 0);
+    CHECK(start == 10 && end == 20);
+    CHECK(getcontentrange("bytes=10-", &start, &end) == 0);
+    CHECK(start == 10 && end == -1);
+    CHECK(getcontentrange("bytes=-500", &start, &end) == 0);
+    CHECK(start == -1 && end == 500);
+    CHECK(getcontentrange("bytes=0-1,5-6", &start, &end) == 0);
+    CHECK(start == 0 && end == 1);
+
+    CHECK(getcontentrange("bytes=20-10", &start, &end) == -1);
+    CHECK(getcontentrange("bytes=-", &start, &end) == -1);
+    CHECK(getcontentrange("bytes=x-1", &start, &end) == -1);
+    CHECK(getcontentrange("bytes=1-2x", &start, &end) == -1);
+    CHECK(getcontentrange("items=1-2", &start, &end) == -1);
+    CHECK(getcontentrange("bytes=99999999999999999999-", &start, &end) == -1);
+}
+
+static void check_normalize(void) {
+    off_t start = 10, end = -1;
+    CHECK(normalizeranges(&start, &end, 100) == 0);
+    CHECK(start == 10 && end == 99);
+    start = 10, end = 1000;
+    CHECK(normalizeranges(&start, &end, 100) == 0);
+    CHECK(start == 10 && end == 99);
+    start = 99, end = -1;
+    CHECK(normalizeranges(&start, &end, 100) == 0);
+    CHECK(start == 99 && end == 99);
+
+    // Suffix ranges, longer than the body included
+    start = -1, end = 30;
+    CHECK(normalizeranges(&start, &end, 100) == 0);
+    CHECK(start == 70 && end == 99);
+    start = -1, end = 500;
+    CHECK(normalizeranges(&start, &end, 100) == 0);
+    CHECK(start == 0 && end == 99);
+
+    // Unsatisfiable
+    start = 100, end = -1;
+    CHECK(normalizeranges(&start, &end, 100) == -1);
+    start = 999999999, end = -1;
+    CHECK(normalizeranges(&start, &end, 100) == -1);
+    start = -1, end = 0;
+    CHECK(normalizeranges(&start, &end, 100) == -1);
+    start = 0, end = -1;
+    CHECK(normalizeranges(&start, &end, 0) == -1);
+}
+
+// Serves /data.bin (100 bytes) with the given Range header
+static void get(Arena* arena, const char* range, Response* resp) {
+    Request req;
+    request_init(&req);
+    char target[] = "/data.bin";
+    CHECK(request_set_target(&req, arena, target, strlen(target)) == 0);
+    request_add_header(&req, arena, "Range", range);
+    handle_request(&req, arena, resp);
+}
+
+static void check_responses(void) {
+    char dir[] = "/tmp/range_test.XXXXXX";
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        failures++;
+        return;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "%s/data.bin", dir);
+    FILE* f = fopen(path, "w");
+    for(int i = 0; i < 100; i++) fputc(i, f);
+    fclose(f);
+    CHECK(pathcache_init(dir, 0) == 0);
+
+    Arena arena;
+    arena_init(&arena, ARENA_BLOCK_SIZE);
+    Response resp;
+
+    get(&arena, "bytes=90-", &resp);
+    CHECK(resp.status == 206);
+    CHECK(resp.file_offset == 90 && resp.file_len == 10);
+    CHECK(strstr(resp.headers, "Content-Range: bytes 90-99/100\r\n"));
+    pathcache_release(&resp.file);
+
+    get(&arena, "bytes=-500", &resp);
+    CHECK(resp.status == 206);
+    CHECK(resp.file_offset == 0 && resp.file_len == 100);
+    pathcache_release(&resp.file);
+
+    get(&arena, "bytes=-25", &resp);
+    CHECK(resp.status == 206);
+    CHECK(resp.file_offset == 75 && resp.file_len == 25);
+    pathcache_release(&resp.file);
+
+    get(&arena, "bytes=100-", &resp);
+    CHECK(resp.status == 416);
+    CHECK(resp.file.fd < 0 && resp.body_len == 0);
+    CHECK(strstr(resp.headers, "Content-Range: bytes */100\r\n"));
+
+    get(&arena, "bytes=999999999-", &resp);
+    CHECK(resp.status == 416);
+
+    arena_free(&arena);
+    unlink(path);
+    rmdir(dir);
+}
+
+int main(void) {
+    check_parse();
+    check_normalize();
+    check_responses();
+    if(failures) fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}